@@ -28,8 +28,9 @@
  * several operations that get added by its add() method. It gets committed
  * with commit(), and rolled back with rollback().
  *
- * There rest of the module's functions are related to file checking, at the
- * moment only jfsck(), which is just a wrapper to the real C functions.
+ * The rest of the module's functions are commit_many(), to commit many
+ * transactions at once, and jfsck() for file checking; they're just wrappers
+ * to the real C functions.
  */
 
 /*
@@ -211,20 +212,30 @@ The buffers must be objects that support slice assignment, like bytearray\n\
 Only available in Python >= 2.6.\n\
 It's a wrapper to jreadv().\n");
 
+/* preadv */
+PyDoc_STRVAR(jf_preadv__doc,
+"preadv([buf1, buf2, ...], offset)\n\
+\n\
+Reads the data from the file at the given offset into the different buffers,\n\
+like readv(); returns the number of bytes written.\n\
+Only available in Python >= 2.6.\n\
+It's a wrapper to jpreadv().\n");
+
 /* readv requires the new Py_buffer interface, which is only available in
  * Python >= 2.6 */
 #if PY_MAJOR_VERSION >= 3 || (PY_MAJOR_VERSION == 2 && PY_MINOR_VERSION >= 6)
-static PyObject *jf_readv(jfile_object *fp, PyObject *args)
+
+/* common code for readv and preadv; offset is only used if use_offset is
+ * set */
+static PyObject *readv_common(jfile_object *fp, PyObject *buffers,
+		int use_offset, long long offset)
 {
 	ssize_t rv;
-	PyObject *buffers, *buf;
+	PyObject *buf;
 	Py_buffer *views = NULL;
 	ssize_t len, pos = 0;
 	struct iovec *iov = NULL;
 
-	if (!PyArg_ParseTuple(args, "O:readv", &buffers))
-		return NULL;
-
 	len = PySequence_Length(buffers);
 	if (len < 0) {
 		PyErr_SetString(PyExc_TypeError, "iterable expected");
@@ -260,7 +271,10 @@ static PyObject *jf_readv(jfile_object *fp, PyObject *args)
 	}
 
 	Py_BEGIN_ALLOW_THREADS
-	rv = jreadv(fp->fs, iov, len);
+	if (use_offset)
+		rv = jpreadv(fp->fs, iov, len, offset);
+	else
+		rv = jreadv(fp->fs, iov, len);
 	Py_END_ALLOW_THREADS
 
 	for (pos = 0; pos < len; pos++) {
@@ -289,6 +303,27 @@ error:
 	return NULL;
 }
 
+static PyObject *jf_readv(jfile_object *fp, PyObject *args)
+{
+	PyObject *buffers;
+
+	if (!PyArg_ParseTuple(args, "O:readv", &buffers))
+		return NULL;
+
+	return readv_common(fp, buffers, 0, 0);
+}
+
+static PyObject *jf_preadv(jfile_object *fp, PyObject *args)
+{
+	PyObject *buffers;
+	long long offset;
+
+	if (!PyArg_ParseTuple(args, "OL:preadv", &buffers, &offset))
+		return NULL;
+
+	return readv_common(fp, buffers, 1, offset);
+}
+
 #else
 
 static PyObject *jf_readv(jfile_object *fp, PyObject *args)
@@ -298,6 +333,13 @@ static PyObject *jf_readv(jfile_object *fp, PyObject *args)
 	return NULL;
 }
 
+static PyObject *jf_preadv(jfile_object *fp, PyObject *args)
+{
+	PyErr_SetString(PyExc_NotImplementedError,
+			"only supported in Python >= 2.6");
+	return NULL;
+}
+
 #endif /* python version >= 2.6 */
 
 /* write */
@@ -369,16 +411,16 @@ number of bytes written.\n\
 The buffers must be strings or string-alike objects, like str or bytes.\n\
 It's a wrapper to jwritev().\n");
 
-static PyObject *jf_writev(jfile_object *fp, PyObject *args)
+/* common code for writev and pwritev; offset is only used if use_offset is
+ * set */
+static PyObject *writev_common(jfile_object *fp, PyObject *buffers,
+		int use_offset, long long offset)
 {
 	ssize_t rv;
-	PyObject *buffers, *buf;
+	PyObject *buf;
 	ssize_t len, pos;
 	struct iovec *iov;
 
-	if (!PyArg_ParseTuple(args, "O:writev", &buffers))
-		return NULL;
-
 	len = PySequence_Length(buffers);
 	if (len < 0) {
 		PyErr_SetString(PyExc_TypeError, "iterable expected");
@@ -403,7 +445,10 @@ static PyObject *jf_writev(jfile_object *fp, PyObject *args)
 	}
 
 	Py_BEGIN_ALLOW_THREADS
-	rv = jwritev(fp->fs, iov, len);
+	if (use_offset)
+		rv = jpwritev(fp->fs, iov, len, offset);
+	else
+		rv = jwritev(fp->fs, iov, len);
 	Py_END_ALLOW_THREADS
 
 	free(iov);
@@ -414,6 +459,36 @@ static PyObject *jf_writev(jfile_object *fp, PyObject *args)
 	return Our_PyLong_FromSsize_t(rv);
 }
 
+static PyObject *jf_writev(jfile_object *fp, PyObject *args)
+{
+	PyObject *buffers;
+
+	if (!PyArg_ParseTuple(args, "O:writev", &buffers))
+		return NULL;
+
+	return writev_common(fp, buffers, 0, 0);
+}
+
+/* pwritev */
+PyDoc_STRVAR(jf_pwritev__doc,
+"pwritev([buf1, buf2, ...], offset)\n\
+\n\
+Writes the data contained in the different buffers to the file at the given\n\
+offset, atomically; returns the number of bytes written.\n\
+The buffers must be strings or string-alike objects, like str or bytes.\n\
+It's a wrapper to jpwritev().\n");
+
+static PyObject *jf_pwritev(jfile_object *fp, PyObject *args)
+{
+	PyObject *buffers;
+	long long offset;
+
+	if (!PyArg_ParseTuple(args, "OL:pwritev", &buffers, &offset))
+		return NULL;
+
+	return writev_common(fp, buffers, 1, offset);
+}
+
 /* truncate */
 PyDoc_STRVAR(jf_truncate__doc,
 "truncate(length)\n\
@@ -572,6 +647,107 @@ static PyObject *jf_autosync_stop(jfile_object *fp, PyObject *args)
 	return PyLong_FromLong(rv);
 }
 
+/* durable_lsn */
+PyDoc_STRVAR(jf_durable_lsn__doc,
+"durable_lsn()\n\
+\n\
+Returns the durable LSN of the file.\n\
+It's a wrapper to jfs_durable_lsn().\n");
+
+static PyObject *jf_durable_lsn(jfile_object *fp, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":durable_lsn"))
+		return NULL;
+
+	return PyLong_FromUnsignedLongLong(jfs_durable_lsn(fp->fs));
+}
+
+/* wait_durable */
+PyDoc_STRVAR(jf_wait_durable__doc,
+"wait_durable(lsn[, timeout_ms])\n\
+\n\
+Waits until the given LSN is durable, for at most timeout_ms milliseconds\n\
+if it's given and not negative. Returns True if it's durable, False if the\n\
+timeout expired first.\n\
+It's a wrapper to jfs_wait_durable().\n");
+
+static PyObject *jf_wait_durable(jfile_object *fp, PyObject *args)
+{
+	int rv;
+	unsigned long long lsn;
+	long timeout_ms = -1;
+
+	if (!PyArg_ParseTuple(args, "K|l:wait_durable", &lsn, &timeout_ms))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfs_wait_durable(fp->fs, lsn, timeout_ms);
+	Py_END_ALLOW_THREADS
+
+	return PyBool_FromLong(rv == 0);
+}
+
+/* durable_eventfd */
+PyDoc_STRVAR(jf_durable_eventfd__doc,
+"durable_eventfd()\n\
+\n\
+Returns a file descriptor that becomes readable when the durable LSN\n\
+advances. It's closed when the file is closed.\n\
+It's a wrapper to jfs_durable_eventfd().\n");
+
+static PyObject *jf_durable_eventfd(jfile_object *fp, PyObject *args)
+{
+	int rv;
+
+	if (!PyArg_ParseTuple(args, ":durable_eventfd"))
+		return NULL;
+
+	rv = jfs_durable_eventfd(fp->fs);
+	if (rv < 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return PyLong_FromLong(rv);
+}
+
+/* budget_stats */
+PyDoc_STRVAR(jf_budget_stats__doc,
+"budget_stats()\n\
+\n\
+Returns a dictionary with the memory and file descriptor accounting of the\n\
+file (equivalent to the 'struct jfs_budget_stats').\n\
+It's a wrapper to jfs_budget_stats().\n");
+
+static PyObject *jf_budget_stats(jfile_object *fp, PyObject *args)
+{
+	PyObject *dict;
+	struct jfs_budget_stats st;
+
+	if (!PyArg_ParseTuple(args, ":budget_stats"))
+		return NULL;
+
+	dict = PyDict_New();
+	if (dict == NULL)
+		return PyErr_NoMemory();
+
+	jfs_budget_stats(fp->fs, &st);
+
+	PyDict_SetItemString(dict, "mem_used", PyLong_FromSize_t(st.mem_used));
+	PyDict_SetItemString(dict, "mem_peak", PyLong_FromSize_t(st.mem_peak));
+	PyDict_SetItemString(dict, "mem_budget",
+			PyLong_FromSize_t(st.mem_budget));
+	PyDict_SetItemString(dict, "mem_waits",
+			PyLong_FromUnsignedLongLong(st.mem_waits));
+	PyDict_SetItemString(dict, "mem_failures",
+			PyLong_FromUnsignedLongLong(st.mem_failures));
+	PyDict_SetItemString(dict, "fds_used", PyLong_FromLong(st.fds_used));
+	PyDict_SetItemString(dict, "fds_peak", PyLong_FromLong(st.fds_peak));
+	PyDict_SetItemString(dict, "fd_budget", PyLong_FromLong(st.fd_budget));
+	PyDict_SetItemString(dict, "early_syncs",
+			PyLong_FromUnsignedLongLong(st.early_syncs));
+
+	return dict;
+}
+
 /* new_trans */
 PyDoc_STRVAR(jf_new_trans__doc,
 "new_trans()\n\
@@ -597,6 +773,8 @@ static PyObject *jf_new_trans(jfile_object *fp, PyObject *args)
 
 	tp->ts = jtrans_new(fp->fs, flags);
 	if(tp->ts == NULL) {
+		if (errno == EINVAL)
+			return PyErr_SetFromErrno(PyExc_IOError);
 		return PyErr_NoMemory();
 	}
 
@@ -610,15 +788,198 @@ static PyObject *jf_new_trans(jfile_object *fp, PyObject *args)
 	return (PyObject *) tp;
 }
 
+/* fread */
+PyDoc_STRVAR(jf_fread__doc,
+"fread(size)\n\
+\n\
+Read at most size bytes from a file opened with fopen(), going through its\n\
+buffer, returns the string with the contents.\n\
+It's a wrapper to jfread().\n");
+
+static PyObject *jf_fread(jfile_object *fp, PyObject *args)
+{
+	size_t rv;
+	ssize_t len;
+	unsigned char *buf;
+	PyObject *r;
+
+	if (!PyArg_ParseTuple(args, "n:fread", &len))
+		return NULL;
+
+	if (len < 0) {
+		PyErr_SetString(PyExc_TypeError, "len must be >= 0");
+		return NULL;
+	}
+
+	buf = malloc(len);
+	if (buf == NULL)
+		return PyErr_NoMemory();
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfread(buf, 1, len, fp->fs);
+	Py_END_ALLOW_THREADS
+
+#ifdef PYTHON3
+	r = PyBytes_FromStringAndSize((char *) buf, rv);
+#elif PYTHON2
+	r = PyString_FromStringAndSize((char *) buf, rv);
+#endif
+
+	free(buf);
+	return r;
+}
+
+/* fwrite */
+PyDoc_STRVAR(jf_fwrite__doc,
+"fwrite(buf)\n\
+\n\
+Write the contents of the given buffer (a string) to a file opened with\n\
+fopen(), going through its buffer, returns the number of bytes written.\n\
+It's a wrapper to jfwrite().\n");
+
+static PyObject *jf_fwrite(jfile_object *fp, PyObject *args)
+{
+	size_t rv;
+	unsigned char *buf;
+	ssize_t len;
+
+	if (!PyArg_ParseTuple(args, "s#:fwrite", &buf, &len))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfwrite(buf, 1, len, fp->fs);
+	Py_END_ALLOW_THREADS
+
+	return Our_PyLong_FromSsize_t(rv);
+}
+
+/* fflush */
+PyDoc_STRVAR(jf_fflush__doc,
+"fflush()\n\
+\n\
+Write the data buffered by a file opened with fopen().\n\
+It's a wrapper to jfflush().\n");
+
+static PyObject *jf_fflush(jfile_object *fp, PyObject *args)
+{
+	int rv;
+
+	if (!PyArg_ParseTuple(args, ":fflush"))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfflush(fp->fs);
+	Py_END_ALLOW_THREADS
+
+	if (rv != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	Py_RETURN_NONE;
+}
+
+/* fseek */
+PyDoc_STRVAR(jf_fseek__doc,
+"fseek(offset, whence)\n\
+\n\
+Reposition a file opened with fopen(), writing what it has buffered first;\n\
+whence is like in lseek().\n\
+It's a wrapper to jfseek().\n");
+
+static PyObject *jf_fseek(jfile_object *fp, PyObject *args)
+{
+	int rv;
+	int whence;
+	long offset;
+
+	if (!PyArg_ParseTuple(args, "li:fseek", &offset, &whence))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfseek(fp->fs, offset, whence);
+	Py_END_ALLOW_THREADS
+
+	if (rv != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	Py_RETURN_NONE;
+}
+
+/* ftell */
+PyDoc_STRVAR(jf_ftell__doc,
+"ftell()\n\
+\n\
+Return the position of a file opened with fopen(), taking its buffer into\n\
+account.\n\
+It's a wrapper to jftell().\n");
+
+static PyObject *jf_ftell(jfile_object *fp, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":ftell"))
+		return NULL;
+
+	return PyLong_FromLong(jftell(fp->fs));
+}
+
+/* ferror */
+PyDoc_STRVAR(jf_ferror__doc,
+"ferror()\n\
+\n\
+Return True if an operation on a file opened with fopen() has failed.\n\
+It's a wrapper to jferror().\n");
+
+static PyObject *jf_ferror(jfile_object *fp, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":ferror"))
+		return NULL;
+
+	return PyBool_FromLong(jferror(fp->fs));
+}
+
+/* fclose */
+PyDoc_STRVAR(jf_fclose__doc,
+"fclose()\n\
+\n\
+Write the data buffered by a file opened with fopen(), and close it; the\n\
+object can't be used afterwards.\n\
+It's a wrapper to jfclose().\n");
+
+static PyObject *jf_fclose(jfile_object *fp, PyObject *args)
+{
+	int rv;
+	jfs_t *fs;
+
+	if (!PyArg_ParseTuple(args, ":fclose"))
+		return NULL;
+
+	if (fp->fs == NULL) {
+		PyErr_SetString(PyExc_ValueError, "the file is closed");
+		return NULL;
+	}
+
+	fs = fp->fs;
+	fp->fs = NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = jfclose(fs);
+	Py_END_ALLOW_THREADS
+
+	if (rv != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	Py_RETURN_NONE;
+}
+
 /* method table */
 static PyMethodDef jfile_methods[] = {
 	{ "fileno", (PyCFunction) jf_fileno, METH_VARARGS, jf_fileno__doc },
 	{ "read", (PyCFunction) jf_read, METH_VARARGS, jf_read__doc },
 	{ "pread", (PyCFunction) jf_pread, METH_VARARGS, jf_pread__doc },
 	{ "readv", (PyCFunction) jf_readv, METH_VARARGS, jf_readv__doc },
+	{ "preadv", (PyCFunction) jf_preadv, METH_VARARGS, jf_preadv__doc },
 	{ "write", (PyCFunction) jf_write, METH_VARARGS, jf_write__doc },
 	{ "pwrite", (PyCFunction) jf_pwrite, METH_VARARGS, jf_pwrite__doc },
 	{ "writev", (PyCFunction) jf_writev, METH_VARARGS, jf_writev__doc },
+	{ "pwritev", (PyCFunction) jf_pwritev, METH_VARARGS, jf_pwritev__doc },
 	{ "truncate", (PyCFunction) jf_truncate, METH_VARARGS,
 		jf_truncate__doc },
 	{ "lseek", (PyCFunction) jf_lseek, METH_VARARGS, jf_lseek__doc },
@@ -629,8 +990,23 @@ static PyMethodDef jfile_methods[] = {
 		jf_autosync_start__doc },
 	{ "autosync_stop", (PyCFunction) jf_autosync_stop, METH_VARARGS,
 		jf_autosync_stop__doc },
+	{ "durable_lsn", (PyCFunction) jf_durable_lsn, METH_VARARGS,
+		jf_durable_lsn__doc },
+	{ "wait_durable", (PyCFunction) jf_wait_durable, METH_VARARGS,
+		jf_wait_durable__doc },
+	{ "durable_eventfd", (PyCFunction) jf_durable_eventfd, METH_VARARGS,
+		jf_durable_eventfd__doc },
+	{ "budget_stats", (PyCFunction) jf_budget_stats, METH_VARARGS,
+		jf_budget_stats__doc },
 	{ "new_trans", (PyCFunction) jf_new_trans, METH_VARARGS,
 		jf_new_trans__doc },
+	{ "fread", (PyCFunction) jf_fread, METH_VARARGS, jf_fread__doc },
+	{ "fwrite", (PyCFunction) jf_fwrite, METH_VARARGS, jf_fwrite__doc },
+	{ "fflush", (PyCFunction) jf_fflush, METH_VARARGS, jf_fflush__doc },
+	{ "fseek", (PyCFunction) jf_fseek, METH_VARARGS, jf_fseek__doc },
+	{ "ftell", (PyCFunction) jf_ftell, METH_VARARGS, jf_ftell__doc },
+	{ "ferror", (PyCFunction) jf_ferror, METH_VARARGS, jf_ferror__doc },
+	{ "fclose", (PyCFunction) jf_fclose, METH_VARARGS, jf_fclose__doc },
 	{ NULL }
 };
 
@@ -709,7 +1085,46 @@ static PyObject *jt_add_w(jtrans_object *tp, PyObject *args)
 		return NULL;
 	}
 
+	/* it can wait for the memory budget */
+	Py_BEGIN_ALLOW_THREADS
 	rv = jtrans_add_w(tp->ts, buf, len, offset);
+	Py_END_ALLOW_THREADS
+
+	if (rv < 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return PyLong_FromLong(rv);
+}
+
+/* add_w_fd */
+PyDoc_STRVAR(jt_add_w_fd__doc,
+"add_w_fd(fd, src_offset, length, offset)\n\
+\n\
+Add an operation to write length bytes of the file descriptor fd, taken\n\
+from src_offset, at the given offset to the transaction.\n\
+It's a wrapper to jtrans_add_w_fd().\n");
+
+static PyObject *jt_add_w_fd(jtrans_object *tp, PyObject *args)
+{
+	int rv, fd;
+	long long src_offset, offset;
+	Py_ssize_t len;
+
+	if (!PyArg_ParseTuple(args, "iLnL:add_w_fd", &fd, &src_offset, &len,
+				&offset))
+		return NULL;
+
+	if (src_offset < 0 || offset < 0 || len < 0) {
+		PyErr_SetString(PyExc_TypeError,
+				"offsets and length must be >= 0");
+		return NULL;
+	}
+
+	/* it can wait for the memory budget */
+	Py_BEGIN_ALLOW_THREADS
+	rv = jtrans_add_w_fd(tp->ts, fd, src_offset, len, offset);
+	Py_END_ALLOW_THREADS
+
 	if (rv < 0)
 		return PyErr_SetFromErrno(PyExc_IOError);
 
@@ -845,12 +1260,73 @@ static PyObject *jt_rollback(jtrans_object *tp, PyObject *args)
 	return Our_PyLong_FromSsize_t(rv);
 }
 
+/* elided */
+PyDoc_STRVAR(jt_elided__doc,
+"elided()\n\
+\n\
+Returns how many bytes the last commit didn't write because they were\n\
+already on disk.\n\
+It's a wrapper to jtrans_elided().\n");
+
+static PyObject *jt_elided(jtrans_object *tp, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":elided"))
+		return NULL;
+
+	return PyLong_FromSize_t(jtrans_elided(tp->ts));
+}
+
+/* lsn */
+PyDoc_STRVAR(jt_lsn__doc,
+"lsn()\n\
+\n\
+Returns the LSN of the last commit, or 0 if it didn't use the journal.\n\
+It's a wrapper to jtrans_lsn().\n");
+
+static PyObject *jt_lsn(jtrans_object *tp, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":lsn"))
+		return NULL;
+
+	return PyLong_FromUnsignedLongLong(jtrans_lsn(tp->ts));
+}
+
+/* reset */
+PyDoc_STRVAR(jt_reset__doc,
+"reset()\n\
+\n\
+Removes all the operations of the transaction, so it can be reused.\n\
+It's a wrapper to jtrans_reset().\n");
+
+static PyObject *jt_reset(jtrans_object *tp, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":reset"))
+		return NULL;
+
+	jtrans_reset(tp->ts);
+
+	/* the read operations are gone, so are their buffers */
+	while (tp->nviews) {
+		PyBuffer_Release(tp->views[tp->nviews - 1]);
+		free(tp->views[tp->nviews - 1]);
+		tp->nviews--;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
 /* method table */
 static PyMethodDef jtrans_methods[] = {
 	{ "add_r", (PyCFunction) jt_add_r, METH_VARARGS, jt_add_r__doc },
 	{ "add_w", (PyCFunction) jt_add_w, METH_VARARGS, jt_add_w__doc },
+	{ "add_w_fd", (PyCFunction) jt_add_w_fd, METH_VARARGS,
+		jt_add_w_fd__doc },
 	{ "commit", (PyCFunction) jt_commit, METH_VARARGS, jt_commit__doc },
 	{ "rollback", (PyCFunction) jt_rollback, METH_VARARGS, jt_rollback__doc },
+	{ "elided", (PyCFunction) jt_elided, METH_VARARGS, jt_elided__doc },
+	{ "lsn", (PyCFunction) jt_lsn, METH_VARARGS, jt_lsn__doc },
+	{ "reset", (PyCFunction) jt_reset, METH_VARARGS, jt_reset__doc },
 	{ NULL }
 };
 
@@ -889,29 +1365,52 @@ static PyTypeObject jtrans_type = {
 
 /* open */
 PyDoc_STRVAR(jf_open__doc,
-"open(name[, flags[, mode[, jflags]]])\n\
+"open(name[, flags[, mode[, jflags]]], [jdir, autosync_max_sec,\n\
+	autosync_max_bytes, async_max_pending, async_max_bytes,\n\
+	group_commit_usec, trans_cache, mem_budget, budget_nowait,\n\
+	fd_budget, spill_threshold, splice_threshold])\n\
 \n\
 Opens a file, returns a file object.\n\
 The arguments flags, mode and jflags are the same as jopen(); the constants\n\
-needed are defined in the module.\n\
-It's a wrapper to jopen().\n");
+needed are defined in the module. The keyword arguments are the fields of\n\
+the 'struct jopen_opts' with the same names.\n\
+It's a wrapper to jopen_ex().\n");
 
-static PyObject *jf_open(PyObject *self, PyObject *args)
+static PyObject *jf_open(PyObject *self, PyObject *args, PyObject *kw)
 {
 	char *file;
 	int flags = O_RDONLY;
 	int mode = 0600;
-	unsigned int jflags = 0;
+	long autosync_max_sec = 0;
+	struct jopen_opts opts;
 	jfile_object *fp = NULL;
+	char *keywords[] = { "name", "flags", "mode", "jflags", "jdir",
+		"autosync_max_sec", "autosync_max_bytes", "async_max_pending",
+		"async_max_bytes", "group_commit_usec", "trans_cache",
+		"mem_budget", "budget_nowait", "fd_budget", "spill_threshold",
+		"splice_threshold", NULL };
 
 	flags = O_RDWR;
 	mode = 0600;
-	jflags = 0;
-
-	if (!PyArg_ParseTuple(args, "s|iiI:open", &file, &flags, &mode,
-				&jflags))
+	memset(&opts, 0, sizeof(opts));
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "s|iiIzlnInkIniInn:open",
+				keywords, &file, &flags, &mode, &opts.jflags,
+				&opts.jdir, &autosync_max_sec,
+				&opts.autosync_max_bytes,
+				&opts.async_max_pending,
+				&opts.async_max_bytes,
+				&opts.group_commit_usec,
+				&opts.trans_cache,
+				&opts.mem_budget,
+				&opts.budget_nowait,
+				&opts.fd_budget,
+				&opts.spill_threshold,
+				&opts.splice_threshold))
 		return NULL;
 
+	opts.autosync_max_sec = autosync_max_sec;
+
 #ifdef PYTHON3
 	fp = (jfile_object *) jfile_type.tp_alloc(&jfile_type, 0);
 #elif PYTHON2
@@ -921,7 +1420,7 @@ static PyObject *jf_open(PyObject *self, PyObject *args)
 	if (fp == NULL)
 		return NULL;
 
-	fp->fs = jopen(file, flags, mode, jflags);
+	fp->fs = jopen_ex(file, flags, mode, &opts);
 	if (fp->fs == NULL) {
 		return PyErr_SetFromErrno(PyExc_IOError);
 	}
@@ -934,6 +1433,40 @@ static PyObject *jf_open(PyObject *self, PyObject *args)
 	return (PyObject *) fp;
 }
 
+/* fopen */
+PyDoc_STRVAR(jf_fopen__doc,
+"fopen(name, mode)\n\
+\n\
+Opens a file like the C fopen() does, returns a file object whose fread(),\n\
+fwrite() and related methods go through a buffer, like stdio's. The other\n\
+methods can be used too, but bypass the buffer.\n\
+It's a wrapper to jfopen().\n");
+
+static PyObject *jf_fopen(PyObject *self, PyObject *args)
+{
+	char *file, *mode;
+	jfile_object *fp = NULL;
+
+	if (!PyArg_ParseTuple(args, "ss:fopen", &file, &mode))
+		return NULL;
+
+#ifdef PYTHON3
+	fp = (jfile_object *) jfile_type.tp_alloc(&jfile_type, 0);
+#elif PYTHON2
+	fp = PyObject_New(jfile_object, &jfile_type);
+#endif
+
+	if (fp == NULL)
+		return NULL;
+
+	fp->fs = jfopen(file, mode);
+	if (fp->fs == NULL) {
+		return PyErr_SetFromErrno(PyExc_IOError);
+	}
+
+	return (PyObject *) fp;
+}
+
 /* jfsck */
 PyDoc_STRVAR(jf_jfsck__doc,
 "jfsck(name[, jdir] [, flags])\n\
@@ -985,10 +1518,72 @@ static PyObject *jf_jfsck(PyObject *self, PyObject *args, PyObject *kw)
 	return dict;
 }
 
+/* commit_many */
+PyDoc_STRVAR(jf_commit_many__doc,
+"commit_many(transactions)\n\
+\n\
+Commits a sequence of transactions, sharing the syncs between them; returns\n\
+a list with the result of each commit (negative if it failed).\n\
+It's a wrapper to jtrans_commit_many().\n");
+
+static PyObject *jf_commit_many(PyObject *self, PyObject *args)
+{
+	unsigned int i, n;
+	PyObject *seq, *fast, *item, *list = NULL;
+	jtrans_t **ts = NULL;
+	ssize_t *status = NULL;
+
+	if (!PyArg_ParseTuple(args, "O:commit_many", &seq))
+		return NULL;
+
+	fast = PySequence_Fast(seq, "expected a sequence of transactions");
+	if (fast == NULL)
+		return NULL;
+
+	n = PySequence_Fast_GET_SIZE(fast);
+	ts = malloc(sizeof(jtrans_t *) * (n ? n : 1));
+	status = malloc(sizeof(ssize_t) * (n ? n : 1));
+	if (ts == NULL || status == NULL) {
+		PyErr_NoMemory();
+		goto exit;
+	}
+
+	for (i = 0; i < n; i++) {
+		item = PySequence_Fast_GET_ITEM(fast, i);
+		if (!PyObject_TypeCheck(item, &jtrans_type)) {
+			PyErr_SetString(PyExc_TypeError,
+					"expected a sequence of transactions");
+			goto exit;
+		}
+		ts[i] = ((jtrans_object *) item)->ts;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	jtrans_commit_many(ts, n, status);
+	Py_END_ALLOW_THREADS
+
+	list = PyList_New(n);
+	if (list == NULL)
+		goto exit;
+
+	for (i = 0; i < n; i++)
+		PyList_SET_ITEM(list, i, Our_PyLong_FromSsize_t(status[i]));
+
+exit:
+	free(ts);
+	free(status);
+	Py_DECREF(fast);
+	return list;
+}
+
 static PyMethodDef module_methods[] = {
-	{ "open", jf_open, METH_VARARGS, jf_open__doc },
+	{ "open", (PyCFunction) jf_open, METH_VARARGS | METH_KEYWORDS,
+		jf_open__doc },
+	{ "fopen", (PyCFunction) jf_fopen, METH_VARARGS, jf_fopen__doc },
 	{ "jfsck", (PyCFunction) jf_jfsck, METH_VARARGS | METH_KEYWORDS,
 		jf_jfsck__doc },
+	{ "commit_many", (PyCFunction) jf_commit_many, METH_VARARGS,
+		jf_commit_many__doc },
 	{ NULL, NULL, 0, NULL },
 };
 
@@ -1013,6 +1608,14 @@ static void populate_module(PyObject *m)
 	PyModule_AddIntConstant(m, "J_NOLOCK", J_NOLOCK);
 	PyModule_AddIntConstant(m, "J_NOROLLBACK", J_NOROLLBACK);
 	PyModule_AddIntConstant(m, "J_LINGER", J_LINGER);
+	PyModule_AddIntConstant(m, "J_COMPRESS", J_COMPRESS);
+	PyModule_AddIntConstant(m, "J_DELTA", J_DELTA);
+	PyModule_AddIntConstant(m, "J_ASYNC", J_ASYNC);
+	PyModule_AddIntConstant(m, "J_BULKLOAD", J_BULKLOAD);
+	PyModule_AddIntConstant(m, "J_FASTEXTEND", J_FASTEXTEND);
+	PyModule_AddIntConstant(m, "J_DUR_FULL", J_DUR_FULL);
+	PyModule_AddIntConstant(m, "J_DUR_JOURNAL", J_DUR_JOURNAL);
+	PyModule_AddIntConstant(m, "J_DUR_ORDERED", J_DUR_ORDERED);
 	PyModule_AddIntConstant(m, "J_COMMITTED", J_COMMITTED);
 	PyModule_AddIntConstant(m, "J_ROLLBACKED", J_ROLLBACKED);
 	PyModule_AddIntConstant(m, "J_ROLLBACKING", J_ROLLBACKING);
@@ -1026,6 +1629,9 @@ static void populate_module(PyObject *m)
 	PyModule_AddIntConstant(m, "J_ECLEANUP", J_ECLEANUP);
 	PyModule_AddIntConstant(m, "J_EIO", J_EIO);
 
+	/* jopen_opts values; splice_threshold is parsed as a Py_ssize_t */
+	PyModule_AddIntConstant(m, "J_SPLICE_AUTO", (Py_ssize_t) J_SPLICE_AUTO);
+
 	/* jfsck() flags */
 	PyModule_AddIntConstant(m, "J_CLEANUP", J_CLEANUP);
 
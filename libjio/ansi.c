@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <pthread.h>
 
 #include "libjio.h"
@@ -25,8 +26,171 @@
  *
  * Note that it is still experimental and it hasn't received too much testing
  * (that's why it's not even documented), so use it at your own risk.
+ *
+ * Like stdio, streams are buffered: small writes accumulate in the buffer
+ * and are committed together, as a single transaction, when it fills up or
+ * on jfflush(), jfseek(), jfileno() and jfclose() (or jclose()); so they're
+ * not durable (nor atomic on their own) until then. Reads are done a buffer
+ * at a time too. A stream is either reading or writing, and switching
+ * flushes the buffer.
+ *
+ * The stream's lock protects the buffer, and it's taken before fs->lock,
+ * which the UNIX wrappers take to move the file pointer. The file pointer
+ * (fs->pos) is where the buffer begins when writing, and where it ends when
+ * reading; except on append streams, where the buffered data goes at the end
+ * of the file, wherever it is when it's written.
  */
 
+/** Size of the stream buffers */
+#define STDIO_BUFSIZE (64 * 1024)
+
+/** What the stream buffer holds */
+enum stdio_mode {
+	/** Nothing */
+	STDIO_NONE = 0,
+
+	/** Data read from the file */
+	STDIO_READ = 1,
+
+	/** Data waiting to be written */
+	STDIO_WRITE = 2,
+};
+
+/** Stream buffer */
+struct jstdio {
+	/** Protects the rest of the fields */
+	pthread_mutex_t lock;
+
+	/** The buffer */
+	unsigned char *buf;
+
+	/** What the buffer holds */
+	enum stdio_mode mode;
+
+	/** Number of valid bytes in the buffer */
+	size_t len;
+
+	/** When reading, the number of bytes already consumed */
+	size_t rpos;
+
+	/** Set to 1 when an operation failed, until jclearerr() */
+	int error;
+};
+
+
+/** Write the buffered data, if any. Must be called with the stream lock
+ * held. Returns 0 on success, -1 on error (and the data is dropped). */
+static int stdio_flush_write(struct jfs *fs)
+{
+	ssize_t rv;
+	size_t len;
+	struct jstdio *st = fs->stdio;
+
+	if (st->mode != STDIO_WRITE)
+		return 0;
+
+	len = st->len;
+	st->mode = STDIO_NONE;
+	st->len = 0;
+
+	rv = 0;
+	if (len > 0)
+		rv = jwrite(fs, st->buf, len);
+
+	if (rv != (ssize_t) len) {
+		st->error = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Drop the read buffer, moving the file pointer back to the first byte
+ * that was not consumed. Must be called with the stream lock held. Returns
+ * 0 on success, -1 on error. */
+static int stdio_drop_read(struct jfs *fs)
+{
+	size_t unread;
+	struct jstdio *st = fs->stdio;
+
+	if (st->mode != STDIO_READ)
+		return 0;
+
+	unread = st->len - st->rpos;
+	st->mode = STDIO_NONE;
+	st->len = st->rpos = 0;
+
+	if (unread && jlseek(fs, -(off_t) unread, SEEK_CUR) < 0) {
+		st->error = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Write the buffered data, or drop what we read ahead. Must be called with
+ * the stream lock held. Returns 0 on success, -1 on error. */
+static int stdio_flush(struct jfs *fs)
+{
+	if (fs->stdio->mode == STDIO_WRITE)
+		return stdio_flush_write(fs);
+	return stdio_drop_read(fs);
+}
+
+/** Get the position of the stream, taking the buffer into account. Must be
+ * called with the stream lock held. Returns -1 on error. */
+static off_t stdio_pos(struct jfs *fs)
+{
+	off_t pos;
+	struct jstdio *st = fs->stdio;
+
+	if (st->mode == STDIO_WRITE && (fs->open_flags & O_APPEND)) {
+		pos = applier_file_end(fs);
+		if (pos < 0)
+			return -1;
+		return pos + st->len;
+	}
+
+	pthread_mutex_lock(&(fs->lock));
+	pos = fs->pos;
+	pthread_mutex_unlock(&(fs->lock));
+
+	if (st->mode == STDIO_WRITE)
+		pos += st->len;
+	else if (st->mode == STDIO_READ)
+		pos -= st->len - st->rpos;
+
+	return pos;
+}
+
+/** Free the stream buffer */
+static void stdio_free(struct jstdio *st)
+{
+	pthread_mutex_destroy(&(st->lock));
+	free(st->buf);
+	free(st);
+}
+
+/** Write the buffered data of a stream and free its buffer; jclose() calls
+ * it, so streams can be closed either way. Returns 0 on success, -1 on
+ * error. */
+int stdio_close(struct jfs *fs)
+{
+	int rv;
+	struct jstdio *st = fs->stdio;
+
+	if (st == NULL)
+		return 0;
+
+	pthread_mutex_lock(&(st->lock));
+	rv = stdio_flush_write(fs);
+	pthread_mutex_unlock(&(st->lock));
+
+	fs->stdio = NULL;
+	stdio_free(st);
+
+	return rv;
+}
 
 /* fopen() wrapper */
 struct jfs *jfopen(const char *path, const char *mode)
@@ -34,6 +198,7 @@ struct jfs *jfopen(const char *path, const char *mode)
 	int flags;
 	int pos_at_the_beginning;
 	struct jfs *fs;
+	struct jstdio *st;
 
 	if (strlen(mode) < 1)
 		return NULL;
@@ -57,14 +222,35 @@ struct jfs *jfopen(const char *path, const char *mode)
 		return NULL;
 	}
 
+	st = malloc(sizeof(struct jstdio));
+	if (st == NULL)
+		return NULL;
+
+	st->buf = malloc(STDIO_BUFSIZE);
+	if (st->buf == NULL) {
+		free(st);
+		return NULL;
+	}
+
+	pthread_mutex_init(&(st->lock), NULL);
+	st->mode = STDIO_NONE;
+	st->len = 0;
+	st->rpos = 0;
+	st->error = 0;
+
 	fs = jopen(path, flags, 0666, 0);
-	if (fs == NULL)
+	if (fs == NULL) {
+		stdio_free(st);
 		return NULL;
+	}
 
-	if (pos_at_the_beginning)
-		lseek(fs->fd, 0, SEEK_SET);
-	else
-		lseek(fs->fd, 0, SEEK_END);
+	if (!pos_at_the_beginning && jlseek(fs, 0, SEEK_END) < 0) {
+		stdio_free(st);
+		jclose(fs);
+		return NULL;
+	}
+
+	fs->stdio = st;
 
 	return fs;
 }
@@ -72,14 +258,11 @@ struct jfs *jfopen(const char *path, const char *mode)
 /* fclose() wrapper */
 int jfclose(struct jfs *stream)
 {
-	int rv;
-	rv = jclose(stream);
-	free(stream);
-
-	if (rv == 0)
-		return 0;
-	else
+	/* jclose() writes the buffered data, and frees the stream */
+	if (jclose(stream) != 0)
 		return EOF;
+
+	return 0;
 }
 
 /* freopen() wrapper */
@@ -95,30 +278,166 @@ struct jfs *jfreopen(const char *path, const char *mode, struct jfs *stream)
 /* fread() wrapper */
 size_t jfread(void *ptr, size_t size, size_t nmemb, struct jfs *stream)
 {
-	int rv;
-	rv = jread(stream, ptr, size * nmemb);
+	ssize_t rv;
+	size_t count, done, avail;
+	struct jstdio *st = stream->stdio;
 
-	if (rv <= 0)
+	count = size * nmemb;
+	if (count == 0)
 		return 0;
 
-	return rv / size;
+	if (st == NULL) {
+		rv = jread(stream, ptr, count);
+		if (rv <= 0)
+			return 0;
+		return rv / size;
+	}
+
+	pthread_mutex_lock(&(st->lock));
+
+	if (stdio_flush_write(stream) != 0) {
+		pthread_mutex_unlock(&(st->lock));
+		return 0;
+	}
+
+	done = 0;
+	while (done < count) {
+		if (st->mode == STDIO_READ && st->rpos < st->len) {
+			avail = st->len - st->rpos;
+			if (avail > count - done)
+				avail = count - done;
+
+			memcpy((unsigned char *) ptr + done,
+					st->buf + st->rpos, avail);
+			st->rpos += avail;
+			done += avail;
+			continue;
+		}
+
+		/* the buffer is empty; big reads skip it */
+		st->mode = STDIO_NONE;
+		st->len = st->rpos = 0;
+
+		if (count - done >= STDIO_BUFSIZE) {
+			rv = jread(stream, (unsigned char *) ptr + done,
+					count - done);
+			if (rv > 0)
+				done += rv;
+			else if (rv < 0)
+				st->error = 1;
+			break;
+		}
+
+		rv = jread(stream, st->buf, STDIO_BUFSIZE);
+		if (rv <= 0) {
+			if (rv < 0)
+				st->error = 1;
+			break;
+		}
+
+		st->mode = STDIO_READ;
+		st->len = rv;
+	}
+
+	pthread_mutex_unlock(&(st->lock));
+
+	return done / size;
 }
 
 /* fwrite() wrapper */
 size_t jfwrite(const void *ptr, size_t size, size_t nmemb, struct jfs *stream)
+{
+	ssize_t rv;
+	size_t count;
+	struct jstdio *st = stream->stdio;
+
+	count = size * nmemb;
+	if (count == 0)
+		return 0;
+
+	if (st == NULL) {
+		rv = jwrite(stream, ptr, count);
+		if (rv <= 0)
+			return 0;
+		return rv / size;
+	}
+
+	pthread_mutex_lock(&(st->lock));
+
+	/* like stdio, fail right away if the stream can't be written, rather
+	 * than when the buffer is flushed */
+	if (stream->flags & J_RDONLY) {
+		errno = EBADF;
+		st->error = 1;
+		goto error;
+	}
+
+	if (stdio_drop_read(stream) != 0)
+		goto error;
+
+	/* if it doesn't fit, write what we have; and if it doesn't fit on an
+	 * empty buffer either, write it directly */
+	if (st->len + count > STDIO_BUFSIZE && stdio_flush_write(stream) != 0)
+		goto error;
+
+	if (count >= STDIO_BUFSIZE) {
+		rv = jwrite(stream, ptr, count);
+		if (rv != (ssize_t) count) {
+			st->error = 1;
+			goto error;
+		}
+	} else {
+		memcpy(st->buf + st->len, ptr, count);
+		st->len += count;
+		st->mode = STDIO_WRITE;
+	}
+
+	pthread_mutex_unlock(&(st->lock));
+	return nmemb;
+
+error:
+	pthread_mutex_unlock(&(st->lock));
+	return 0;
+}
+
+/* fflush() wrapper */
+int jfflush(struct jfs *stream)
 {
 	int rv;
-	rv = jwrite(stream, ptr, size * nmemb);
+	struct jstdio *st = stream->stdio;
 
-	if (rv <= 0)
+	if (st == NULL)
 		return 0;
 
-	return rv / size;
+	pthread_mutex_lock(&(st->lock));
+	rv = stdio_flush(stream);
+	pthread_mutex_unlock(&(st->lock));
+
+	return rv == 0 ? 0 : EOF;
 }
 
 /* fileno() wrapper */
 int jfileno(struct jfs *stream)
 {
+	int rv;
+	struct jstdio *st = stream->stdio;
+
+	/* whoever uses the file descriptor must see what we buffered, and
+	 * find it at the position of the stream */
+	if (st != NULL) {
+		pthread_mutex_lock(&(st->lock));
+		rv = stdio_flush(stream);
+		pthread_mutex_unlock(&(st->lock));
+		if (rv != 0)
+			return -1;
+	}
+
+	/* we keep the file position ourselves, so the real file's is only
+	 * brought up to date when someone else is going to use it */
+	pthread_mutex_lock(&(stream->lock));
+	lseek(stream->fd, stream->pos, SEEK_SET);
+	pthread_mutex_unlock(&(stream->lock));
+
 	return stream->fd;
 }
 
@@ -133,14 +452,17 @@ int jfeof(struct jfs *stream)
 
 	off_t curpos, endpos;
 
-	pthread_mutex_lock(&(stream->lock));
-
-	curpos = lseek(jfileno(stream), 0, SEEK_CUR);
-	endpos = lseek(jfileno(stream), 0, SEEK_END);
-
-	lseek(jfileno(stream), curpos, SEEK_SET);
+	if (stream->stdio == NULL) {
+		pthread_mutex_lock(&(stream->lock));
+		curpos = stream->pos;
+		pthread_mutex_unlock(&(stream->lock));
+	} else {
+		pthread_mutex_lock(&(stream->stdio->lock));
+		curpos = stdio_pos(stream);
+		pthread_mutex_unlock(&(stream->stdio->lock));
+	}
 
-	pthread_mutex_unlock(&(stream->lock));
+	endpos = applier_file_end(stream);
 
 	if (curpos >= endpos)
 		return 1;
@@ -151,30 +473,55 @@ int jfeof(struct jfs *stream)
 /* clearerr() wrapper */
 void jclearerr(struct jfs *stream)
 {
-	/* As we do not carry any kind of error state (like explained in
-	 * jfeof()), this function has no effect. */
+	/* We only carry the error state of the buffered operations (see
+	 * jfeof() for the EOF one) */
+	if (stream->stdio == NULL)
+		return;
+
+	pthread_mutex_lock(&(stream->stdio->lock));
+	stream->stdio->error = 0;
+	pthread_mutex_unlock(&(stream->stdio->lock));
 }
 
 /* ferror() wrapper */
 int jferror(struct jfs *stream)
 {
+	int error;
+
 	/* The same as the above; however not returning this might have some
 	 * side effects on very subtle programs relying on this behaviour */
-	return 0;
+	if (stream->stdio == NULL)
+		return 0;
+
+	pthread_mutex_lock(&(stream->stdio->lock));
+	error = stream->stdio->error;
+	pthread_mutex_unlock(&(stream->stdio->lock));
+
+	return error;
 }
 
 /* fseek() wrapper */
 int jfseek(struct jfs *stream, long offset, int whence)
 {
 	off_t pos;
+	struct jstdio *st = stream->stdio;
+
+	if (st != NULL) {
+		pthread_mutex_lock(&(st->lock));
+		if (stdio_flush(stream) != 0) {
+			pthread_mutex_unlock(&(st->lock));
+			return -1;
+		}
+	}
 
-	pthread_mutex_lock(&(stream->lock));
-	pos = lseek(stream->fd, offset, whence);
-	pthread_mutex_unlock(&(stream->lock));
+	pos = jlseek(stream, offset, whence);
+
+	if (st != NULL)
+		pthread_mutex_unlock(&(st->lock));
 
 	/* fseek returns 0 on success, -1 on error */
 	if (pos == -1)
-		return 1;
+		return -1;
 
 	return 0;
 }
@@ -182,14 +529,27 @@ int jfseek(struct jfs *stream, long offset, int whence)
 /* ftell() wrapper */
 long jftell(struct jfs *stream)
 {
+	off_t pos;
+
+	if (stream->stdio == NULL) {
+		pthread_mutex_lock(&(stream->lock));
+		pos = stream->pos;
+		pthread_mutex_unlock(&(stream->lock));
+	} else {
+		pthread_mutex_lock(&(stream->stdio->lock));
+		pos = stdio_pos(stream);
+		pthread_mutex_unlock(&(stream->stdio->lock));
+	}
+
 	/* forced conversion to long to meet the prototype */
-	return (long) lseek(stream->fd, 0, SEEK_CUR);
+	return (long) pos;
 }
 
 /* rewind() wrapper */
 void jrewind(struct jfs *stream)
 {
-	lseek(stream->fd, 0, SEEK_SET);
+	jfseek(stream, 0, SEEK_SET);
+	jclearerr(stream);
 }
 
 /* convert a struct jfs to a FILE so you can use it with other functions that
@@ -197,6 +557,13 @@ void jrewind(struct jfs *stream)
  * and it can cause corruption if you're not extremely careful */
 FILE *jfsopen(struct jfs *stream, const char *mode)
 {
-	return fdopen(stream->fd, mode);
-}
+	int fd;
+
+	/* the FILE will have its own buffer, so ours must be empty, which
+	 * jfileno() takes care of */
+	fd = jfileno(stream);
+	if (fd < 0)
+		return NULL;
 
+	return fdopen(fd, mode);
+}
@@ -0,0 +1,670 @@
+
+/*
+ * Asynchronous write-back (J_ASYNC)
+ *
+ * When a file is opened with J_ASYNC, jtrans_commit() returns as soon as the
+ * transaction file is safely on disk, and leaves the data in a queue. A
+ * background thread, the applier, takes the transactions from it in order,
+ * writes their data to the file, syncs it and only then removes the
+ * transaction files, so if we crash in the middle jfsck() will find them and
+ * reapply them.
+ *
+ * Transactions committed with J_DUR_ORDERED go through a pipeline instead:
+ * jtrans_commit() writes the transaction file but doesn't sync it, and
+ * queues the transaction right away. A second thread, the syncer, syncs the
+ * queued transaction files in batches and marks them durable, and the
+ * applier only takes a transaction once it has been synced. So while the
+ * caller writes the journal of a transaction, the syncer can be syncing the
+ * previous one and the applier applying the one before, without ever
+ * applying data whose transaction file could be lost.
+ *
+ * Until a transaction has been applied, its data is only in the queue, so
+ * the reading functions use applier_pread(), which overlays the queued data
+ * on top of what's on disk.
+ */
+
+#include <sys/types.h>	/* off_t */
+#include <sys/stat.h>	/* fstat() */
+#include <pthread.h>	/* pthread_* */
+#include <time.h>	/* clock_gettime() */
+#include <stdlib.h>	/* malloc() and friends */
+#include <string.h>	/* memcpy(), memset() */
+#include <unistd.h>	/* fdatasync() */
+
+#include "common.h"
+#include "libjio.h"
+#include "compat.h"
+#include "journal.h"
+#include "trans.h"
+
+
+/** Default maximum number of transactions waiting to be applied; each one
+ * keeps its transaction file open, so we can't let them grow unbounded */
+#define MAX_PENDING 128
+
+/** Default maximum number of bytes waiting to be applied */
+#define MAX_PENDING_BYTES (64 * 1024 * 1024)
+
+/** Stages of a queued transaction */
+enum pending_stage {
+	/** The transaction file was written, but not synced */
+	PT_WRITTEN = 1,
+
+	/** The transaction file is safe, the data can be applied */
+	PT_SYNCED = 2,
+};
+
+/** A write operation waiting to be applied */
+struct pending_op {
+	/** Offset to write to */
+	off_t offset;
+
+	/** Data length */
+	size_t len;
+
+	/** Data, points inside the transaction's buffer */
+	unsigned char *buf;
+};
+
+/** A transaction waiting to be applied */
+struct pending_trans {
+	/** Its journal operation, freed once the data is safe */
+	struct journal_op *jop;
+
+	/** Number of operations */
+	unsigned int numops;
+
+	/** Operations, in the order they must be applied */
+	struct pending_op *ops;
+
+	/** Buffer holding the data of all the operations */
+	unsigned char *buf;
+
+	/** Length of buf */
+	size_t len;
+
+	/** Stage the transaction is in */
+	enum pending_stage stage;
+
+	/** Next transaction in the queue */
+	struct pending_trans *next;
+};
+
+/** Configuration and state of an applier thread */
+struct applier_cfg {
+	/** File structure to apply the transactions to */
+	struct jfs *fs;
+
+	/** Applier thread id */
+	pthread_t tid;
+
+	/** Syncer thread id */
+	pthread_t sync_tid;
+
+	/** When the thread must die, we set this to 1 */
+	int must_die;
+
+	/** Set to 1 if the threads failed to sync or apply a transaction */
+	int had_errors;
+
+	/** First transaction of the queue, the next one to apply */
+	struct pending_trans *first;
+
+	/** Last transaction of the queue */
+	struct pending_trans *last;
+
+	/** Number of transactions in the queue */
+	unsigned int npending;
+
+	/** Number of bytes in the queue */
+	size_t pending_bytes;
+
+	/** Number of threads waiting for room in the queue */
+	unsigned int nwaiting;
+
+	/** Max number of transactions in the queue */
+	unsigned int max_pending;
+
+	/** Max number of bytes in the queue (but a transaction is always let
+	 * in if the queue is empty) */
+	size_t max_bytes;
+
+	/** Microseconds to wait for more transactions before applying */
+	unsigned long window;
+
+	/** Broadcasted when a transaction is queued or synced, or the threads
+	 * must die */
+	pthread_cond_t queued;
+
+	/** Signalled when transactions are removed from the queue */
+	pthread_cond_t applied;
+
+	/** Protects all the above */
+	pthread_mutex_t mutex;
+};
+
+/** Free a pending transaction */
+static void free_pending(struct pending_trans *pt)
+{
+	free(pt->ops);
+	free(pt->buf);
+	free(pt);
+}
+
+/** Write the data of a pending transaction to the file. Returns 0 on
+ * success, -1 on error. */
+static int apply_pending(struct jfs *fs, struct pending_trans *pt)
+{
+	unsigned int i;
+	struct pending_op *op;
+
+	for (i = 0; i < pt->numops; i++) {
+		op = &(pt->ops[i]);
+
+		if (spwrite(fs->fd, op->buf, op->len, op->offset) != op->len)
+			return -1;
+
+		if (have_sync_range &&
+				sync_range_submit(fs->fd, op->offset, op->len))
+			return -1;
+	}
+
+	return 0;
+}
+
+/** Wait for the data of a pending transaction to reach the disk. Returns 0 on
+ * success, -1 on error. */
+static int wait_pending(struct jfs *fs, struct pending_trans *pt)
+{
+	unsigned int i;
+	struct pending_op *op;
+
+	for (i = 0; i < pt->numops; i++) {
+		op = &(pt->ops[i]);
+
+		if (sync_range_wait(fs->fd, op->offset, op->len))
+			return -1;
+	}
+
+	return 0;
+}
+
+/** Thread that syncs the transaction files of the queued transactions that
+ * were committed with J_DUR_ORDERED */
+static void *syncer_thread(void *arg)
+{
+	int failed;
+	struct applier_cfg *cfg;
+	struct pending_trans *first, *last, *pt;
+
+	cfg = (struct applier_cfg *) arg;
+
+	pthread_mutex_lock(&cfg->mutex);
+	for (;;) {
+		for (first = cfg->first; first != NULL; first = first->next) {
+			if (first->stage == PT_WRITTEN)
+				break;
+		}
+
+		if (first == NULL) {
+			/* we only die once there's nothing left to sync */
+			if (cfg->must_die)
+				break;
+			pthread_cond_wait(&cfg->queued, &cfg->mutex);
+			continue;
+		}
+
+		/* take the run of written transactions that starts at first;
+		 * the applier doesn't touch them until we mark them synced,
+		 * so we can go through them without the lock */
+		for (last = first; last->next != NULL &&
+				last->next->stage == PT_WRITTEN;
+				last = last->next)
+			;
+		failed = cfg->had_errors;
+		pthread_mutex_unlock(&cfg->mutex);
+
+		/* the journal directory is synced only once, after the last
+		 * transaction file */
+		for (pt = first; !failed; pt = pt->next) {
+			if (journal_sync(pt->jop, pt == last) != 0)
+				failed = 1;
+			if (pt == last)
+				break;
+		}
+
+		/* the commits have already returned, so the only way to let
+		 * the callers know is to stop the durable LSN from advancing,
+		 * and to fail jsync() and jclose() */
+		if (failed) {
+			mark_broken(cfg->fs);
+			lsn_fail(cfg->fs);
+		} else {
+			for (pt = first; ; pt = pt->next) {
+				lsn_untrack(cfg->fs, pt->jop);
+				if (pt == last)
+					break;
+			}
+		}
+
+		pthread_mutex_lock(&cfg->mutex);
+		for (pt = first; ; pt = pt->next) {
+			pt->stage = PT_SYNCED;
+			if (pt == last)
+				break;
+		}
+		if (failed)
+			cfg->had_errors = 1;
+		pthread_cond_broadcast(&cfg->queued);
+	}
+	pthread_mutex_unlock(&cfg->mutex);
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/** Thread that applies the queued transactions */
+static void *applier_thread(void *arg)
+{
+	int failed;
+	struct timespec ts;
+	struct applier_cfg *cfg;
+	struct pending_trans *first, *last, *pt, *next;
+	unsigned int n;
+	size_t len;
+
+	cfg = (struct applier_cfg *) arg;
+
+	pthread_mutex_lock(&cfg->mutex);
+	for (;;) {
+		while ((cfg->first == NULL && !cfg->must_die) ||
+				(cfg->first != NULL &&
+				 cfg->first->stage != PT_SYNCED))
+			pthread_cond_wait(&cfg->queued, &cfg->mutex);
+
+		/* we only die once the queue is empty */
+		if (cfg->first == NULL)
+			break;
+
+		/* give other transactions the chance to join the batch, but
+		 * don't keep anybody waiting for room in the queue, or for it
+		 * to drain */
+		if (cfg->window && !cfg->must_die) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += (cfg->window % 1000000) * 1000;
+			ts.tv_sec += cfg->window / 1000000 +
+				ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+
+			while (!cfg->must_die && !cfg->nwaiting) {
+				if (pthread_cond_timedwait(&cfg->queued,
+						&cfg->mutex, &ts) != 0)
+					break;
+			}
+		}
+
+		/* take everything that is synced right now; new transactions
+		 * are only appended after last, so we can go through the list
+		 * without the lock */
+		first = cfg->first;
+		for (last = first; last->next != NULL &&
+				last->next->stage == PT_SYNCED;
+				last = last->next)
+			;
+		failed = cfg->had_errors;
+		pthread_mutex_unlock(&cfg->mutex);
+
+		/* write all the data first, and then wait for it, so we only
+		 * pay for a single sync for the whole batch */
+		for (pt = first; !failed; pt = pt->next) {
+			if (apply_pending(cfg->fs, pt) != 0)
+				failed = 1;
+			if (pt == last)
+				break;
+		}
+
+		if (!failed && !have_sync_range) {
+			if (fdatasync(cfg->fs->fd) != 0)
+				failed = 1;
+		} else {
+			for (pt = first; !failed; pt = pt->next) {
+				if (wait_pending(cfg->fs, pt) != 0)
+					failed = 1;
+				if (pt == last)
+					break;
+			}
+		}
+
+		/* the data is safe, we can remove the transaction files; if
+		 * we failed they're left behind for jfsck(), and since they
+		 * would be reapplied on top of the following transactions,
+		 * we prevent new ones from being committed */
+		if (failed)
+			mark_broken(cfg->fs);
+
+		n = 0;
+		len = 0;
+		for (pt = first; ; pt = pt->next) {
+			if (journal_free(pt->jop, failed ? 0 : 1) != 0)
+				failed = 1;
+			n++;
+			len += pt->len;
+			if (pt == last)
+				break;
+		}
+
+		pthread_mutex_lock(&cfg->mutex);
+		cfg->first = last->next;
+		if (cfg->first == NULL)
+			cfg->last = NULL;
+		cfg->npending -= n;
+		cfg->pending_bytes -= len;
+		if (failed)
+			cfg->had_errors = 1;
+		last->next = NULL;
+		pthread_cond_broadcast(&cfg->applied);
+
+		pthread_mutex_unlock(&cfg->mutex);
+		for (pt = first; pt != NULL; pt = next) {
+			next = pt->next;
+			free_pending(pt);
+		}
+		pthread_mutex_lock(&cfg->mutex);
+	}
+	pthread_mutex_unlock(&cfg->mutex);
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/** Start the applier and syncer threads of the given file. At most max_pending
+ * transactions, holding at most max_bytes, will be kept waiting to be
+ * applied (0 means the default); and the thread will wait window
+ * microseconds after a transaction is queued for others to join it. Returns 0
+ * on success, -1 on error. */
+int applier_start(struct jfs *fs, unsigned int max_pending, size_t max_bytes,
+		unsigned long window)
+{
+	struct applier_cfg *cfg;
+
+	cfg = malloc(sizeof(struct applier_cfg));
+	if (cfg == NULL)
+		return -1;
+
+	cfg->fs = fs;
+	cfg->must_die = 0;
+	cfg->had_errors = 0;
+	cfg->first = NULL;
+	cfg->last = NULL;
+	cfg->npending = 0;
+	cfg->pending_bytes = 0;
+	cfg->nwaiting = 0;
+	cfg->max_pending = max_pending ? max_pending : MAX_PENDING;
+	cfg->max_bytes = max_bytes ? max_bytes : MAX_PENDING_BYTES;
+	cfg->window = window;
+	pthread_cond_init(&cfg->queued, NULL);
+	pthread_cond_init(&cfg->applied, NULL);
+	pthread_mutex_init(&cfg->mutex, NULL);
+
+	if (pthread_create(&cfg->tid, NULL, &applier_thread, cfg) != 0)
+		goto error;
+
+	if (pthread_create(&cfg->sync_tid, NULL, &syncer_thread, cfg) != 0) {
+		pthread_mutex_lock(&cfg->mutex);
+		cfg->must_die = 1;
+		pthread_cond_broadcast(&cfg->queued);
+		pthread_mutex_unlock(&cfg->mutex);
+		pthread_join(cfg->tid, NULL);
+		goto error;
+	}
+
+	fs->ap_cfg = cfg;
+
+	return 0;
+
+error:
+	pthread_cond_destroy(&cfg->queued);
+	pthread_cond_destroy(&cfg->applied);
+	pthread_mutex_destroy(&cfg->mutex);
+	free(cfg);
+	return -1;
+}
+
+/** Stop the applier and syncer threads, after they have applied all the
+ * queued transactions. Returns 0 on success, -1 if there were errors applying
+ * them. */
+int applier_stop(struct jfs *fs)
+{
+	int rv;
+	struct applier_cfg *cfg = fs->ap_cfg;
+
+	if (cfg == NULL)
+		return 0;
+
+	pthread_mutex_lock(&cfg->mutex);
+	cfg->must_die = 1;
+	pthread_cond_broadcast(&cfg->queued);
+	pthread_mutex_unlock(&cfg->mutex);
+
+	pthread_join(cfg->sync_tid, NULL);
+	pthread_join(cfg->tid, NULL);
+
+	rv = cfg->had_errors ? -1 : 0;
+
+	pthread_cond_destroy(&cfg->queued);
+	pthread_cond_destroy(&cfg->applied);
+	pthread_mutex_destroy(&cfg->mutex);
+	free(cfg);
+	fs->ap_cfg = NULL;
+
+	return rv;
+}
+
+/** Queue the write operations of the given transaction, whose journal
+ * operation has been committed, so the applier writes them to the file. If
+ * it was committed with J_DUR_ORDERED, the syncer syncs it first. The
+ * journal operation will be freed by the applier. Returns 0 on success, -1 on
+ * error (in which case nothing was queued). */
+int applier_queue(struct jfs *fs, struct jtrans *ts, struct journal_op *jop)
+{
+	int i;
+	unsigned int n;
+	size_t len, done;
+	unsigned char *p;
+	struct operation *op;
+	struct pending_trans *pt;
+	struct applier_cfg *cfg = fs->ap_cfg;
+
+	/* operations whose data is in a file could be too big to copy, so
+	 * they're applied by the caller */
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (op->direction == D_WRITE && !op->elided && op->srcfd >= 0)
+			return -1;
+	}
+
+	pt = malloc(sizeof(struct pending_trans));
+	if (pt == NULL)
+		return -1;
+
+	n = 0;
+	len = 0;
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (op->direction == D_READ || op->elided)
+			continue;
+		n++;
+		len += op->len;
+	}
+
+	pt->jop = jop;
+	pt->numops = n;
+	pt->len = len;
+	pt->stage = PT_SYNCED;
+	if (durability(jop->flags) == J_DUR_ORDERED)
+		pt->stage = PT_WRITTEN;
+	pt->next = NULL;
+	pt->ops = malloc(sizeof(struct pending_op) * n);
+	pt->buf = malloc(len);
+	if (pt->ops == NULL || pt->buf == NULL) {
+		free_pending(pt);
+		return -1;
+	}
+
+	/* the operations' buffers belong to the transaction, which can be
+	 * freed as soon as we return, so we need our own copy */
+	n = 0;
+	p = pt->buf;
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (op->direction == D_READ || op->elided)
+			continue;
+
+		if (op->iov == NULL) {
+			memcpy(p, op->buf, op->len);
+		} else {
+			done = 0;
+			for (i = 0; i < op->iovcnt; i++) {
+				memcpy(p + done, op->iov[i].iov_base,
+						op->iov[i].iov_len);
+				done += op->iov[i].iov_len;
+			}
+		}
+		pt->ops[n].offset = op->offset;
+		pt->ops[n].len = op->len;
+		pt->ops[n].buf = p;
+		p += op->len;
+		n++;
+	}
+
+	pthread_mutex_lock(&cfg->mutex);
+
+	while (cfg->npending >= cfg->max_pending || (cfg->npending &&
+			cfg->pending_bytes + len > cfg->max_bytes)) {
+		/* wake up the applier in case it's waiting for more */
+		cfg->nwaiting++;
+		pthread_cond_broadcast(&cfg->queued);
+		pthread_cond_wait(&cfg->applied, &cfg->mutex);
+		cfg->nwaiting--;
+	}
+
+	if (cfg->last == NULL)
+		cfg->first = pt;
+	else
+		cfg->last->next = pt;
+	cfg->last = pt;
+	cfg->npending++;
+	cfg->pending_bytes += len;
+
+	pthread_cond_broadcast(&cfg->queued);
+	pthread_mutex_unlock(&cfg->mutex);
+
+	return 0;
+}
+
+/** Wait until all the queued transactions have been applied. Returns 0 on
+ * success, -1 if there were errors applying them. */
+int applier_drain(struct jfs *fs)
+{
+	int rv;
+	struct applier_cfg *cfg = fs->ap_cfg;
+
+	if (cfg == NULL)
+		return 0;
+
+	pthread_mutex_lock(&cfg->mutex);
+	cfg->nwaiting++;
+	pthread_cond_broadcast(&cfg->queued);
+	while (cfg->first != NULL)
+		pthread_cond_wait(&cfg->applied, &cfg->mutex);
+	cfg->nwaiting--;
+	rv = cfg->had_errors ? -1 : 0;
+	pthread_mutex_unlock(&cfg->mutex);
+
+	return rv;
+}
+
+/** Like spread(), but the data of the transactions that have not been
+ * applied yet is taken into account, as if they had been. */
+ssize_t applier_pread(struct jfs *fs, void *buf, size_t count, off_t offset)
+{
+	ssize_t rv;
+	unsigned int i;
+	off_t start, end;
+	struct pending_trans *pt;
+	struct pending_op *op;
+	struct applier_cfg *cfg = fs->ap_cfg;
+
+	if (cfg == NULL)
+		return spread(fs->fd, buf, count, offset);
+
+	/* we hold the lock while we read, so the applier can't take a
+	 * transaction out of the queue between our read and the overlay;
+	 * it only does it after the data has been written */
+	pthread_mutex_lock(&cfg->mutex);
+
+	if (cfg->first == NULL) {
+		pthread_mutex_unlock(&cfg->mutex);
+		return spread(fs->fd, buf, count, offset);
+	}
+
+	rv = spread(fs->fd, buf, count, offset);
+	if (rv < 0)
+		goto exit;
+
+	/* the queued data can extend the file */
+	memset((unsigned char *) buf + rv, 0, count - rv);
+
+	for (pt = cfg->first; pt != NULL; pt = pt->next) {
+		for (i = 0; i < pt->numops; i++) {
+			op = &(pt->ops[i]);
+
+			start = op->offset > offset ? op->offset : offset;
+			end = op->offset + (off_t) op->len;
+			if (end > offset + (off_t) count)
+				end = offset + count;
+			if (start >= end)
+				continue;
+
+			memcpy((unsigned char *) buf + (start - offset),
+					op->buf + (start - op->offset),
+					end - start);
+			if (end - offset > rv)
+				rv = end - offset;
+		}
+	}
+
+exit:
+	pthread_mutex_unlock(&cfg->mutex);
+	return rv;
+}
+
+/** Get the end of the file as it will be once all the queued transactions
+ * have been applied, or the real one if it's further. */
+off_t applier_file_end(struct jfs *fs)
+{
+	off_t end, opend;
+	unsigned int i;
+	struct stat st;
+	struct pending_trans *pt;
+	struct applier_cfg *cfg = fs->ap_cfg;
+
+	end = 0;
+	if (cfg != NULL) {
+		pthread_mutex_lock(&cfg->mutex);
+		for (pt = cfg->first; pt != NULL; pt = pt->next) {
+			for (i = 0; i < pt->numops; i++) {
+				opend = pt->ops[i].offset + pt->ops[i].len;
+				if (opend > end)
+					end = opend;
+			}
+		}
+		pthread_mutex_unlock(&cfg->mutex);
+	}
+
+	/* we can't use lseek() because it would move the file pointer */
+	if (fstat(fs->fd, &st) != 0)
+		return -1;
+
+	if (st.st_size > end)
+		end = st.st_size;
+
+	return end;
+}
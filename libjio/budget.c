@@ -0,0 +1,189 @@
+
+/*
+ * Memory and file descriptor budgets
+ *
+ * The write operations of a transaction keep a copy of their data in memory
+ * from the moment they're added until the transaction is reset or freed,
+ * and when it's committed the previous data is read into memory too. With
+ * many transactions in flight, or big ones, that adds up; so every file
+ * keeps count of the bytes its transactions hold, and if it was opened with
+ * a memory budget, adding an operation that would go over it waits until
+ * other transactions free enough (or fails, if the file was opened with
+ * budget_nowait).
+ *
+ * The accounting is done when the operation is added, charging twice its
+ * length (the data and the previous data), so the commit never has to wait.
+ * The data is not charged if it's in a file (see jtrans_add_w_fd()), and
+ * the previous data is not charged if the transaction has J_NOROLLBACK, or
+ * the operation is big enough for it to be spilled to the undo file (see
+ * operation_spill_prev()).
+ *
+ * A transaction that already holds memory never waits: it could be waiting
+ * for another one that is waiting for it. Its adds fail instead. And if
+ * nobody holds anything, an add always goes through, no matter its size, so
+ * a single transaction bigger than the budget can still be committed.
+ *
+ * Lingering transactions don't hold their data in memory, but each one
+ * keeps its transaction file open until jsync(); with a fd budget, a commit
+ * that leaves that many lingering transactions calls jsync() before
+ * returning.
+ */
+
+#include <pthread.h>	/* pthread_* */
+#include <errno.h>	/* errno */
+#include <string.h>	/* memset() */
+#include <limits.h>	/* SSIZE_MAX */
+
+#include "common.h"
+#include "libjio.h"
+#include "trans.h"
+
+
+/** How many bytes an operation of count bytes charges against the budget;
+ * fromfd is set if its data is in a file (see jtrans_add_w_fd()) */
+static size_t op_charge(struct jtrans *ts, size_t count, int fromfd)
+{
+	size_t len;
+
+	/* the data, unless it stays in its file */
+	len = fromfd ? 0 : count;
+
+	/* and the previous data, read when committing, unless it goes to the
+	 * undo file */
+	if (!(ts->flags & J_NOROLLBACK) && count < ts->fs->spill_threshold)
+		len = len > MAX_TSIZE - count ? MAX_TSIZE : len + count;
+
+	return len;
+}
+
+/** Charge len bytes against fs' memory budget, on behalf of a transaction
+ * that holds held bytes already. Returns 0 on success, -1 if the budget
+ * doesn't allow it (with errno set to EAGAIN). */
+static int charge(struct jfs *fs, size_t held, size_t len)
+{
+	int rv = 0;
+
+	pthread_mutex_lock(&(fs->memlock));
+
+	while (fs->mem_budget && fs->mem_used &&
+			(fs->mem_used >= fs->mem_budget ||
+			 len > fs->mem_budget - fs->mem_used)) {
+		if (held || fs->budget_nowait) {
+			fs->mem_failures++;
+			errno = EAGAIN;
+			rv = -1;
+			goto exit;
+		}
+
+		fs->mem_waits++;
+		pthread_cond_wait(&(fs->mem_cond), &(fs->memlock));
+	}
+
+	/* mem_used can go over the budget if nobody held anything */
+	fs->mem_used += len;
+	if (fs->mem_used > fs->mem_peak)
+		fs->mem_peak = fs->mem_used;
+
+exit:
+	pthread_mutex_unlock(&(fs->memlock));
+	return rv;
+}
+
+/** Give back len bytes charged against fs' memory budget */
+static void release(struct jfs *fs, size_t len)
+{
+	if (len == 0)
+		return;
+
+	pthread_mutex_lock(&(fs->memlock));
+	fs->mem_used -= len;
+	pthread_cond_broadcast(&(fs->mem_cond));
+	pthread_mutex_unlock(&(fs->memlock));
+}
+
+/** Charge a write operation of count bytes that is about to be added to
+ * the given transaction, waiting if the budget requires it; fromfd is set if
+ * its data is in a file. Returns 0 on success, -1 on error. */
+int budget_charge_op(struct jtrans *ts, size_t count, int fromfd)
+{
+	size_t len;
+
+	len = op_charge(ts, count, fromfd);
+	if (charge(ts->fs, ts->mem, len) != 0)
+		return -1;
+
+	ts->mem += len;
+	return 0;
+}
+
+/** Give back what budget_charge_op() charged for an operation of count
+ * bytes that could not be added after all */
+void budget_uncharge_op(struct jtrans *ts, size_t count, int fromfd)
+{
+	size_t len;
+
+	len = op_charge(ts, count, fromfd);
+	release(ts->fs, len);
+	ts->mem -= len;
+}
+
+/** Charge len bytes on behalf of a commit that doesn't go through a
+ * transaction of its own (see jtrans_commit_w()), and so holds nothing.
+ * Returns 0 on success, -1 on error; it must be released with
+ * budget_release(). */
+int budget_charge(struct jfs *fs, size_t len)
+{
+	return charge(fs, 0, len);
+}
+
+/** Give back len bytes charged with budget_charge() */
+void budget_release(struct jfs *fs, size_t len)
+{
+	release(fs, len);
+}
+
+/** Give back everything the given transaction has charged */
+void budget_release_trans(struct jtrans *ts)
+{
+	release(ts->fs, ts->mem);
+	ts->mem = 0;
+}
+
+/** Tell if the lingering transactions of fs have reached its fd budget, so
+ * it should be jsync()ed. Must be called with fs' ltlock held. */
+int budget_fds_exceeded(struct jfs *fs)
+{
+	return fs->fd_budget && fs->ltrans_count >= fs->fd_budget;
+}
+
+/** Call jsync() on fs because it reached its fd budget */
+void budget_sync(struct jfs *fs)
+{
+	pthread_mutex_lock(&(fs->memlock));
+	fs->early_syncs++;
+	pthread_mutex_unlock(&(fs->memlock));
+
+	jsync(fs);
+}
+
+/* Get the memory and fd accounting of a file */
+void jfs_budget_stats(struct jfs *fs, struct jfs_budget_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&(fs->memlock));
+	stats->mem_used = fs->mem_used;
+	stats->mem_peak = fs->mem_peak;
+	stats->mem_budget = fs->mem_budget;
+	stats->mem_waits = fs->mem_waits;
+	stats->mem_failures = fs->mem_failures;
+	stats->early_syncs = fs->early_syncs;
+	pthread_mutex_unlock(&(fs->memlock));
+
+	pthread_mutex_lock(&(fs->ltlock));
+	stats->fds_used = fs->ltrans_count;
+	stats->fds_peak = fs->fds_peak;
+	stats->fd_budget = fs->fd_budget;
+	pthread_mutex_unlock(&(fs->ltlock));
+}
+
@@ -0,0 +1,5 @@
+build/ansi.o: ansi.c libjio.h common.h fiu-local.h trans.h
+libjio.h:
+common.h:
+fiu-local.h:
+trans.h:
@@ -0,0 +1,8 @@
+build/applier.o: applier.c common.h fiu-local.h libjio.h compat.h \
+ journal.h trans.h
+common.h:
+fiu-local.h:
+libjio.h:
+compat.h:
+journal.h:
+trans.h:
@@ -0,0 +1,5 @@
+build/autosync.o: autosync.c common.h fiu-local.h libjio.h compat.h
+common.h:
+fiu-local.h:
+libjio.h:
+compat.h:
@@ -0,0 +1,5 @@
+build/budget.o: budget.c common.h fiu-local.h libjio.h trans.h
+common.h:
+fiu-local.h:
+libjio.h:
+trans.h:
@@ -0,0 +1,5 @@
+build/bulk.o: bulk.c common.h fiu-local.h libjio.h journal.h
+common.h:
+fiu-local.h:
+libjio.h:
+journal.h:
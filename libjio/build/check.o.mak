@@ -0,0 +1,6 @@
+build/check.o: check.c libjio.h common.h fiu-local.h journal.h trans.h
+libjio.h:
+common.h:
+fiu-local.h:
+journal.h:
+trans.h:
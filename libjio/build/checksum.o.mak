@@ -0,0 +1,3 @@
+build/checksum.o: checksum.c common.h fiu-local.h
+common.h:
+fiu-local.h:
@@ -0,0 +1,5 @@
+build/common.o: common.c libjio.h common.h fiu-local.h compat.h
+libjio.h:
+common.h:
+fiu-local.h:
+compat.h:
@@ -0,0 +1,2 @@
+build/compat.o: compat.c compat.h
+compat.h:
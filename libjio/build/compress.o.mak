@@ -0,0 +1,3 @@
+build/compress.o: compress.c common.h fiu-local.h
+common.h:
+fiu-local.h:
@@ -0,0 +1,2 @@
+build/jiofsck.o: jiofsck.c libjio.h
+libjio.h:
@@ -0,0 +1,6 @@
+build/lsn.o: lsn.c common.h fiu-local.h libjio.h compat.h journal.h
+common.h:
+fiu-local.h:
+libjio.h:
+compat.h:
+journal.h:
@@ -0,0 +1,8 @@
+build/trans.o: trans.c libjio.h common.h fiu-local.h compat.h journal.h \
+ trans.h
+libjio.h:
+common.h:
+fiu-local.h:
+compat.h:
+journal.h:
+trans.h:
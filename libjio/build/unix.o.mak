@@ -0,0 +1,6 @@
+build/unix.o: unix.c libjio.h common.h fiu-local.h compat.h trans.h
+libjio.h:
+common.h:
+fiu-local.h:
+compat.h:
+trans.h:
@@ -0,0 +1,237 @@
+
+/*
+ * Bulk loading (J_BULKLOAD)
+ *
+ * When a file is opened with J_BULKLOAD, the writes past the point where the
+ * file ended when it was opened (the bulk start) go straight to the file,
+ * without being journaled, and only the writes before it use the journal.
+ *
+ * To be able to recover, a marker file named "bulkload" is kept in the
+ * journal directory, holding the bulk start. If we crash, jfsck() truncates
+ * the file back to it, discarding the partially loaded data. jsync() makes a
+ * checkpoint: it syncs the data and then moves the bulk start to the end of
+ * the file, so the data loaded up to then survives. jclose() syncs the data
+ * and removes the marker.
+ *
+ * A write that starts before the bulk start but ends after it would be torn
+ * by the truncation, so before committing it we make a checkpoint that moves
+ * the bulk start past its end.
+ */
+
+#include <sys/types.h>	/* off_t */
+#include <sys/stat.h>	/* fstat() */
+#include <fcntl.h>	/* open() */
+#include <unistd.h>	/* fdatasync(), unlink() */
+#include <stdio.h>	/* snprintf(), rename() */
+#include <stdint.h>	/* uint64_t */
+#include <limits.h>	/* PATH_MAX */
+#include <errno.h>	/* errno */
+#include <pthread.h>	/* pthread_* */
+
+#include "common.h"
+#include "libjio.h"
+#include "journal.h"
+
+
+/** Get the path of the marker file of the given journal directory */
+static void get_marker(const char *jdir, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/bulkload", jdir);
+}
+
+/** Read the bulk start from the marker file. Returns 1 if it was found, 0 if
+ * there is no marker, or -1 on error. */
+static int read_marker(const char *jdir, off_t *start)
+{
+	int fd;
+	uint64_t v;
+	char path[PATH_MAX];
+
+	get_marker(jdir, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	if (spread(fd, &v, sizeof(v), 0) != sizeof(v)) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	*start = (off_t) letohll(v);
+	return 1;
+}
+
+/** Replace the marker file with one holding the given bulk start; it's done
+ * with a rename() so a crash leaves either the old one or the new one.
+ * Returns 0 on success, -1 on error. */
+static int write_marker(struct jfs *fs, off_t start)
+{
+	int fd;
+	uint64_t v;
+	char path[PATH_MAX], tmppath[PATH_MAX];
+
+	get_marker(fs->jdir, path);
+	snprintf(tmppath, PATH_MAX, "%s/bulkload.new", fs->jdir);
+
+	fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+
+	v = htolell((uint64_t) start);
+	if (spwrite(fd, &v, sizeof(v), 0) != sizeof(v) || fsync(fd) != 0) {
+		close(fd);
+		unlink(tmppath);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmppath, path) != 0) {
+		unlink(tmppath);
+		return -1;
+	}
+
+	return fsync_dir(fs->jdirfd);
+}
+
+/** Start bulk loading the given file. If there's a marker left by a previous
+ * load that was not recovered, we keep its bulk start. Returns 0 on success,
+ * -1 on error. */
+int bulk_begin(struct jfs *fs)
+{
+	int rv;
+	off_t start;
+	struct stat st;
+
+	rv = read_marker(fs->jdir, &start);
+	if (rv < 0)
+		return -1;
+
+	if (rv == 0) {
+		if (fstat(fs->fd, &st) != 0)
+			return -1;
+		start = st.st_size;
+
+		if (write_marker(fs, start) != 0)
+			return -1;
+	}
+
+	fs->bulk_start = start;
+	return 0;
+}
+
+/** Make a checkpoint: sync the data and move the bulk start to the end of
+ * the file, or to min_start if it's further. Returns 0 on success, -1 on
+ * error. */
+int bulk_checkpoint(struct jfs *fs, off_t min_start)
+{
+	int rv = -1;
+	off_t start;
+	struct stat st;
+
+	pthread_mutex_lock(&(fs->bulklock));
+
+	if (fs->bulk_start < 0) {
+		rv = 0;
+		goto exit;
+	}
+
+	/* we take the size before syncing, so everything up to it is safe
+	 * once fdatasync() returns */
+	if (fstat(fs->fd, &st) != 0)
+		goto exit;
+	start = st.st_size > min_start ? st.st_size : min_start;
+
+	if (fdatasync(fs->fd) != 0)
+		goto exit;
+
+	if (start != fs->bulk_start && write_marker(fs, start) != 0)
+		goto exit;
+
+	fs->bulk_start = start;
+	rv = 0;
+
+exit:
+	pthread_mutex_unlock(&(fs->bulklock));
+	return rv;
+}
+
+/** Get the current bulk start, or -1 if we're not bulk loading */
+off_t bulk_get_start(struct jfs *fs)
+{
+	off_t start;
+
+	pthread_mutex_lock(&(fs->bulklock));
+	start = fs->bulk_start;
+	pthread_mutex_unlock(&(fs->bulklock));
+
+	return start;
+}
+
+/** Prepare to truncate the file to the given length: the data after it goes
+ * away anyway, so the bulk start must not be past it, or the data written
+ * there later would be taken as old. Returns 0 on success, -1 on error. */
+int bulk_truncate(struct jfs *fs, off_t length)
+{
+	int rv = 0;
+
+	pthread_mutex_lock(&(fs->bulklock));
+	if (fs->bulk_start > length) {
+		rv = write_marker(fs, length);
+		if (rv == 0)
+			fs->bulk_start = length;
+	}
+	pthread_mutex_unlock(&(fs->bulklock));
+
+	return rv;
+}
+
+/** Finish bulk loading: sync the data and remove the marker. Returns 0 on
+ * success, -1 on error. */
+int bulk_end(struct jfs *fs)
+{
+	char path[PATH_MAX];
+
+	if (fs->bulk_start < 0)
+		return 0;
+
+	if (fdatasync(fs->fd) != 0)
+		return -1;
+
+	get_marker(fs->jdir, path);
+	if (unlink(path) != 0 || fsync_dir(fs->jdirfd) != 0)
+		return -1;
+
+	fs->bulk_start = -1;
+	return 0;
+}
+
+/** Recover from an interrupted bulk load, for jfsck(): truncate the file to
+ * the bulk start and remove the marker. Returns 1 if there was a load to
+ * recover, 0 if not, -1 on error. */
+int bulk_recover(struct jfs *fs)
+{
+	int rv;
+	off_t start;
+	struct stat st;
+	char path[PATH_MAX];
+
+	rv = read_marker(fs->jdir, &start);
+	if (rv <= 0)
+		return rv;
+
+	if (fstat(fs->fd, &st) != 0)
+		return -1;
+
+	if (st.st_size > start) {
+		if (ftruncate(fs->fd, start) != 0 || fsync(fs->fd) != 0)
+			return -1;
+	}
+
+	get_marker(fs->jdir, path);
+	if (unlink(path) != 0 || fsync_dir(fs->jdirfd) != 0)
+		return -1;
+
+	return 1;
+}
+
@@ -79,31 +79,104 @@ static int jfsck_cleanup(const char *name, const char *jdir)
 	return 0;
 }
 
+/** Compare two transaction ids, for qsort() */
+static int tidcmp(const void *a, const void *b)
+{
+	uint64_t ta = *(const uint64_t *) a, tb = *(const uint64_t *) b;
+
+	if (ta < tb)
+		return -1;
+	else if (ta > tb)
+		return 1;
+	return 0;
+}
+
+/** Get the transaction ids present in the journal directory, sorted.
+ *
+ * @param dir the opened journal directory
+ * @param tids where to store the array of ids, to be freed by the caller
+ * @param ntids where to store the number of ids
+ * @returns 0 on success, -1 on I/O errors, -2 on memory errors
+ */
+static int get_tids(DIR *dir, uint64_t **tids, size_t *ntids)
+{
+	uint64_t tid, *t, *newt;
+	size_t n, size;
+	char *end;
+	struct dirent *dent;
+
+	n = 0;
+	size = 64;
+	t = malloc(size * sizeof(uint64_t));
+	if (t == NULL)
+		return -2;
+
+	for (errno = 0, dent = readdir(dir); dent != NULL;
+			errno = 0, dent = readdir(dir)) {
+		/* see if the file is named like a transaction (a number > 0),
+		 * ignore it otherwise */
+		if (dent->d_name[0] < '1' || dent->d_name[0] > '9')
+			continue;
+
+		tid = strtoull(dent->d_name, &end, 10);
+		if (*end != '\0' || tid == 0 || tid == ULLONG_MAX)
+			continue;
+
+		if (n == size) {
+			size *= 2;
+			newt = realloc(t, size * sizeof(uint64_t));
+			if (newt == NULL) {
+				free(t);
+				return -2;
+			}
+			t = newt;
+		}
+
+		t[n] = tid;
+		n++;
+	}
+	if (errno) {
+		free(t);
+		return -1;
+	}
+
+	/* they must be applied in order (recovering transaction in a
+	 * different order as they were applied would result in corruption) */
+	qsort(t, n, sizeof(uint64_t), tidcmp);
+
+	*tids = t;
+	*ntids = n;
+	return 0;
+}
+
 /* Check the journal and fix the incomplete transactions */
 enum jfsck_return jfsck(const char *name, const char *jdir,
 		struct jfsck_result *res, unsigned int flags)
 {
-	int tfd, rv, i, ret;
-	unsigned int maxtid;
+	int tfd, rv, ret;
+	uint64_t maxtid, *tids;
+	size_t i, ntids;
 	char jlockfile[PATH_MAX], tname[PATH_MAX], brokenname[PATH_MAX];
 	struct stat sinfo;
 	struct jfs fs;
 	struct jtrans *curts;
-	struct operation *tmpop;
 	DIR *dir;
-	struct dirent *dent;
-	unsigned char *map;
 	off_t filelen, lr;
 
 	tfd = -1;
 	filelen = 0;
 	dir = NULL;
+	tids = NULL;
+	ntids = 0;
 	fs.fd = -1;
 	fs.jfd = -1;
 	fs.jdir = NULL;
 	fs.jdirfd = -1;
 	fs.jmap = MAP_FAILED;
-	map = NULL;
+	fs.flags = 0;
+	fs.trans_cache = 0;
+	fs.jop_cache = NULL;
+	fs.jop_cached = 0;
 	ret = 0;
 
 	res->total = 0;
@@ -185,7 +258,16 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 	}
 	fs.jfd = rv;
 
-	fs.jmap = (unsigned int *) mmap(NULL, sizeof(unsigned int),
+	/* it could have been written by an older version of the library */
+	plockf(fs.jfd, F_LOCKW, 0, 0);
+	rv = init_lockfile(fs.jfd);
+	plockf(fs.jfd, F_UNLOCK, 0, 0);
+	if (rv != 0) {
+		ret = J_EIO;
+		goto exit;
+	}
+
+	fs.jmap = (uint64_t *) mmap(NULL, sizeof(uint64_t),
 			PROT_READ | PROT_WRITE, MAP_SHARED, fs.jfd, 0);
 	if (fs.jmap == MAP_FAILED) {
 		ret = J_EIO;
@@ -200,27 +282,22 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 		goto exit;
 	}
 
-	/* find the greatest transaction number by looking into the journal
-	 * directory */
-	maxtid = 0;
-	for (errno = 0, dent = readdir(dir); dent != NULL;
-			errno = 0, dent = readdir(dir)) {
-		/* see if the file is named like a transaction, ignore
-		 * otherwise; as transactions are named as numbers > 0, a
-		 * simple atoi() is enough testing */
-		rv = atoi(dent->d_name);
-		if (rv <= 0)
-			continue;
-		if (rv > maxtid)
-			maxtid = rv;
-	}
-	if (errno) {
+	/* find the transactions by looking into the journal directory */
+	rv = get_tids(dir, &tids, &ntids);
+	if (rv == -1) {
 		ret = J_EIO;
 		goto exit;
+	} else if (rv == -2) {
+		ret = J_ENOMEM;
+		goto exit;
 	}
 
 	/* rewrite the lockfile, writing the new maxtid on it, so that when we
-	 * rollback a transaction it doesn't step over existing ones */
+	 * rollback a transaction it doesn't step over existing ones; ids
+	 * never go back, so we keep the current one if it's bigger */
+	maxtid = *(fs.jmap);
+	if (ntids > 0 && tids[ntids - 1] > maxtid)
+		maxtid = tids[ntids - 1];
 	rv = spwrite(fs.jfd, &maxtid, sizeof(maxtid), 0);
 	if (rv != sizeof(maxtid)) {
 		ret = J_ENOMEM;
@@ -240,21 +317,28 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 		goto exit;
 	}
 
+	/* discard the data of an interrupted bulk load; it goes first
+	 * because the transactions never touch the data after the bulk
+	 * start (see bulk.c) */
+	rv = bulk_recover(&fs);
+	if (rv < 0) {
+		ret = J_EIO;
+		goto exit;
+	}
+
 	/* verify (and possibly fix) all the transactions */
-	for (i = 1; i <= maxtid; i++) {
+	for (i = 0; i < ntids; i++) {
 		curts = jtrans_new(&fs, 0);
 		if (curts == NULL) {
 			ret = J_ENOMEM;
 			goto exit;
 		}
 
-		curts->id = i;
+		curts->id = tids[i];
 
-		/* open the transaction file, using i as its name, so we are
-		 * really looping in order (recovering transaction in a
-		 * different order as they were applied would result in
-		 * corruption) */
-		get_jtfile(&fs, i, tname);
+		/* open the transaction file; tids is sorted so we are really
+		 * looping in order */
+		get_jtfile(&fs, tids[i], tname);
 		tfd = open(tname, O_RDWR | O_SYNC, 0600);
 		if (tfd < 0) {
 			if (errno == ENOENT) {
@@ -283,30 +367,25 @@ enum jfsck_return jfsck(const char *name, const char *jdir,
 			goto exit;
 		}
 
-		/* no overflow problems because we know the transaction size
-		 * is limited to SSIZE_MAX */
-		map = mmap((void *) 0, filelen, PROT_READ, MAP_SHARED, tfd, 0);
-		if (map == MAP_FAILED) {
-			map = NULL;
-			ret = J_EIO;
-			goto exit;
-		}
-
-		rv = fill_trans(map, filelen, curts);
+		/* verify the whole transaction before touching the file; the
+		 * transaction file is read sequentially using a fixed-size
+		 * buffer, so the memory we use does not depend on its size */
+		rv = fill_trans(tfd, filelen, curts);
 		if (rv == -1) {
 			res->broken++;
 			goto loop;
 		} else if (rv == -2) {
 			res->corrupt++;
 			goto loop;
+		} else if (rv < 0) {
+			ret = J_EIO;
+			goto exit;
 		}
 
-		/* remove flags from the transaction, so we don't have issues
-		 * re-committing */
-		curts->flags = 0;
-
-		rv = jtrans_commit(curts);
-
+		/* and now apply it, in a second pass over the file; the file
+		 * was opened with O_SYNC so once this returns the data is
+		 * safe and we can remove the transaction */
+		rv = replay_trans(tfd, filelen, curts);
 		if (rv < 0) {
 			ret = J_EIO;
 			goto exit;
@@ -324,18 +403,8 @@ nounlink_loop:
 			close(tfd);
 			tfd = -1;
 		}
-		if (map != NULL)
-			munmap(map, filelen);
-
-		while (curts->op != NULL) {
-			tmpop = curts->op->next;
-			if (curts->op->pdata)
-				free(curts->op->pdata);
-			free(curts->op);
-			curts->op = tmpop;
-		}
-		pthread_mutex_destroy(&(curts->lock));
-		free(curts);
+
+		jtrans_free(curts);
 
 		res->total++;
 	}
@@ -358,7 +427,8 @@ exit:
 	if (dir != NULL)
 		closedir(dir);
 	if (fs.jmap != MAP_FAILED)
-		munmap(fs.jmap, sizeof(unsigned int));
+		munmap(fs.jmap, sizeof(uint64_t));
+	free(tids);
 
 	return ret;
 }
@@ -4,6 +4,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -11,10 +12,12 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>		/* PRIu64 */
 #include <arpa/inet.h>		/* htonl() and friends */
 
 #include "libjio.h"
 #include "common.h"
+#include "compat.h"
 
 
 /** Like lockf(), but lock always from the given offset */
@@ -142,6 +145,120 @@ ssize_t swritev(int fd, struct iovec *iov, int iovcnt)
 	return c;
 }
 
+/** Like pwritev() but either fails, or returns a complete write. If *dsync is
+ * set, the data is synced as it's written if possible, and *dsync is cleared
+ * if it wasn't (see vec_pwrite()). Like swritev(), it WILL MODIFY iov. */
+ssize_t spwritev(int fd, struct iovec *iov, int iovcnt, off_t offset,
+		int *dsync)
+{
+	int i;
+	ssize_t rv;
+	size_t c, t, total;
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	c = 0;
+	while (c < total) {
+		rv = vec_pwrite(fd, iov, iovcnt, offset + c, dsync);
+
+		if (rv < 0)
+			return rv;
+
+		c += rv;
+		if (c == total)
+			break;
+
+		/* incomplete write, advance iov and try again */
+		t = 0;
+		for (i = 0; i < iovcnt; i++) {
+			if (t + iov[i].iov_len > rv) {
+				iov[i].iov_base = (char *)
+					iov[i].iov_base + rv - t;
+				iov[i].iov_len -= rv - t;
+				break;
+			} else {
+				t += iov[i].iov_len;
+			}
+		}
+
+		iovcnt -= i;
+		iov = iov + i;
+	}
+
+	return c;
+}
+
+/** Copy count bytes from fdin at offin to fdout at offout. Like spread(), it
+ * either fails or returns a complete copy; if it returns less than count it's
+ * because EOF was reached in fdin. */
+ssize_t copy_range(int fdin, off_t offin, int fdout, off_t offout,
+		size_t count)
+{
+	ssize_t rv;
+	size_t c, n;
+	unsigned char *buf;
+
+	/* let the kernel do it if it can, so the data doesn't go through
+	 * user space (and some filesystems can even share the blocks) */
+	rv = 0;
+	c = 0;
+	while (c < count) {
+		rv = kernel_copy_range(fdin, offin + c, fdout, offout + c,
+				count - c);
+		if (rv <= 0)
+			break;
+		c += rv;
+	}
+
+	if (c == count || rv == 0)
+		return c;
+
+	/* it refused, so we copy the rest ourselves, COPY_CHUNK bytes at a
+	 * time */
+	buf = malloc(count - c < COPY_CHUNK ? count - c : COPY_CHUNK);
+	if (buf == NULL)
+		return -1;
+
+	rv = 0;
+	while (c < count) {
+		n = count - c < COPY_CHUNK ? count - c : COPY_CHUNK;
+
+		rv = spread(fdin, buf, n, offin + c);
+		if (rv <= 0)
+			break;
+
+		if (spwrite(fdout, buf, rv, offout + c) != rv) {
+			rv = -1;
+			break;
+		}
+
+		c += rv;
+		if ((size_t) rv < n)
+			break;
+	}
+
+	free(buf);
+	return rv < 0 ? rv : c;
+}
+
+/** Fill len bytes of fd with zeros, at the given offset. Returns 0 on
+ * success, -1 on error. */
+int fill_zeros(int fd, uint64_t len, off_t offset)
+{
+	size_t blen;
+	static const unsigned char zeros[4096] = { 0 };
+
+	for (; len > 0; len -= blen, offset += blen) {
+		blen = len < sizeof(zeros) ? len : sizeof(zeros);
+		if (spwrite(fd, zeros, blen, offset) != blen)
+			return -1;
+	}
+
+	return 0;
+}
+
 /** Store in jdir the default journal directory path of the given filename */
 int get_jdir(const char *filename, char *jdir)
 {
@@ -170,9 +287,51 @@ int get_jdir(const char *filename, char *jdir)
 
 /** Build the filename of a given transaction. Assumes jtfile can hold at
  * least PATH_MAX bytes. */
-void get_jtfile(struct jfs *fs, unsigned int tid, char *jtfile)
+void get_jtfile(struct jfs *fs, uint64_t tid, char *jtfile)
+{
+	snprintf(jtfile, PATH_MAX, "%s/%" PRIu64, fs->jdir, tid);
+}
+
+/** Get the durability level out of the given transaction flags: the one
+ * given explicitly, or J_DUR_JOURNAL for J_LINGER, or J_DUR_FULL */
+unsigned int durability(unsigned int flags)
+{
+	if (flags & J_DUR_MASK)
+		return flags & J_DUR_MASK;
+
+	if (flags & J_LINGER)
+		return J_DUR_JOURNAL;
+
+	return J_DUR_FULL;
+}
+
+/** Make sure the lock file holds a 64-bit transaction id: initialize it if
+ * it's empty, and widen the value if it was written by an older version of
+ * the library, which used an unsigned int. The caller must hold the lock on
+ * the file. Returns 0 on success, -1 on error. */
+int init_lockfile(int jfd)
 {
-	snprintf(jtfile, PATH_MAX, "%s/%u", fs->jdir, tid);
+	struct stat sinfo;
+	unsigned int oldtid;
+	uint64_t tid;
+
+	if (fstat(jfd, &sinfo) != 0)
+		return -1;
+
+	if (sinfo.st_size == sizeof(tid))
+		return 0;
+
+	tid = 0;
+	if (sinfo.st_size == sizeof(oldtid)) {
+		if (spread(jfd, &oldtid, sizeof(oldtid), 0) != sizeof(oldtid))
+			return -1;
+		tid = oldtid;
+	}
+
+	if (spwrite(jfd, &tid, sizeof(tid), 0) != sizeof(tid))
+		return -1;
+
+	return 0;
 }
 
 
@@ -229,3 +388,49 @@ uint64_t htonll(uint64_t x)
 }
 
 
+/* Version 2 transaction files are stored in little endian, which for the same
+ * reasons as above also needs the runtime check. */
+
+/** Returns 1 if we are running on a little endian machine, 0 otherwise. */
+static int is_little_endian(void)
+{
+	static int endianness = 0;
+
+	/* same trick as in ntohll(): -1 for little endian, 1 for big */
+	if (endianness == 0) {
+		if (htonl(1) == 1)
+			endianness = 1;
+		else
+			endianness = -1;
+	}
+
+	return endianness == -1;
+}
+
+/** Convert a 16-bit value between little endian and host byte order. */
+uint16_t letohs(uint16_t x)
+{
+	if (is_little_endian())
+		return x;
+
+	return (x >> 8) | (x << 8);
+}
+
+/** Convert a 32-bit value between little endian and host byte order. */
+uint32_t letohl(uint32_t x)
+{
+	if (is_little_endian())
+		return x;
+
+	return ( (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | \
+			(x << 24) );
+}
+
+/** Convert a 64-bit value between little endian and host byte order. */
+uint64_t letohll(uint64_t x)
+{
+	if (is_little_endian())
+		return x;
+
+	return ( letohl(x >> 32) | ( (uint64_t) letohl(x & 0xFFFFFFFF) ) << 32 );
+}
@@ -27,6 +27,9 @@
 
 #define MAX_TSIZE	(SSIZE_MAX)
 
+/** Size of the buffer used to copy data between files, see copy_range() */
+#define COPY_CHUNK	(1024 * 1024)
+
 /** The main file structure */
 struct jfs {
 	/** Real file fd */
@@ -44,8 +47,8 @@ struct jfs {
 	/** Journal's lock file descriptor */
 	int jfd;
 
-	/** Journal's lock file mmap */
-	unsigned int *jmap;
+	/** Journal's lock file mmap, holding the last transaction id */
+	uint64_t *jmap;
 
 	/** Journal flags */
 	uint32_t flags;
@@ -59,14 +62,125 @@ struct jfs {
 	/** Length of all the lingered transactions */
 	size_t ltrans_len;
 
+	/** Number of lingered transactions, each one with its transaction
+	 * file open */
+	unsigned int ltrans_count;
+
+	/** Highest ltrans_count seen */
+	unsigned int fds_peak;
+
+	/** If not 0, jsync() is called when ltrans_count reaches it (see
+	 * budget.c) */
+	unsigned int fd_budget;
+
 	/** Lingering transactions' lock */
 	pthread_mutex_t ltlock;
 
 	/** A soft lock used in some operations */
 	pthread_mutex_t lock;
 
+	/** File position, protected by lock; the real file's is only moved
+	 * to it by jfileno() */
+	off_t pos;
+
 	/** Autosync config */
 	struct autosync_cfg *as_cfg;
+
+	/** Applier config, only for J_ASYNC */
+	struct applier_cfg *ap_cfg;
+
+	/** Transactions which are not durable yet, in LSN order */
+	struct journal_op *lsn_pending;
+
+	/** Last transaction in lsn_pending */
+	struct journal_op *lsn_pending_last;
+
+	/** Greatest LSN assigned to a transaction of this file */
+	uint64_t last_lsn;
+
+	/** Greatest LSN that is durable, along with all the previous ones */
+	uint64_t durable_lsn;
+
+	/** Signalled when durable_lsn advances */
+	pthread_cond_t durable_cond;
+
+	/** File descriptor to notify when durable_lsn advances, or -1 */
+	int durable_efd;
+
+	/** Set to 1 if a transaction failed to become durable after its
+	 * commit returned, so durable_lsn must not advance anymore */
+	int lsn_failed;
+
+	/** Protects the LSN fields, and the transaction id assignment; also
+	 * the journal operation cache */
+	pthread_mutex_t lsnlock;
+
+	/** Freed journal operations kept for reuse (see journal.c), linked
+	 * by their lsn_next */
+	struct journal_op *jop_cache;
+
+	/** Number of journal operations in jop_cache */
+	unsigned int jop_cached;
+
+	/** With J_BULKLOAD, the offset from which writes are not journaled;
+	 * -1 if we're not bulk loading */
+	off_t bulk_start;
+
+	/** Protects bulk_start */
+	pthread_mutex_t bulklock;
+
+	/** With O_APPEND, where the appends in progress end */
+	off_t append_end;
+
+	/** Number of appends in progress; append_end is only valid if it's
+	 * not 0 */
+	unsigned int appends;
+
+	/** Protects append_end and appends */
+	pthread_mutex_t appendlock;
+
+	/** Buffer for the stdio wrappers, only for files opened with
+	 * jfopen() (see ansi.c) */
+	struct jstdio *stdio;
+
+	/** How many freed transactions of this file jtrans_free() keeps in
+	 * each thread's cache, see jopen_opts.trans_cache */
+	unsigned int trans_cache;
+
+	/** Write operations at least this long keep their previous data in
+	 * an undo file instead of memory, see jopen_opts.spill_threshold */
+	size_t spill_threshold;
+
+	/** If not 0, operations with at least this many bytes of data are
+	 * spliced into their transaction file, see jopen_opts.splice_threshold */
+	size_t splice_threshold;
+
+	/** Bytes held by the file's transactions (see budget.c) */
+	size_t mem_used;
+
+	/** Highest mem_used seen */
+	size_t mem_peak;
+
+	/** If not 0, the most bytes the transactions can hold */
+	size_t mem_budget;
+
+	/** If set, adds that go over mem_budget fail instead of waiting */
+	int budget_nowait;
+
+	/** Number of adds that waited for memory */
+	uint64_t mem_waits;
+
+	/** Number of adds that failed because of the memory budget */
+	uint64_t mem_failures;
+
+	/** Number of jsync() calls made because of the fd budget */
+	uint64_t early_syncs;
+
+	/** Protects the memory accounting and the statistics */
+	pthread_mutex_t memlock;
+
+	/** Signalled when memory is given back */
+	pthread_cond_t mem_cond;
 };
 
 
@@ -74,14 +188,71 @@ off_t plockf(int fd, int cmd, off_t offset, off_t len);
 ssize_t spread(int fd, void *buf, size_t count, off_t offset);
 ssize_t spwrite(int fd, const void *buf, size_t count, off_t offset);
 ssize_t swritev(int fd, struct iovec *iov, int iovcnt);
+ssize_t spwritev(int fd, struct iovec *iov, int iovcnt, off_t offset,
+		int *dsync);
+ssize_t copy_range(int fdin, off_t offin, int fdout, off_t offout,
+		size_t count);
+int fill_zeros(int fd, uint64_t len, off_t offset);
 int get_jdir(const char *filename, char *jdir);
-void get_jtfile(struct jfs *fs, unsigned int tid, char *jtfile);
+void get_jtfile(struct jfs *fs, uint64_t tid, char *jtfile);
+int init_lockfile(int jfd);
+unsigned int durability(unsigned int flags);
 uint64_t ntohll(uint64_t x);
 uint64_t htonll(uint64_t x);
+uint16_t letohs(uint16_t x);
+uint32_t letohl(uint32_t x);
+uint64_t letohll(uint64_t x);
+
+/* converting to little endian is the same as converting from it */
+#define htoles(x) letohs(x)
+#define htolel(x) letohl(x)
+#define htolell(x) letohll(x)
 
 uint32_t checksum_buf(uint32_t sum, const unsigned char *buf, size_t count);
 
+/** Maximum size of a compression block */
+#define LZ_BLOCK_SIZE (64 * 1024)
+
+size_t lz_compress(const unsigned char *in, size_t len,
+		unsigned char *out, size_t outlen);
+ssize_t lz_decompress(const unsigned char *in, size_t len,
+		unsigned char *out, size_t outlen);
+
 void autosync_check(struct jfs *fs);
 
+int stdio_close(struct jfs *fs);
+
+struct jtrans;
+struct journal_op;
+ssize_t jtrans_commit_w(struct jfs *fs, const void *buf, size_t count,
+		off_t offset);
+ssize_t jtrans_commit_wv(struct jfs *fs, const struct iovec *iov, int iovcnt,
+		off_t offset);
+int budget_charge_op(struct jtrans *ts, size_t count, int fromfd);
+void budget_uncharge_op(struct jtrans *ts, size_t count, int fromfd);
+int budget_charge(struct jfs *fs, size_t len);
+void budget_release(struct jfs *fs, size_t len);
+void budget_release_trans(struct jtrans *ts);
+int budget_fds_exceeded(struct jfs *fs);
+void budget_sync(struct jfs *fs);
+int applier_start(struct jfs *fs, unsigned int max_pending, size_t max_bytes,
+		unsigned long window);
+int applier_stop(struct jfs *fs);
+int applier_queue(struct jfs *fs, struct jtrans *ts, struct journal_op *jop);
+int applier_drain(struct jfs *fs);
+ssize_t applier_pread(struct jfs *fs, void *buf, size_t count, off_t offset);
+off_t applier_file_end(struct jfs *fs);
+
+void lsn_track(struct jfs *fs, struct journal_op *jop);
+void lsn_untrack(struct jfs *fs, struct journal_op *jop);
+void lsn_fail(struct jfs *fs);
+
+int bulk_begin(struct jfs *fs);
+int bulk_checkpoint(struct jfs *fs, off_t min_start);
+off_t bulk_get_start(struct jfs *fs);
+int bulk_truncate(struct jfs *fs, off_t length);
+int bulk_end(struct jfs *fs);
+int bulk_recover(struct jfs *fs);
+
 #endif
 
@@ -94,3 +94,268 @@ int fdatasync(int fd)
 }
 #endif /* defined LACK_FDATASYNC */
 
+
+/*
+ * eventfd() support through an internal similar API
+ */
+
+#ifdef LACK_EVENTFD
+#warning "Not using eventfd()"
+
+#include <errno.h>		/* ENOSYS */
+
+int notify_fd_new(void)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void notify_fd_signal(int fd)
+{
+}
+
+#else
+
+#include <stdint.h>		/* uint64_t */
+#include <sys/eventfd.h>	/* eventfd() */
+
+/** Create a file descriptor to notify events through */
+int notify_fd_new(void)
+{
+	return eventfd(0, 0);
+}
+
+/** Notify an event through a file descriptor created with notify_fd_new() */
+void notify_fd_signal(int fd)
+{
+	uint64_t one = 1;
+
+	/* it can only fail if the counter would overflow, in which case the
+	 * reader already has something to read */
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		return;
+}
+
+#endif /* defined LACK_EVENTFD */
+
+
+/*
+ * copy_file_range() support through an internal similar API
+ */
+
+#ifdef LACK_COPY_FILE_RANGE
+
+#include <errno.h>		/* ENOSYS */
+
+ssize_t kernel_copy_range(int fdin, off_t offin, int fdout, off_t offout,
+		size_t count)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#else
+
+/** Copy up to count bytes from fdin at offin to fdout at offout without
+ * going through user space. Returns how many bytes were copied, 0 on EOF, or
+ * -1 on error; the kernel refuses some combinations of files, so on error
+ * the caller must be ready to copy the data itself. */
+ssize_t kernel_copy_range(int fdin, off_t offin, int fdout, off_t offout,
+		size_t count)
+{
+	loff_t in = offin, out = offout;
+
+	return copy_file_range(fdin, &in, fdout, &out, count, 0);
+}
+
+#endif /* defined LACK_COPY_FILE_RANGE */
+
+
+/*
+ * vmsplice() and splice() support through an internal API
+ */
+
+#ifdef LACK_SPLICE
+
+/** Indicates whether splice_write() can write anything */
+const int have_splice = 0;
+
+size_t splice_write(int fd, const void *buf, size_t count)
+{
+	return 0;
+}
+
+#else
+
+#include <sys/uio.h>		/* vmsplice(), struct iovec */
+
+/** Indicates whether splice_write() can write anything */
+const int have_splice = 1;
+
+/** Size we ask for the pipe used by splice_write(); a bigger one means fewer
+ * calls, but it's fine if we don't get it */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+/** Write count bytes of buf to fd, at its current position, by mapping the
+ * pages into a pipe with vmsplice() and passing them to fd with splice(),
+ * instead of with write(). It's not zero-copy: unless fd bypasses the page
+ * cache, the kernel still copies the data into it, so whether it's cheaper
+ * than write() depends on the system. The pipe is closed before returning,
+ * so it doesn't keep any reference to buf. Returns how many bytes were
+ * written: if it's less than count, the caller must write the rest by itself
+ * (the error, if it's a real one, will show up then). */
+size_t splice_write(int fd, const void *buf, size_t count)
+{
+	int p[2];
+	ssize_t rv;
+	size_t done, inpipe;
+	struct iovec iov;
+
+	if (pipe(p) != 0)
+		return 0;
+
+#ifdef F_SETPIPE_SZ
+	fcntl(p[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#endif
+
+	/* the data goes through the pipe in order, so what reached fd is
+	 * always the first done bytes */
+	done = 0;
+	while (done < count) {
+		iov.iov_base = (char *) buf + done;
+		iov.iov_len = count - done;
+		rv = vmsplice(p[1], &iov, 1, 0);
+		if (rv <= 0)
+			break;
+
+		for (inpipe = rv; inpipe > 0; inpipe -= rv) {
+			rv = splice(p[0], NULL, fd, NULL, inpipe,
+					SPLICE_F_MOVE);
+			if (rv <= 0)
+				goto exit;
+			done += rv;
+		}
+	}
+
+exit:
+	close(p[0]);
+	close(p[1]);
+	return done;
+}
+
+#endif /* defined LACK_SPLICE */
+
+
+/*
+ * pwritev2() support through an internal similar API
+ */
+
+#ifdef LACK_PWRITEV2
+
+/** Indicates whether vec_pwrite() can sync the data as it writes it */
+const int have_dsync_write = 0;
+
+/** Write some of the data in iov to fd at offset, like pwritev(); here we
+ * just write the first buffer, the caller copes with incomplete writes. The
+ * data is never synced, so *dsync is cleared. */
+ssize_t vec_pwrite(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		int *dsync)
+{
+	*dsync = 0;
+	return pwrite(fd, iov[0].iov_base, iov[0].iov_len, offset);
+}
+
+/** Read into the buffers in iov from fd at offset, like preadv(), one
+ * buffer at a time */
+ssize_t vec_pread(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	int i;
+	ssize_t rv, done;
+
+	done = 0;
+	for (i = 0; i < iovcnt; i++) {
+		rv = pread(fd, iov[i].iov_base, iov[i].iov_len, offset + done);
+		if (rv < 0)
+			return done ? done : rv;
+
+		done += rv;
+		if ((size_t) rv < iov[i].iov_len)
+			break;
+	}
+
+	return done;
+}
+
+#else
+
+#include <errno.h>		/* errno */
+#include <pthread.h>		/* pthread_mutex_t */
+
+/** Indicates whether vec_pwrite() can sync the data as it writes it */
+const int have_dsync_write = 1;
+
+/** Whether the kernel supports RWF_DSYNC: 1 if it does, 0 if it doesn't, -1
+ * if we don't know yet; protected by dsync_lock */
+static int dsync_works = -1;
+static pthread_mutex_t dsync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Find out if the kernel supports RWF_DSYNC, the first time we're called,
+ * with a write of no data to fd, which can only fail because of the flag.
+ * Returns 1 if it does, 0 if it doesn't. */
+static int dsync_supported(int fd)
+{
+	int works;
+	ssize_t rv;
+	struct iovec none;
+
+	pthread_mutex_lock(&dsync_lock);
+
+	if (dsync_works < 0) {
+		none.iov_base = NULL;
+		none.iov_len = 0;
+		rv = pwritev2(fd, &none, 1, 0, RWF_DSYNC);
+		if (rv >= 0)
+			dsync_works = 1;
+		else if (errno == EOPNOTSUPP || errno == ENOSYS)
+			dsync_works = 0;
+	}
+
+	/* if the probe failed for some other reason, we try again next
+	 * time, and meanwhile we just try the flag */
+	works = dsync_works != 0;
+
+	pthread_mutex_unlock(&dsync_lock);
+
+	return works;
+}
+
+/** Write the data in iov to fd at offset, like pwritev(). If *dsync is set,
+ * it's written with RWF_DSYNC, so it's on disk (along with the metadata
+ * needed to read it back) once we return; if the kernel doesn't support it,
+ * it's written as usual and *dsync is cleared. */
+ssize_t vec_pwrite(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		int *dsync)
+{
+	ssize_t rv;
+
+	if (*dsync && dsync_supported(fd)) {
+		rv = pwritev2(fd, iov, iovcnt, offset, RWF_DSYNC);
+
+		/* the file may still not take it, even if the kernel does;
+		 * any other error is about the arguments, and would happen
+		 * without the flag too */
+		if (rv >= 0 || errno != EOPNOTSUPP)
+			return rv;
+	}
+
+	*dsync = 0;
+	return pwritev(fd, iov, iovcnt, offset);
+}
+
+/** Read into the buffers in iov from fd at offset, like preadv() */
+ssize_t vec_pread(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return preadv(fd, iov, iovcnt, offset);
+}
+
+#endif /* defined LACK_PWRITEV2 */
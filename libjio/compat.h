@@ -65,5 +65,62 @@ int fdatasync(int fd);
 int clock_gettime(int clk_id, struct timespec *tp);
 #endif
 
+/* Without a monotonic clock, the real time one has to do. */
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC CLOCK_REALTIME
+#endif
+
+
+/* eventfd() is linux-specific, and it's only used to notify the caller about
+ * events, so we provide an internal API which just fails when it's not
+ * available; the implementation is in compat.c. */
+#ifndef __linux__
+#define LACK_EVENTFD 1
+#endif
+
+int notify_fd_new(void);
+void notify_fd_signal(int fd);
+
+
+/* copy_file_range() is linux-specific, and only in glibc since 2.27, so we
+ * provide an internal similar API which just fails when it's not available,
+ * and the callers fall back to copying the data themselves; the
+ * implementation is in compat.c. */
+#if ! ( (defined __linux__) && (defined __GLIBC__) && \
+		(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)) )
+#define LACK_COPY_FILE_RANGE 1
+#endif
+
+ssize_t kernel_copy_range(int fdin, off_t offin, int fdout, off_t offout,
+		size_t count);
+
+
+/* vmsplice() and splice() are linux-specific, so we provide an internal API
+ * which just writes nothing when they're not available, and the callers
+ * write the data as usual; the implementation is in compat.c. */
+#ifndef __linux__
+#define LACK_SPLICE 1
+#endif
+
+extern const int have_splice;
+size_t splice_write(int fd, const void *buf, size_t count);
+
+
+/* pwritev2() and RWF_DSYNC are linux-specific, and only in glibc since 2.26,
+ * so we provide an internal API that falls back to pwritev(), or to pwrite()
+ * where that's not available either, with a constant to be able to check if
+ * the data can be synced as it's written; and one for preadv(), which falls
+ * back to pread(). The implementation is in compat.c. */
+#if ! ( (defined __linux__) && (defined __GLIBC__) && \
+		(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 26)) )
+#define LACK_PWRITEV2 1
+#endif
+
+#include <sys/uio.h>		/* struct iovec */
+extern const int have_dsync_write;
+ssize_t vec_pwrite(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		int *dsync);
+ssize_t vec_pread(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
 #endif
 
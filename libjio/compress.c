@@ -0,0 +1,240 @@
+
+/*
+ * Compression functions
+ * A small and fast LZ77 codec, in the spirit of LZ4, used to compress the
+ * data stored in transaction files. It works on blocks of up to
+ * LZ_BLOCK_SIZE bytes, which are compressed independently, so they can be
+ * decompressed using a small fixed-size buffer.
+ *
+ * A compressed block is a sequence of sequences; each one is made of:
+ *
+ *  - a token byte: the high 4 bits are the number of literals, the low 4
+ *    bits are the match length minus LZ_MINMATCH; in both cases, 15 means
+ *    the value continues in the following bytes, each one added to it until
+ *    one that is not 255 is found.
+ *  - the literals, copied as-is.
+ *  - the match offset, 2 bytes in little endian; the match is copied from
+ *    that many bytes before the current position.
+ *
+ * The last sequence has only literals, and ends the block.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "common.h"
+
+
+/** Minimum match length */
+#define LZ_MINMATCH 4
+
+/** Biggest offset we can encode */
+#define LZ_MAXOFFSET 65535
+
+/** Log2 of the number of entries in the hash table */
+#define LZ_HASH_LOG 12
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned int lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/** Write the continuation of a length. Returns the new output position, or
+ * NULL if there's not enough room. */
+static unsigned char *put_len(unsigned char *op, unsigned char *oend,
+		size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+
+	if (op >= oend)
+		return NULL;
+	*op++ = len;
+
+	return op;
+}
+
+/** Write a sequence; if mlen is 0, it's the last one and has no match.
+ * Returns the new output position, or NULL if there's not enough room. */
+static unsigned char *put_seq(unsigned char *op, unsigned char *oend,
+		const unsigned char *lit, size_t litlen,
+		size_t mlen, size_t offset)
+{
+	unsigned char *token;
+
+	if (op >= oend)
+		return NULL;
+
+	token = op++;
+	*token = (litlen < 15 ? litlen : 15) << 4;
+	if (litlen >= 15) {
+		op = put_len(op, oend, litlen - 15);
+		if (op == NULL)
+			return NULL;
+	}
+
+	if ((size_t) (oend - op) < litlen)
+		return NULL;
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	if (mlen == 0)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+
+	mlen -= LZ_MINMATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15)
+		op = put_len(op, oend, mlen - 15);
+
+	return op;
+}
+
+/** Compress a block of len bytes (which must not be more than
+ * LZ_BLOCK_SIZE) into out, which can hold up to outlen bytes. Returns the
+ * size of the compressed block, or 0 if it doesn't fit in outlen. */
+size_t lz_compress(const unsigned char *in, size_t len,
+		unsigned char *out, size_t outlen)
+{
+	size_t ip, anchor, ref, mlen;
+	uint32_t v;
+	unsigned int h;
+	unsigned char *op, *oend;
+
+	/* positions of the last occurrence of each hash; they fit in 16 bits
+	 * because blocks are at most LZ_BLOCK_SIZE long */
+	uint16_t table[1 << LZ_HASH_LOG];
+
+	memset(table, 0, sizeof(table));
+	op = out;
+	oend = out + outlen;
+	ip = anchor = 0;
+
+	while (ip + LZ_MINMATCH <= len) {
+		v = read32(in + ip);
+		h = lz_hash(v);
+		ref = table[h];
+		table[h] = ip;
+
+		if (ref >= ip || ip - ref > LZ_MAXOFFSET
+				|| read32(in + ref) != v) {
+			/* skip faster over data that doesn't compress */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		mlen = LZ_MINMATCH;
+		while (ip + mlen < len && in[ref + mlen] == in[ip + mlen])
+			mlen++;
+
+		op = put_seq(op, oend, in + anchor, ip - anchor,
+				mlen, ip - ref);
+		if (op == NULL)
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = put_seq(op, oend, in + anchor, len - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+
+	return op - out;
+}
+
+/** Read the continuation of a length. Returns 0 on success, -1 if the input
+ * is too short. */
+static int get_len(const unsigned char **ip, const unsigned char *iend,
+		size_t *len)
+{
+	unsigned char b;
+
+	do {
+		if (*ip >= iend || *len > LZ_BLOCK_SIZE)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/** Decompress a block of len bytes into out, which can hold up to outlen
+ * bytes. The input is not trusted, it may come from a corrupted file.
+ * Returns the size of the decompressed data, or -1 if the block is not
+ * valid. */
+ssize_t lz_decompress(const unsigned char *in, size_t len,
+		unsigned char *out, size_t outlen)
+{
+	size_t litlen, mlen, offset;
+	const unsigned char *ip, *iend, *match;
+	unsigned char *op, *oend, token;
+
+	ip = in;
+	iend = in + len;
+	op = out;
+	oend = out + outlen;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		litlen = token >> 4;
+		if (litlen == 15 && get_len(&ip, iend, &litlen) != 0)
+			return -1;
+
+		if (litlen > (size_t) (iend - ip)
+				|| litlen > (size_t) (oend - op))
+			return -1;
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t) (op - out))
+			return -1;
+
+		mlen = token & 15;
+		if (mlen == 15 && get_len(&ip, iend, &mlen) != 0)
+			return -1;
+		mlen += LZ_MINMATCH;
+		if (mlen > (size_t) (oend - op))
+			return -1;
+
+		/* the match can overlap with what we're writing */
+		match = op - offset;
+		if (offset >= mlen) {
+			memcpy(op, match, mlen);
+			op += mlen;
+		} else {
+			while (mlen--)
+				*op++ = *match++;
+		}
+	}
+
+	return op - out;
+}
+
@@ -15,6 +15,8 @@
 #include <stdint.h>		/* uintX_t */
 #include <arpa/inet.h>		/* htonl() and friends */
 #include <netinet/in.h>		/* htonl() and friends (on some platforms) */
+#include <time.h>		/* clock_gettime() */
+#include <pthread.h>		/* pthread_mutex_t */
 
 #include "libjio.h"
 #include "common.h"
@@ -29,75 +31,218 @@
  * Each transaction will be stored on disk as a single file, composed of a
  * header, operation information, and a trailer. The operation information is
  * composed of repeated operation headers followed by their corresponding
- * data, one for each operation. A special operation header containing all 0s
- * marks the end of the operations.
- * 
+ * data, one for each operation.
+ *
  * Visually, something like this:
- * 
+ *
+ *  +--------+---------+----------+---------+----------+-----+---------+
+ *  | header | op1 hdr | op1 data | op2 hdr | op2 data | ... | trailer |
+ *  +--------+---------+----------+---------+----------+-----+---------+
+ *             \                                         /
+ *              +------------- operations --------------+
+ *
+ * This is version 2 of the format, the one we write. All integers are stored
+ * in little endian, and all the structures are aligned to 8 bytes: the data
+ * of each operation is padded with zeros up to the next multiple of 8.
+ *
+ * The header holds the number of operations and the total length of their
+ * data, so readers know in advance what to expect. Each operation header has
+ * its own checksum, which covers the header (with the checksum field set to
+ * 0) and the data, so operations can be verified and applied independently.
+ * The trailer has a checksum of all the operation checksums and the header,
+ * which ties everything together.
+ *
+ * The data of an operation can be stored compressed (see compress.c), in
+ * which case its header has the OPF_COMPRESSED flag and dlen is the length of
+ * the data as stored. It's a sequence of blocks that hold up to LZ_BLOCK_SIZE
+ * bytes of the operation each, compressed independently, and prepended by
+ * their stored length (4 bytes, little endian). If a block's stored length is
+ * its uncompressed length, then it's stored raw.
+ *
+ * The data can also be stored as a delta against the data the file had
+ * before the transaction, in which case its header has the OPF_DELTA flag.
+ * It's then a sequence of runs, each one being an on_disk_run header followed
+ * by the bytes of the run; the header says how many bytes to skip since the
+ * end of the previous run, and how many bytes the run has. Delta operations
+ * are never compressed.
+ *
+ * Operations that write past the end of the file can be journaled without
+ * their data, in which case their header has the OPF_EXTEND flag and a dlen
+ * of 0. Their data is written and synced in place before the transaction
+ * file is removed, so if we find one on recovery, the data may be incomplete
+ * and the operation is undone instead: the file is truncated back to the
+ * operation's offset, or the range is filled with zeros if the file was
+ * extended past it by someone else in the meantime.
+ *
+ * Version 1 files are still read, so transactions written by older versions
+ * of the library can be recovered. They have packed headers with integers in
+ * network byte order, a special operation header containing all 0s marks the
+ * end of the operations ("eoo"), and a single checksum of everything but the
+ * trailer:
+ *
  *  +--------+---------+----------+---------+----------+-----+-----+---------+
  *  | header | op1 hdr | op1 data | op2 hdr | op2 data | ... | eoo | trailer |
  *  +--------+---------+----------+---------+----------+-----+-----+---------+
- *             \                                             /
- *              +--------------- operations ----------------+ 
  *
- * The details of each part can be seen on the following structures. All
- * integers are stored in network byte order.
+ * The version is the first field of both headers; since version 1 stores it
+ * big endian and version 2 little endian, the first two bytes of the file are
+ * enough to tell them apart.
+ *
+ * The details of each part can be seen on the following structures.
  */
 
 /** Transaction file header */
 struct on_disk_hdr {
 	uint16_t ver;
 	uint16_t flags;
-	uint32_t trans_id;
-} __attribute__((packed));
+	uint32_t reserved;
+	uint64_t trans_id;
+	uint64_t numops;
+	uint64_t total_len;
+};
 
 /** Transaction file operation header */
 struct on_disk_ophdr {
-	uint32_t len;
+	uint64_t len;
 	uint64_t offset;
-} __attribute__((packed));
+	uint64_t dlen;
+	uint32_t flags;
+	uint32_t checksum;
+};
+
+/** Operation flag: the data is compressed */
+#define OPF_COMPRESSED 1
+
+/** Operation flag: the data is a delta against the previous contents */
+#define OPF_DELTA 2
+
+/** Operation flag: the data is not stored, the operation extends the file and
+ * must be undone on recovery */
+#define OPF_EXTEND 4
+
+/** Header of a run in a delta operation */
+struct on_disk_run {
+	uint32_t gap;
+	uint32_t len;
+};
 
 /** Transaction file trailer */
 struct on_disk_trailer {
+	uint64_t numops;
+	uint32_t checksum;
+	uint32_t reserved;
+};
+
+/** Length of operation data once padded to keep the structures aligned */
+#define PADDED_LEN(len) (((len) + 7) & ~((uint64_t) 7))
+
+/** Maximum number of buffers journal_add_opv() writes with a single
+ * writev() */
+#define JOURNAL_IOV_MAX 64
+
+/** Smallest and biggest operation sizes journal_splice_threshold() tries */
+#define SPLICE_CAL_MIN (64 * 1024)
+#define SPLICE_CAL_MAX (4 * 1024 * 1024)
+
+/** Bytes journal_splice_threshold() writes for each size and method */
+#define SPLICE_CAL_BYTES (4 * 1024 * 1024)
+
+/** Times journal_splice_threshold() tries each size and method; the best
+ * run counts, so a single unlucky one doesn't decide */
+#define SPLICE_CAL_RUNS 3
+
+/** Transaction file header (version 1) */
+struct on_disk_hdr_v1 {
+	uint16_t ver;
+	uint16_t flags;
+	uint32_t trans_id;
+} __attribute__((packed));
+
+/** Transaction file operation header (version 1) */
+struct on_disk_ophdr_v1 {
+	uint32_t len;
+	uint64_t offset;
+} __attribute__((packed));
+
+/** Transaction file trailer (version 1) */
+struct on_disk_trailer_v1 {
 	uint32_t numops;
 	uint32_t checksum;
 } __attribute__((packed));
 
 
-/* Convert structs to/from host to network (disk) endian */
+/* Convert structs to/from host to little endian (disk) */
 
-static void hdr_hton(struct on_disk_hdr *hdr)
+static void hdr_htole(struct on_disk_hdr *hdr)
 {
-	hdr->ver = htons(hdr->ver);
-	hdr->flags = htons(hdr->flags);
-	hdr->trans_id = htonl(hdr->trans_id);
+	hdr->ver = htoles(hdr->ver);
+	hdr->flags = htoles(hdr->flags);
+	hdr->reserved = htolel(hdr->reserved);
+	hdr->trans_id = htolell(hdr->trans_id);
+	hdr->numops = htolell(hdr->numops);
+	hdr->total_len = htolell(hdr->total_len);
 }
 
-static void hdr_ntoh(struct on_disk_hdr *hdr)
+static void hdr_letoh(struct on_disk_hdr *hdr)
 {
-	hdr->ver = ntohs(hdr->ver);
-	hdr->flags = ntohs(hdr->flags);
-	hdr->trans_id = ntohl(hdr->trans_id);
+	hdr->ver = letohs(hdr->ver);
+	hdr->flags = letohs(hdr->flags);
+	hdr->reserved = letohl(hdr->reserved);
+	hdr->trans_id = letohll(hdr->trans_id);
+	hdr->numops = letohll(hdr->numops);
+	hdr->total_len = letohll(hdr->total_len);
 }
 
-static void ophdr_hton(struct on_disk_ophdr *ophdr)
+static void ophdr_htole(struct on_disk_ophdr *ophdr)
 {
-	ophdr->len = htonl(ophdr->len);
-	ophdr->offset = htonll(ophdr->offset);
+	ophdr->len = htolell(ophdr->len);
+	ophdr->offset = htolell(ophdr->offset);
+	ophdr->dlen = htolell(ophdr->dlen);
+	ophdr->flags = htolel(ophdr->flags);
+	ophdr->checksum = htolel(ophdr->checksum);
 }
 
-static void ophdr_ntoh(struct on_disk_ophdr *ophdr)
+static void ophdr_letoh(struct on_disk_ophdr *ophdr)
 {
-	ophdr->len = ntohl(ophdr->len);
-	ophdr->offset = ntohll(ophdr->offset);
+	ophdr->len = letohll(ophdr->len);
+	ophdr->offset = letohll(ophdr->offset);
+	ophdr->dlen = letohll(ophdr->dlen);
+	ophdr->flags = letohl(ophdr->flags);
+	ophdr->checksum = letohl(ophdr->checksum);
+}
+
+static void trailer_htole(struct on_disk_trailer *trailer)
+{
+	trailer->numops = htolell(trailer->numops);
+	trailer->checksum = htolel(trailer->checksum);
+	trailer->reserved = htolel(trailer->reserved);
+}
+
+static void trailer_letoh(struct on_disk_trailer *trailer)
+{
+	trailer->numops = letohll(trailer->numops);
+	trailer->checksum = letohl(trailer->checksum);
+	trailer->reserved = letohl(trailer->reserved);
+}
+
+
+/* Convert version 1 structs from network (disk) to host endian; we never
+ * write them so the other direction is not needed */
+
+static void hdr_v1_ntoh(struct on_disk_hdr_v1 *hdr)
+{
+	hdr->ver = ntohs(hdr->ver);
+	hdr->flags = ntohs(hdr->flags);
+	hdr->trans_id = ntohl(hdr->trans_id);
 }
 
-static void trailer_hton(struct on_disk_trailer *trailer) {
-	trailer->numops = htonl(trailer->numops);
-	trailer->checksum = htonl(trailer->checksum);
+static void ophdr_v1_ntoh(struct on_disk_ophdr_v1 *ophdr)
+{
+	ophdr->len = ntohl(ophdr->len);
+	ophdr->offset = ntohll(ophdr->offset);
 }
 
-static void trailer_ntoh(struct on_disk_trailer *trailer) {
+static void trailer_v1_ntoh(struct on_disk_trailer_v1 *trailer) {
 	trailer->numops = ntohl(trailer->numops);
 	trailer->checksum = ntohl(trailer->checksum);
 }
@@ -107,10 +252,12 @@ static void trailer_ntoh(struct on_disk_trailer *trailer) {
  * Helper functions
  */
 
-/** Get a new transaction id */
-static unsigned int get_tid(struct jfs *fs)
+/** Get a new transaction id. Ids are 64-bit and only ever grow, which is what
+ * allows us to know the order in which to apply transactions on recovery.
+ * Returns 0 on error. */
+static uint64_t get_tid(struct jfs *fs)
 {
-	unsigned int curid, rv;
+	uint64_t curid, rv;
 
 	/* lock the whole file */
 	plockf(fs->jfd, F_LOCKW, 0, 0);
@@ -120,7 +267,9 @@ static unsigned int get_tid(struct jfs *fs)
 
 	fiu_do_on("jio/get_tid/overflow", curid = -1);
 
-	/* increment it and handle overflows */
+	/* increment it and handle overflows; at a million transactions per
+	 * second, this would take more than half a million years to happen,
+	 * but it doesn't hurt to check */
 	rv = curid + 1;
 	if (rv == 0)
 		goto exit;
@@ -133,47 +282,129 @@ exit:
 	return rv;
 }
 
-/** Free a transaction id */
-static void free_tid(struct jfs *fs, unsigned int tid)
+
+/** Compress the data of an operation into out, which can hold up to outlen
+ * bytes, using the block format described at the top of this file. Returns
+ * the length of the compressed data, or 0 if it doesn't fit in outlen (which
+ * is the case when the data doesn't compress well). */
+static size_t compress_op(const unsigned char *buf, size_t len,
+		unsigned char *out, size_t outlen)
 {
-	unsigned int curid, i;
-	char name[PATH_MAX];
+	size_t done, blen, clen, pos;
+	uint32_t bhdr;
+
+	pos = 0;
+	for (done = 0; done < len; done += blen) {
+		blen = len - done;
+		if (blen > LZ_BLOCK_SIZE)
+			blen = LZ_BLOCK_SIZE;
+
+		if (outlen - pos < sizeof(bhdr))
+			return 0;
+		pos += sizeof(bhdr);
+
+		/* blocks that don't get smaller are stored raw */
+		clen = lz_compress(buf + done, blen, out + pos,
+				blen - 1 < outlen - pos ?
+					blen - 1 : outlen - pos);
+		if (clen == 0) {
+			if (outlen - pos < blen)
+				return 0;
+			memcpy(out + pos, buf + done, blen);
+			clen = blen;
+		}
 
-	/* lock the whole file */
-	plockf(fs->jfd, F_LOCKW, 0, 0);
+		bhdr = htolel(clen);
+		memcpy(out + pos - sizeof(bhdr), &bhdr, sizeof(bhdr));
+		pos += clen;
+	}
 
-	/* read the current max. curid */
-	curid = *(fs->jmap);
+	return pos;
+}
 
-	/* if we're the max tid, scan the directory looking up for the new
-	 * max; the detailed description can be found in the "doc/" dir */
-	if (tid == curid) {
-		/* look up the new max. */
-		for (i = curid - 1; i > 0; i--) {
-			get_jtfile(fs, i, name);
-			if (access(name, R_OK | W_OK) == 0) {
-				break;
-			} else if (errno != EACCES) {
-				/* Real error, stop looking for a new max. It
-				 * doesn't hurt us because it's ok if the max
-				 * is higher than it could be */
-				break;
+/** Append a run to a delta. Returns 0 on success, -1 if it doesn't fit. */
+static int put_run(unsigned char *out, size_t outlen, size_t *pos,
+		uint64_t gap, const unsigned char *data, uint64_t len)
+{
+	uint32_t g, l;
+	struct on_disk_run run;
+
+	/* runs and gaps that don't fit in the header are split */
+	do {
+		g = gap > UINT32_MAX ? UINT32_MAX : gap;
+		gap -= g;
+		l = gap ? 0 : (len > UINT32_MAX ? UINT32_MAX : len);
+		len -= l;
+
+		if (outlen - *pos < sizeof(run) + (size_t) l)
+			return -1;
+
+		run.gap = htolel(g);
+		run.len = htolel(l);
+		memcpy(out + *pos, &run, sizeof(run));
+		memcpy(out + *pos + sizeof(run), data, l);
+		*pos += sizeof(run) + l;
+		data += l;
+	} while (gap || len);
+
+	return 0;
+}
+
+/** Encode the data of an operation as a delta against the previous data
+ * (pdata, which can be shorter than buf if the operation extends the file),
+ * using the format described at the top of this file. Returns the length of
+ * the delta, or (size_t) -1 if it doesn't fit in outlen. */
+static size_t delta_op(const unsigned char *buf, size_t len,
+		const unsigned char *pdata, size_t plen,
+		unsigned char *out, size_t outlen)
+{
+	size_t i, start, end, eq, pos, prev_end;
+
+	pos = 0;
+	prev_end = 0;
+	i = 0;
+	while (i < len) {
+		/* skip to the next byte that changed */
+		while (i < plen && i < len && buf[i] == pdata[i])
+			i++;
+		if (i == len)
+			break;
+
+		/* and find where the run ends; runs separated by less
+		 * unchanged bytes than a run header are merged, because it's
+		 * cheaper */
+		start = end = i;
+		while (end < len) {
+			if (end >= plen || buf[end] != pdata[end]) {
+				end++;
+				continue;
 			}
+
+			for (eq = end; eq < plen && eq < len
+					&& buf[eq] == pdata[eq]
+					&& eq - end < sizeof(struct on_disk_run);
+					eq++)
+				;
+
+			if (eq == len || eq - end >= sizeof(struct on_disk_run))
+				break;
+			end = eq;
 		}
 
-		/* and save it */
-		*(fs->jmap) = i;
+		if (put_run(out, outlen, &pos, start - prev_end, buf + start,
+					end - start) != 0)
+			return (size_t) -1;
+
+		prev_end = i = end;
 	}
 
-	plockf(fs->jfd, F_UNLOCK, 0, 0);
-	return;
+	return pos;
 }
 
-
 static int already_warned_about_sync = 0;
 
 /** fsync() a directory */
-static int fsync_dir(int fd)
+int fsync_dir(int fd)
 {
 	int rv;
 
@@ -210,6 +441,7 @@ static int corrupt_journal_file(struct journal_op *jop)
 	 * transaction overwrites this one */
 	trailer.numops = 0;
 	trailer.checksum = 0xffffffff;
+	trailer.reserved = 0;
 
 	pos = lseek(jop->fd, 0, SEEK_END);
 	if (pos == (off_t) -1)
@@ -229,7 +461,7 @@ static int corrupt_journal_file(struct journal_op *jop)
  * inside the journal directory. Used internally to mark severe journal errors
  * that should prevent further journal use to avoid potential corruption, like
  * failures to remove transaction files. The mark is removed by jfsck(). */
-static int mark_broken(struct jfs *fs)
+int mark_broken(struct jfs *fs)
 {
 	char broken_path[PATH_MAX];
 	int fd;
@@ -255,13 +487,84 @@ static int is_broken(struct jfs *fs)
  * Journal functions
  */
 
-/** Create a new transaction in the journal. Returns a pointer to an opaque
+/** How many freed journal operations each file keeps for reuse */
+#define JOP_CACHE_MAX 8
+
+/** Get a journal operation structure, with room for its name: one of the
+ * file's cached ones if there are any, or a new one. Returns NULL on
+ * error. */
+static struct journal_op *jop_get(struct jfs *fs)
+{
+	struct journal_op *jop;
+
+	pthread_mutex_lock(&(fs->lsnlock));
+	jop = fs->jop_cache;
+	if (jop != NULL) {
+		fs->jop_cache = jop->lsn_next;
+		fs->jop_cached--;
+	}
+	pthread_mutex_unlock(&(fs->lsnlock));
+
+	if (jop != NULL)
+		return jop;
+
+	jop = malloc(sizeof(struct journal_op));
+	if (jop == NULL)
+		return NULL;
+
+	jop->name = (char *) malloc(PATH_MAX);
+	if (jop->name == NULL) {
+		free(jop);
+		return NULL;
+	}
+
+	return jop;
+}
+
+/** Give back a journal operation structure obtained with jop_get(), which
+ * must not be tracked anymore. It's kept for reuse unless the file has
+ * enough already. */
+static void jop_put(struct jfs *fs, struct journal_op *jop)
+{
+	pthread_mutex_lock(&(fs->lsnlock));
+	if (fs->jop_cached < JOP_CACHE_MAX) {
+		jop->lsn_next = fs->jop_cache;
+		fs->jop_cache = jop;
+		fs->jop_cached++;
+		jop = NULL;
+	}
+	pthread_mutex_unlock(&(fs->lsnlock));
+
+	if (jop != NULL) {
+		free(jop->name);
+		free(jop);
+	}
+}
+
+/** Free the journal operations cached by the file, when closing it */
+void journal_free_cache(struct jfs *fs)
+{
+	struct journal_op *jop;
+
+	while (fs->jop_cache != NULL) {
+		jop = fs->jop_cache;
+		fs->jop_cache = jop->lsn_next;
+		free(jop->name);
+		free(jop);
+	}
+	fs->jop_cached = 0;
+}
+
+/** Create a new transaction in the journal, which will hold numops
+ * operations whose data adds up to len bytes. Returns a pointer to an opaque
  * jop_t (that is freed using journal_free), or NULL if there was an error. */
-struct journal_op *journal_new(struct jfs *fs, unsigned int flags)
+struct journal_op *journal_new(struct jfs *fs, unsigned int flags,
+		uint64_t numops, uint64_t len)
 {
-	int fd, id;
+	int fd;
+	uint64_t id;
 	ssize_t rv;
-	char *name = NULL;
+	char *name;
 	struct journal_op *jop = NULL;
 	struct on_disk_hdr hdr;
 	struct iovec iov[1];
@@ -269,15 +572,24 @@ struct journal_op *journal_new(struct jfs *fs, unsigned int flags)
 	if (is_broken(fs))
 		goto error;
 
-	jop = malloc(sizeof(struct journal_op));
+	jop = jop_get(fs);
 	if (jop == NULL)
 		goto error;
 
-	name = (char *) malloc(PATH_MAX);
-	if (name == NULL)
-		goto error;
+	jop->fs = fs;
+	jop->lsn_tracked = 0;
+	name = jop->name;
 
+	/* ids must be tracked in the same order they're assigned, and while
+	 * the lock file is locked, other threads of this process can still
+	 * get to it because fcntl() locks are per-process */
+	pthread_mutex_lock(&(fs->lsnlock));
 	id = get_tid(fs);
+	if (id != 0) {
+		jop->id = id;
+		lsn_track(fs, jop);
+	}
+	pthread_mutex_unlock(&(fs->lsnlock));
 	if (id == 0)
 		goto error;
 
@@ -290,20 +602,22 @@ struct journal_op *journal_new(struct jfs *fs, unsigned int flags)
 	if (plockf(fd, F_LOCKW, 0, 0) != 0)
 		goto unlink_error;
 
-	jop->id = id;
 	jop->fd = fd;
 	jop->numops = 0;
-	jop->name = name;
+	jop->expected_numops = numops;
+	jop->flags = flags;
 	jop->csum = 0;
-	jop->fs = fs;
 
 	fiu_exit_on("jio/commit/created_tf");
 
 	/* save the header */
-	hdr.ver = 1;
-	hdr.trans_id = id;
+	hdr.ver = 2;
 	hdr.flags = flags;
-	hdr_hton(&hdr);
+	hdr.reserved = 0;
+	hdr.trans_id = id;
+	hdr.numops = numops;
+	hdr.total_len = len;
+	hdr_htole(&hdr);
 
 	iov[0].iov_base = (void *) &hdr;
 	iov[0].iov_len = sizeof(hdr);
@@ -320,108 +634,474 @@ struct journal_op *journal_new(struct jfs *fs, unsigned int flags)
 
 unlink_error:
 	unlink(name);
-	free_tid(fs, id);
 	close(fd);
 
 error:
-	free(name);
-	free(jop);
+	if (jop) {
+		lsn_untrack(fs, jop);
+		jop_put(fs, jop);
+	}
 
 	return NULL;
 }
 
-/** Save a single operation in the journal file */
+/** Write an operation to the transaction file, with the given data as stored
+ * (dlen bytes of buf) and operation flags. Returns 0 on success, -1 on
+ * error. */
+static int write_op(struct journal_op *jop, unsigned char *buf, size_t len,
+		off_t offset, size_t dlen, uint32_t flags)
+{
+	ssize_t rv;
+	size_t done;
+	uint32_t csum;
+	struct on_disk_ophdr ophdr;
+	struct iovec iov[3];
+	static const unsigned char padding[8] = { 0 };
+
+	/* the operation checksum covers its header, with the checksum field
+	 * set to 0, and its data as stored */
+	ophdr.len = len;
+	ophdr.offset = offset;
+	ophdr.dlen = dlen;
+	ophdr.flags = flags;
+	ophdr.checksum = 0;
+	ophdr_htole(&ophdr);
+
+	csum = checksum_buf(0, (unsigned char *) &ophdr, sizeof(ophdr));
+	csum = checksum_buf(csum, buf, dlen);
+	ophdr.checksum = htolel(csum);
+
+	/* and the transaction checksum covers the operation checksums */
+	jop->csum = checksum_buf(jop->csum, (unsigned char *) &ophdr.checksum,
+			sizeof(ophdr.checksum));
+
+	iov[0].iov_base = (void *) &ophdr;
+	iov[0].iov_len = sizeof(ophdr);
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = dlen;
+	iov[2].iov_base = (void *) padding;
+	iov[2].iov_len = PADDED_LEN(dlen) - dlen;
+
+	fiu_exit_on("jio/commit/tf_pre_addop");
+
+	/* big data can be spliced into the file instead of copied (see
+	 * jopen_opts.splice_threshold); whatever couldn't is written below
+	 * as usual */
+	if (jop->fs->splice_threshold && dlen >= jop->fs->splice_threshold) {
+		rv = swritev(jop->fd, iov, 1);
+		if (rv != sizeof(ophdr))
+			return -1;
+
+		done = splice_write(jop->fd, buf, dlen);
+		iov[1].iov_base = (void *) (buf + done);
+		iov[1].iov_len = dlen - done;
+
+		rv = swritev(jop->fd, iov + 1, 2);
+		if (rv != PADDED_LEN(dlen) - done)
+			return -1;
+	} else {
+		rv = swritev(jop->fd, iov, 3);
+		if (rv != sizeof(ophdr) + PADDED_LEN(dlen))
+			return -1;
+	}
+
+	fiu_exit_on("jio/commit/tf_addop");
+
+	jop->numops++;
+
+	return 0;
+}
+
+/** Threshold measured by journal_splice_threshold(), once per process */
+static size_t splice_measured = J_SPLICE_AUTO;
+static pthread_mutex_t splice_measured_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Write SPLICE_CAL_BYTES of buf to fd, size bytes at a time, spliced or
+ * with writev() like write_op() does. Returns how long it took in seconds,
+ * or -1 on error. */
+static double splice_time(int fd, unsigned char *buf, size_t size,
+		int splice)
+{
+	size_t done, n;
+	struct iovec iov;
+	struct timespec t1, t2;
+
+	if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (done = 0; done < SPLICE_CAL_BYTES; done += size) {
+		n = splice ? splice_write(fd, buf, size) : 0;
+
+		iov.iov_base = (void *) (buf + n);
+		iov.iov_len = size - n;
+		if (iov.iov_len && swritev(fd, &iov, 1) != iov.iov_len)
+			return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	return (t2.tv_sec - t1.tv_sec) +
+		(t2.tv_nsec - t1.tv_nsec) / 1000000000.0;
+}
+
+/** Find out from which operation size it's faster to splice the data into
+ * the transaction files than to write it, for jopen_opts.splice_threshold
+ * set to J_SPLICE_AUTO. Like tests/performance/splice, it times both methods
+ * for growing sizes on a file in the journal directory, and the threshold is
+ * the smallest size from which splicing wins for all the bigger ones, or 0
+ * if it never does. It's measured by the first file that asks for it, and
+ * kept for the rest of the process. */
+size_t journal_splice_threshold(struct jfs *fs)
+{
+	int fd, i;
+	size_t size, threshold;
+	double tw, ts, t;
+	unsigned char *buf;
+	char path[PATH_MAX];
+
+	pthread_mutex_lock(&splice_measured_lock);
+
+	if (splice_measured != J_SPLICE_AUTO)
+		goto exit;
+
+	/* without splice() there's nothing to measure; if we can't measure,
+	 * we don't splice, but try again next time */
+	if (!have_splice) {
+		splice_measured = 0;
+		goto exit;
+	}
+
+	buf = malloc(SPLICE_CAL_MAX);
+	if (buf == NULL)
+		goto exit_err;
+	memset(buf, 0x5a, SPLICE_CAL_MAX);
+
+	snprintf(path, PATH_MAX, "%s/splice.XXXXXX", fs->jdir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		free(buf);
+		goto exit_err;
+	}
+	unlink(path);
+
+	threshold = 0;
+	for (size = SPLICE_CAL_MIN; size <= SPLICE_CAL_MAX; size *= 2) {
+		/* the runs of both methods are interleaved, so they're
+		 * equally affected by whatever else is going on */
+		tw = ts = -1;
+		for (i = 0; i < SPLICE_CAL_RUNS; i++) {
+			t = splice_time(fd, buf, size, 0);
+			if (t < 0)
+				break;
+			if (tw < 0 || t < tw)
+				tw = t;
+
+			t = splice_time(fd, buf, size, 1);
+			if (t < 0)
+				break;
+			if (ts < 0 || t < ts)
+				ts = t;
+		}
+
+		if (i < SPLICE_CAL_RUNS) {
+			threshold = 0;
+			break;
+		}
+
+		if (ts < tw) {
+			if (threshold == 0)
+				threshold = size;
+		} else {
+			threshold = 0;
+		}
+	}
+
+	close(fd);
+	free(buf);
+	splice_measured = threshold;
+
+exit:
+	pthread_mutex_unlock(&splice_measured_lock);
+	return splice_measured;
+
+exit_err:
+	pthread_mutex_unlock(&splice_measured_lock);
+	return 0;
+}
+
+/** Save a single operation in the journal file. If pdata is not NULL, it
+ * must hold the previous plen bytes of the file at the operation's offset,
+ * and the operation may be stored as a delta against them. */
 int journal_add_op(struct journal_op *jop, unsigned char *buf, size_t len,
+		off_t offset, unsigned char *pdata, size_t plen)
+{
+	int rv;
+	size_t dlen;
+	uint32_t flags;
+	unsigned char *cbuf = NULL;
+
+	if (jop->numops >= jop->expected_numops)
+		return -1;
+
+	dlen = len;
+	flags = 0;
+
+	/* store only what changed, if it's smaller than the data; otherwise
+	 * fall back to the other encodings */
+	if (pdata != NULL) {
+		cbuf = malloc(len);
+		if (cbuf != NULL) {
+			dlen = delta_op(buf, len, pdata, plen, cbuf, len - 1);
+			if (dlen != (size_t) -1) {
+				buf = cbuf;
+				flags = OPF_DELTA;
+			} else {
+				dlen = len;
+				free(cbuf);
+				cbuf = NULL;
+			}
+		}
+	}
+
+	/* if compression doesn't help (or we can't get the memory for it),
+	 * we just store the data as-is */
+	if (!(flags & OPF_DELTA) && (jop->flags & J_COMPRESS)) {
+		cbuf = malloc(len);
+		if (cbuf != NULL) {
+			dlen = compress_op(buf, len, cbuf, len);
+			if (dlen > 0) {
+				buf = cbuf;
+				flags = OPF_COMPRESSED;
+			} else {
+				dlen = len;
+			}
+		}
+	}
+
+	rv = write_op(jop, buf, len, offset, dlen, flags);
+	if (cbuf)
+		free(cbuf);
+
+	return rv;
+}
+
+/** Save a single operation whose len bytes of data are in the iovcnt buffers
+ * of iov, written straight from them. The data is always stored as-is. */
+int journal_add_opv(struct journal_op *jop, const struct iovec *iov,
+		int iovcnt, size_t len, off_t offset)
+{
+	int i, n;
+	size_t wlen;
+	uint32_t csum;
+	struct on_disk_ophdr ophdr;
+	struct iovec wiov[JOURNAL_IOV_MAX];
+	static const unsigned char padding[8] = { 0 };
+
+	if (jop->numops >= jop->expected_numops)
+		return -1;
+
+	ophdr.len = len;
+	ophdr.offset = offset;
+	ophdr.dlen = len;
+	ophdr.flags = 0;
+	ophdr.checksum = 0;
+	ophdr_htole(&ophdr);
+
+	/* see write_op() */
+	csum = checksum_buf(0, (unsigned char *) &ophdr, sizeof(ophdr));
+	for (i = 0; i < iovcnt; i++)
+		csum = checksum_buf(csum, iov[i].iov_base, iov[i].iov_len);
+	ophdr.checksum = htolel(csum);
+
+	jop->csum = checksum_buf(jop->csum, (unsigned char *) &ophdr.checksum,
+			sizeof(ophdr.checksum));
+
+	fiu_exit_on("jio/commit/tf_pre_addop");
+
+	/* the header, the buffers and the padding go in as few writev() as
+	 * we can; wiov is a copy because swritev() modifies it */
+	wiov[0].iov_base = (void *) &ophdr;
+	wiov[0].iov_len = sizeof(ophdr);
+	n = 1;
+	wlen = sizeof(ophdr);
+	for (i = 0; i <= iovcnt; i++) {
+		if (i < iovcnt) {
+			wiov[n] = iov[i];
+		} else {
+			wiov[n].iov_base = (void *) padding;
+			wiov[n].iov_len = PADDED_LEN(len) - len;
+		}
+		wlen += wiov[n].iov_len;
+		n++;
+
+		if (n < JOURNAL_IOV_MAX && i < iovcnt)
+			continue;
+
+		if (swritev(jop->fd, wiov, n) != wlen)
+			return -1;
+
+		n = 0;
+		wlen = 0;
+	}
+
+	fiu_exit_on("jio/commit/tf_addop");
+
+	jop->numops++;
+
+	return 0;
+}
+
+/** Save a single operation whose data is read from len bytes of fd at foff,
+ * instead of from memory; it's copied in pieces, so it can be much bigger
+ * than what we could hold. The data is always stored as-is. */
+int journal_add_op_fd(struct journal_op *jop, int fd, off_t foff, size_t len,
 		off_t offset)
 {
 	ssize_t rv;
+	off_t hdrpos;
+	size_t done, n;
+	uint32_t csum;
+	unsigned char *buf;
 	struct on_disk_ophdr ophdr;
-	struct iovec iov[2];
+	struct iovec iov[1];
+	static const unsigned char padding[8] = { 0 };
+
+	if (jop->numops >= jop->expected_numops)
+		return -1;
+
+	buf = malloc(len < COPY_CHUNK ? len : COPY_CHUNK);
+	if (buf == NULL)
+		return -1;
 
+	/* we only know the checksum once we've gone over the data, so the
+	 * header is written with the checksum set to 0 (which is what it
+	 * covers anyway, see write_op()) and fixed afterwards */
 	ophdr.len = len;
 	ophdr.offset = offset;
-	ophdr_hton(&ophdr);
+	ophdr.dlen = len;
+	ophdr.flags = 0;
+	ophdr.checksum = 0;
+	ophdr_htole(&ophdr);
+
+	csum = checksum_buf(0, (unsigned char *) &ophdr, sizeof(ophdr));
+
+	hdrpos = lseek(jop->fd, 0, SEEK_CUR);
+	if (hdrpos < 0)
+		goto error;
+
+	fiu_exit_on("jio/commit/tf_pre_addop");
 
 	iov[0].iov_base = (void *) &ophdr;
 	iov[0].iov_len = sizeof(ophdr);
-	jop->csum = checksum_buf(jop->csum, (unsigned char *) &ophdr,
-			sizeof(ophdr));
+	if (swritev(jop->fd, iov, 1) != sizeof(ophdr))
+		goto error;
 
-	iov[1].iov_base = (void *) buf;
-	iov[1].iov_len = len;
-	jop->csum = checksum_buf(jop->csum, buf, len);
+	for (done = 0; done < len; done += n) {
+		n = len - done < COPY_CHUNK ? len - done : COPY_CHUNK;
 
-	fiu_exit_on("jio/commit/tf_pre_addop");
+		if (spread(fd, buf, n, foff + done) != n)
+			goto error;
 
-	rv = swritev(jop->fd, iov, 2);
-	if (rv != sizeof(ophdr) + len)
+		csum = checksum_buf(csum, buf, n);
+
+		iov[0].iov_base = (void *) buf;
+		iov[0].iov_len = n;
+		if (swritev(jop->fd, iov, 1) != n)
+			goto error;
+	}
+
+	iov[0].iov_base = (void *) padding;
+	iov[0].iov_len = PADDED_LEN(len) - len;
+	rv = swritev(jop->fd, iov, 1);
+	if (rv != PADDED_LEN(len) - len)
 		goto error;
 
+	ophdr.checksum = htolel(csum);
+	if (spwrite(jop->fd, &ophdr, sizeof(ophdr), hdrpos) != sizeof(ophdr))
+		goto error;
+
+	jop->csum = checksum_buf(jop->csum, (unsigned char *) &ophdr.checksum,
+			sizeof(ophdr.checksum));
+
 	fiu_exit_on("jio/commit/tf_addop");
 
+	free(buf);
 	jop->numops++;
 
 	return 0;
 
 error:
+	free(buf);
 	return -1;
 }
 
+/** Save an operation that writes len bytes past the end of the file at the
+ * given offset, without its data: the caller must write and sync the data
+ * before removing the transaction file, because if it's found on recovery
+ * the operation is undone (see the top of this file). */
+int journal_add_extend(struct journal_op *jop, size_t len, off_t offset)
+{
+	if (jop->numops >= jop->expected_numops)
+		return -1;
+
+	return write_op(jop, NULL, len, offset, 0, OPF_EXTEND);
+}
+
 /** Prepares to commit the operation. Can be omitted. */
 void journal_pre_commit(struct journal_op *jop)
 {
-	/* In an attempt to reduce journal_commit() fsync() waiting time, we
+	/* In an attempt to reduce journal_sync() fsync() waiting time, we
 	 * submit the sync here, hoping that at least some of it will be ready
-	 * by the time we hit journal_commit() */
+	 * by the time we hit journal_sync() */
 	sync_range_submit(jop->fd, 0, 0);
 }
 
-/** Commit the journal operation */
+/** Commit the journal operation, by writing its trailer. It doesn't sync
+ * it, see journal_sync(). */
 int journal_commit(struct journal_op *jop)
 {
 	ssize_t rv;
-	struct on_disk_ophdr ophdr;
 	struct on_disk_trailer trailer;
-	struct iovec iov[2];
+	struct iovec iov[1];
 
-	/* write the empty ophdr to mark there are no more operations, and
-	 * then the trailer */
-	ophdr.len = 0;
-	ophdr.offset = 0;
-	ophdr_hton(&ophdr);
-	iov[0].iov_base = (void *) &ophdr;
-	iov[0].iov_len = sizeof(ophdr);
-	jop->csum = checksum_buf(jop->csum, (unsigned char *) &ophdr,
-			sizeof(ophdr));
+	/* the header promised a number of operations, we must have them all
+	 * before we can commit */
+	if (jop->numops != jop->expected_numops)
+		goto error;
 
-	trailer.checksum = jop->csum;
 	trailer.numops = jop->numops;
-	trailer_hton(&trailer);
-	iov[1].iov_base = (void *) &trailer;
-	iov[1].iov_len = sizeof(trailer);
-
-	rv = swritev(jop->fd, iov, 2);
-	if (rv != sizeof(ophdr) + sizeof(trailer))
-		goto error;
+	trailer.checksum = jop->csum;
+	trailer.reserved = 0;
+	trailer_htole(&trailer);
+	iov[0].iov_base = (void *) &trailer;
+	iov[0].iov_len = sizeof(trailer);
 
-	/* this is a simple but efficient optimization: instead of doing
-	 * everything O_SYNC, we sync at this point only, this way we avoid
-	 * doing a lot of very small writes; in case of a crash the
-	 * transaction file is only useful if it's complete (ie. after this
-	 * point) so we only flush here (both data and metadata) */
-	if (fsync(jop->fd) != 0)
-		goto error;
-	if (fsync_dir(jop->fs->jdirfd) != 0)
+	rv = swritev(jop->fd, iov, 1);
+	if (rv != sizeof(trailer))
 		goto error;
 
-	fiu_exit_on("jio/commit/tf_sync");
-
 	return 0;
 
 error:
 	return -1;
 }
 
+/** Sync a committed transaction file, and the journal directory too if
+ * sync_dir is set; when syncing many transaction files, the directory only
+ * needs to be synced after the last one. It doesn't mark the transaction as
+ * durable, that's up to the caller. Returns 0 on success, -1 on error. */
+int journal_sync(struct journal_op *jop, int sync_dir)
+{
+	if (fsync(jop->fd) != 0)
+		return -1;
+	if (sync_dir && fsync_dir(jop->fs->jdirfd) != 0)
+		return -1;
+
+	return 0;
+}
+
 /** Free a journal operation.
  * NOTE: It can't assume the save completed successfuly, so we can call it
  * when journal_save() fails.  */
@@ -455,123 +1135,676 @@ int journal_free(struct journal_op *jop, int do_unlink)
 	}
 
 	fiu_exit_on("jio/commit/pre_ok_free_tid");
-	free_tid(jop->fs, jop->id);
 
 	rv = 0;
 
 exit:
+	/* if it was not committed, it will never be durable; and if it
+	 * was, it has been synced by now, by the commit or by the applier's
+	 * syncer */
+	lsn_untrack(jop->fs, jop);
+
 	close(jop->fd);
 
-	free(jop->name);
-	free(jop);
+	jop_put(jop->fs, jop);
 
 	return rv;
 }
 
-/** Fill a transaction structure from a mmapped transaction file. Useful for
- * checking purposes.
- * @returns 0 on success, -1 if the file was broken, -2 if the checksums didn't
- *	match
+
+/*
+ * Transaction file reading
  */
-int fill_trans(unsigned char *map, off_t len, struct jtrans *ts)
+
+/** Size of the buffer used to go through transaction files; the memory used
+ * when reading them does not depend on the size of the transaction */
+#define READER_BUFSIZE (128 * 1024)
+
+/** Sequential reader of a transaction file, which never keeps more than
+ * READER_BUFSIZE bytes of it in memory */
+struct tf_reader {
+	/** Transaction file descriptor */
+	int fd;
+
+	/** Transaction file length */
+	off_t len;
+
+	/** File offset of the end of the valid data in buf */
+	off_t fpos;
+
+	/** Buffer */
+	unsigned char *buf;
+
+	/** Position of the first unconsumed byte in buf */
+	size_t start;
+
+	/** Position right after the last valid byte in buf */
+	size_t end;
+
+	/** Buffer for decompressing, allocated when needed */
+	unsigned char *dbuf;
+};
+
+static int tfr_init(struct tf_reader *r, int fd, off_t len)
+{
+	r->buf = malloc(READER_BUFSIZE);
+	if (r->buf == NULL)
+		return -1;
+
+	r->fd = fd;
+	r->len = len;
+	r->fpos = 0;
+	r->start = r->end = 0;
+	r->dbuf = NULL;
+
+	return 0;
+}
+
+static void tfr_free(struct tf_reader *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+	free(r->dbuf);
+	r->dbuf = NULL;
+}
+
+/** Make sure there are at least want bytes available in the buffer (or as
+ * many as the file has left). Returns the number of bytes available, or -1 on
+ * error. */
+static ssize_t tfr_fill(struct tf_reader *r, size_t want)
+{
+	ssize_t rv;
+	size_t toread;
+
+	if (r->end - r->start >= want)
+		return r->end - r->start;
+
+	/* move the unconsumed bytes to the beginning of the buffer, and then
+	 * read as much as we can fit */
+	memmove(r->buf, r->buf + r->start, r->end - r->start);
+	r->end -= r->start;
+	r->start = 0;
+
+	toread = READER_BUFSIZE - r->end;
+	if (toread > r->len - r->fpos)
+		toread = r->len - r->fpos;
+
+	rv = spread(r->fd, r->buf + r->end, toread, r->fpos);
+	if (rv < 0)
+		return -1;
+
+	r->end += rv;
+	r->fpos += rv;
+
+	return r->end - r->start;
+}
+
+/** Read exactly count bytes (which must not be more than READER_BUFSIZE) into
+ * dst. Returns 0 on success, -1 on error or if the file is too short. */
+static int tfr_read(struct tf_reader *r, void *dst, size_t count)
+{
+	if (tfr_fill(r, count) < (ssize_t) count)
+		return -1;
+
+	memcpy(dst, r->buf + r->start, count);
+	r->start += count;
+
+	return 0;
+}
+
+/** Get a pointer to the next chunk of the file, of up to max bytes, and
+ * consume it. The pointer is valid until the next call. Returns the length of
+ * the chunk, 0 on EOF, or -1 on error. */
+static ssize_t tfr_next(struct tf_reader *r, size_t max, unsigned char **p)
+{
+	ssize_t avail;
+
+	avail = tfr_fill(r, 1);
+	if (avail <= 0)
+		return avail;
+
+	if (avail > max)
+		avail = max;
+
+	*p = r->buf + r->start;
+	r->start += avail;
+
+	return avail;
+}
+
+/** Get a pointer to the next count bytes (which must not be more than
+ * READER_BUFSIZE), and consume them. The pointer is valid until the next
+ * call. Returns NULL on error or if the file is too short. */
+static unsigned char *tfr_get(struct tf_reader *r, size_t count)
 {
-	int rv;
 	unsigned char *p;
-	struct operation *op, *tmp;
-	struct on_disk_hdr hdr;
-	struct on_disk_ophdr ophdr;
-	struct on_disk_trailer trailer;
 
-	rv = -1;
+	if (tfr_fill(r, count) < (ssize_t) count)
+		return NULL;
+
+	p = r->buf + r->start;
+	r->start += count;
+
+	return p;
+}
+
+/** Skip count bytes. Returns 0 on success, -1 on error or if the file is too
+ * short. */
+static int tfr_skip(struct tf_reader *r, uint64_t count)
+{
+	ssize_t clen;
+	unsigned char *p;
+
+	for (; count > 0; count -= clen) {
+		clen = tfr_next(r, count < READER_BUFSIZE ?
+				count : READER_BUFSIZE, &p);
+		if (clen <= 0)
+			return -1;
+	}
 
-	if (len < sizeof(hdr) + sizeof(ophdr) + sizeof(trailer))
+	return 0;
+}
+
+/** Current position of the reader in the file */
+static off_t tfr_pos(struct tf_reader *r)
+{
+	return r->fpos - (r->end - r->start);
+}
+
+/** Number of bytes left to read */
+static uint64_t tfr_left(struct tf_reader *r)
+{
+	return r->len - tfr_pos(r);
+}
+
+/** Find out the version of the transaction file, without consuming
+ * anything. Returns the version, or -1 if it's not a known one. */
+static int tfr_version(struct tf_reader *r)
+{
+	uint16_t ver;
+
+	if (tfr_fill(r, sizeof(ver)) < (ssize_t) sizeof(ver))
 		return -1;
 
-	p = map;
+	memcpy(&ver, r->buf + r->start, sizeof(ver));
+
+	if (ntohs(ver) == 1)
+		return 1;
+	else if (letohs(ver) == 2)
+		return 2;
+
+	return -1;
+}
 
-	memcpy(&hdr, p, sizeof(hdr));
-	p += sizeof(hdr);
+/** Checksum the next len bytes of the file. Returns 0 on success, -1 on
+ * error or if the file is too short. */
+static int tfr_checksum(struct tf_reader *r, uint64_t len, uint32_t *csum)
+{
+	ssize_t clen;
+	unsigned char *p;
+
+	for (; len > 0; len -= clen) {
+		clen = tfr_next(r, len < READER_BUFSIZE ?
+				len : READER_BUFSIZE, &p);
+		if (clen <= 0)
+			return -1;
+		*csum = checksum_buf(*csum, p, clen);
+	}
+
+	return 0;
+}
+
+/** Write the next len bytes of the file to fd, at the given offset. Returns 0
+ * on success, -1 if the file is too short, -3 on I/O errors. */
+static int tfr_apply(struct tf_reader *r, uint64_t len, int fd, off_t offset)
+{
+	ssize_t clen;
+	uint64_t done;
+	unsigned char *p;
+
+	for (done = 0; done < len; done += clen) {
+		clen = tfr_next(r, len - done < READER_BUFSIZE ?
+				len - done : READER_BUFSIZE, &p);
+		if (clen < 0)
+			return -3;
+		else if (clen == 0)
+			return -1;
+
+		if (spwrite(fd, p, clen, offset + done) != clen)
+			return -3;
+	}
+
+	return 0;
+}
+
+/** tfr_opdata() for operations that extend the file: undo the operation,
+ * unless we're only checksumming. Returns 0 on success, -1 if the operation
+ * is broken, -3 on I/O errors. */
+static int tfr_extend(const struct on_disk_ophdr *ophdr, uint32_t *csum,
+		int fd)
+{
+	off_t end;
+	struct stat st;
+
+	if (ophdr->flags != OPF_EXTEND || ophdr->dlen != 0)
+		return -1;
+
+	if (csum != NULL)
+		return 0;
+
+	if (fstat(fd, &st) != 0)
+		return -3;
+
+	/* the data after the operation may have been written by other
+	 * transactions, which we must not lose */
+	end = ophdr->offset + ophdr->len;
+	if (st.st_size > end) {
+		if (fill_zeros(fd, ophdr->len, ophdr->offset) != 0)
+			return -3;
+	} else if (st.st_size > (off_t) ophdr->offset) {
+		if (ftruncate(fd, ophdr->offset) != 0 || fsync(fd) != 0)
+			return -3;
+	}
+
+	return 0;
+}
+
+/** tfr_opdata() for operations stored as a delta */
+static int tfr_delta(struct tf_reader *r, const struct on_disk_ophdr *ophdr,
+		uint32_t *csum, int fd)
+{
+	int rv;
+	uint64_t pos, stored, gap, len;
+	struct on_disk_run run;
+
+	pos = 0;
+	for (stored = 0; stored < ophdr->dlen; stored += len) {
+		if (ophdr->dlen - stored < sizeof(run))
+			return -1;
+		if (tfr_read(r, &run, sizeof(run)) != 0)
+			return -1;
+		stored += sizeof(run);
+		if (csum != NULL)
+			*csum = checksum_buf(*csum, (unsigned char *) &run,
+					sizeof(run));
+
+		gap = letohl(run.gap);
+		len = letohl(run.len);
+		if (gap > ophdr->len - pos || len > ophdr->len - pos - gap
+				|| len > ophdr->dlen - stored)
+			return -1;
+		pos += gap;
+
+		if (csum != NULL)
+			rv = tfr_checksum(r, len, csum);
+		else
+			rv = tfr_apply(r, len, fd, ophdr->offset + pos);
+		if (rv != 0)
+			return rv;
+
+		pos += len;
+	}
+
+	if (tfr_skip(r, PADDED_LEN(ophdr->dlen) - ophdr->dlen) != 0)
+		return -1;
 
-	hdr_ntoh(&hdr);
+	return 0;
+}
+
+/** Go through the data of a version 2 operation, including its padding, and
+ * either checksum it (if csum is not NULL) or write it to fd. Compressed
+ * data is decompressed one block at a time, and checked in both cases.
+ * Returns 0 on success, -1 if the file is broken, -2 if the compressed data
+ * is not valid, -3 on I/O or memory errors. */
+static int tfr_opdata(struct tf_reader *r, const struct on_disk_ophdr *ophdr,
+		uint32_t *csum, int fd)
+{
+	int rv;
+	uint32_t bhdr;
+	uint64_t done, stored;
+	size_t blen, clen;
+	unsigned char *p, *data;
+
+	if (PADDED_LEN(ophdr->dlen) > tfr_left(r))
+		return -1;
+
+	if (ophdr->flags & OPF_EXTEND)
+		return tfr_extend(ophdr, csum, fd);
+
+	if ((ophdr->flags & OPF_DELTA) && (ophdr->flags & OPF_COMPRESSED))
+		return -1;
+
+	if (ophdr->flags & OPF_DELTA)
+		return tfr_delta(r, ophdr, csum, fd);
+
+	if (!(ophdr->flags & OPF_COMPRESSED)) {
+		if (ophdr->dlen != ophdr->len)
+			return -1;
+
+		if (csum != NULL)
+			rv = tfr_checksum(r, ophdr->len, csum);
+		else
+			rv = tfr_apply(r, ophdr->len, fd, ophdr->offset);
+		if (rv != 0)
+			return rv;
+
+		goto skip_padding;
+	}
+
+	if (r->dbuf == NULL) {
+		r->dbuf = malloc(LZ_BLOCK_SIZE);
+		if (r->dbuf == NULL)
+			return -3;
+	}
+
+	rv = 0;
+	stored = 0;
+	for (done = 0; done < ophdr->len; done += blen) {
+		blen = ophdr->len - done;
+		if (blen > LZ_BLOCK_SIZE)
+			blen = LZ_BLOCK_SIZE;
+
+		if (ophdr->dlen - stored < sizeof(bhdr))
+			return -1;
+		if (tfr_read(r, &bhdr, sizeof(bhdr)) != 0)
+			return -1;
+		stored += sizeof(bhdr);
+		if (csum != NULL)
+			*csum = checksum_buf(*csum, (unsigned char *) &bhdr,
+					sizeof(bhdr));
+
+		clen = letohl(bhdr);
+		if (clen > blen || clen > ophdr->dlen - stored)
+			return -1;
+
+		p = tfr_get(r, clen);
+		if (p == NULL)
+			return -1;
+		stored += clen;
+		if (csum != NULL)
+			*csum = checksum_buf(*csum, p, clen);
+
+		/* blocks stored with their full length are not compressed */
+		data = p;
+		if (clen < blen) {
+			if (lz_decompress(p, clen, r->dbuf, blen)
+					!= (ssize_t) blen) {
+				rv = -2;
+				continue;
+			}
+			data = r->dbuf;
+		}
+
+		if (csum == NULL && spwrite(fd, data, blen,
+					ophdr->offset + done) != blen)
+			return -3;
+	}
+
+	if (stored != ophdr->dlen)
+		return -1;
+
+skip_padding:
+	if (tfr_skip(r, PADDED_LEN(ophdr->dlen) - ophdr->dlen) != 0)
+		return -1;
+
+	return rv;
+}
+
+/** fill_trans() for version 1 files */
+static int fill_trans_v1(struct tf_reader *r, struct jtrans *ts)
+{
+	uint32_t csum;
+	struct on_disk_hdr_v1 hdr;
+	struct on_disk_ophdr_v1 ophdr;
+	struct on_disk_trailer_v1 trailer;
+
+	if (r->len < sizeof(hdr) + sizeof(ophdr) + sizeof(trailer))
+		return -1;
+
+	if (tfr_read(r, &hdr, sizeof(hdr)) != 0)
+		return -1;
+	csum = checksum_buf(0, (unsigned char *) &hdr, sizeof(hdr));
+
+	hdr_v1_ntoh(&hdr);
 	if (hdr.ver != 1)
 		return -1;
 
 	ts->id = hdr.trans_id;
 	ts->flags = hdr.flags;
-	ts->numops_r = 0;
-	ts->numops_w = 0;
-	ts->len_w = 0;
 
 	for (;;) {
-		if (p + sizeof(ophdr) > map + len)
-			goto error;
-
-		memcpy(&ophdr, p,  sizeof(ophdr));
-		p += sizeof(ophdr);
+		if (tfr_read(r, &ophdr, sizeof(ophdr)) != 0)
+			return -1;
+		csum = checksum_buf(csum, (unsigned char *) &ophdr,
+				sizeof(ophdr));
 
-		ophdr_ntoh(&ophdr);
+		ophdr_v1_ntoh(&ophdr);
 
 		if (ophdr.len == 0 && ophdr.offset == 0) {
 			/* This header marks the end of the operations */
 			break;
 		}
 
-		if (p + ophdr.len > map + len)
-			goto error;
+		if (ophdr.len > tfr_left(r))
+			return -1;
 
-		op = malloc(sizeof(struct operation));
-		if (op == NULL)
-			goto error;
+		/* go through the data, just to checksum it */
+		if (tfr_checksum(r, ophdr.len, &csum) != 0)
+			return -1;
 
-		op->len = ophdr.len;
-		op->offset = ophdr.offset;
-		op->direction = D_WRITE;
+		ts->numops_w++;
+		ts->len_w += ophdr.len;
+	}
 
-		op->buf = (void *) p;
-		p += op->len;
+	if (tfr_read(r, &trailer, sizeof(trailer)) != 0)
+		return -1;
 
-		op->pdata = NULL;
+	trailer_v1_ntoh(&trailer);
 
-		if (ts->op == NULL) {
-			ts->op = op;
-			op->prev = NULL;
-			op->next = NULL;
-		} else {
-			for (tmp = ts->op; tmp->next != NULL; tmp = tmp->next)
-				;
-			tmp->next = op;
-			op->prev = tmp;
-			op->next = NULL;
-		}
+	if (trailer.numops != ts->numops_w)
+		return -1;
+
+	/* the checksum covers everything but the trailer, which must be at
+	 * the very end of the file */
+	if (tfr_left(r) != 0 || csum != trailer.checksum)
+		return -2;
+
+	return 0;
+}
+
+/** fill_trans() for version 2 files */
+static int fill_trans_v2(struct tf_reader *r, struct jtrans *ts)
+{
+	int rv, csum_ok;
+	uint64_t i, len_w;
+	uint32_t csum, opcsum, ccsum;
+	struct on_disk_hdr hdr;
+	struct on_disk_ophdr ophdr;
+	struct on_disk_trailer trailer;
+
+	if (tfr_read(r, &hdr, sizeof(hdr)) != 0)
+		return -1;
 
+	/* the transaction checksum begins with the header, as stored */
+	csum = checksum_buf(0, (unsigned char *) &hdr, sizeof(hdr));
+
+	hdr_letoh(&hdr);
+	if (hdr.ver != 2)
+		return -1;
+
+	/* a cheap sanity check before going through the operations */
+	if (hdr.numops > tfr_left(r) / sizeof(ophdr))
+		return -1;
+
+	ts->id = hdr.trans_id;
+	ts->flags = hdr.flags;
+
+	/* we keep going through the file even if a checksum doesn't match,
+	 * so structural problems are reported as such */
+	csum_ok = 1;
+	len_w = 0;
+
+	for (i = 0; i < hdr.numops; i++) {
+		if (tfr_read(r, &ophdr, sizeof(ophdr)) != 0)
+			return -1;
+
+		csum = checksum_buf(csum, (unsigned char *) &ophdr.checksum,
+				sizeof(ophdr.checksum));
+
+		/* the operation checksum covers its header (with the
+		 * checksum field set to 0) and its data, as stored */
+		ophdr_letoh(&ophdr);
+		opcsum = ophdr.checksum;
+		ophdr.checksum = 0;
+		ophdr_htole(&ophdr);
+		ccsum = checksum_buf(0, (unsigned char *) &ophdr,
+				sizeof(ophdr));
+		ophdr_letoh(&ophdr);
+
+		rv = tfr_opdata(r, &ophdr, &ccsum, -1);
+		if (rv == -2)
+			csum_ok = 0;
+		else if (rv != 0)
+			return rv;
+
+		if (ccsum != opcsum)
+			csum_ok = 0;
+
+		len_w += ophdr.len;
 		ts->numops_w++;
-		ts->len_w += op->len;
+		ts->len_w += ophdr.len;
 	}
 
-	if (p + sizeof(trailer) > map + len)
-		goto error;
+	if (len_w != hdr.total_len)
+		return -1;
 
-	memcpy(&trailer, p, sizeof(trailer));
-	p += sizeof(trailer);
+	if (tfr_read(r, &trailer, sizeof(trailer)) != 0)
+		return -1;
 
-	trailer_ntoh(&trailer);
+	trailer_letoh(&trailer);
 
-	if (trailer.numops != ts->numops_w)
-		goto error;
+	if (trailer.numops != hdr.numops || tfr_left(r) != 0)
+		return -1;
 
-	if (checksum_buf(0, map, len - sizeof(trailer)) != trailer.checksum) {
-		rv = -2;
-		goto error;
-	}
+	if (!csum_ok || csum != trailer.checksum)
+		return -2;
 
 	return 0;
+}
 
-error:
-	while (ts->op != NULL) {
-		tmp = ts->op->next;
-		free(ts->op);
-		ts->op = tmp;
+/** Fill a transaction structure with the information of the given transaction
+ * file, and verify it. The file is read sequentially in fixed-size chunks, and
+ * the operations are not loaded: use replay_trans() to apply them. Useful for
+ * checking purposes.
+ * @returns 0 on success, -1 if the file was broken, -2 if the checksums didn't
+ *	match, -3 on I/O or memory errors
+ */
+int fill_trans(int fd, off_t len, struct jtrans *ts)
+{
+	int rv;
+	struct tf_reader r;
+
+	if (tfr_init(&r, fd, len) != 0)
+		return -3;
+
+	ts->numops_r = 0;
+	ts->numops_w = 0;
+	ts->len_w = 0;
+
+	switch (tfr_version(&r)) {
+	case 1:
+		rv = fill_trans_v1(&r, ts);
+		break;
+	case 2:
+		rv = fill_trans_v2(&r, ts);
+		break;
+	default:
+		rv = -1;
 	}
+
+	tfr_free(&r);
 	return rv;
 }
 
+/** replay_trans() for version 1 files */
+static int replay_trans_v1(struct tf_reader *r, struct jtrans *ts)
+{
+	int rv;
+	struct on_disk_hdr_v1 hdr;
+	struct on_disk_ophdr_v1 ophdr;
+
+	if (tfr_read(r, &hdr, sizeof(hdr)) != 0)
+		return -1;
+
+	for (;;) {
+		if (tfr_read(r, &ophdr, sizeof(ophdr)) != 0)
+			return -1;
+
+		ophdr_v1_ntoh(&ophdr);
+
+		if (ophdr.len == 0 && ophdr.offset == 0)
+			break;
+
+		rv = tfr_apply(r, ophdr.len, ts->fs->fd, ophdr.offset);
+		if (rv != 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+/** replay_trans() for version 2 files */
+static int replay_trans_v2(struct tf_reader *r, struct jtrans *ts)
+{
+	int rv;
+	uint64_t i;
+	struct on_disk_hdr hdr;
+	struct on_disk_ophdr ophdr;
+
+	if (tfr_read(r, &hdr, sizeof(hdr)) != 0)
+		return -1;
+	hdr_letoh(&hdr);
+
+	for (i = 0; i < hdr.numops; i++) {
+		if (tfr_read(r, &ophdr, sizeof(ophdr)) != 0)
+			return -1;
+		ophdr_letoh(&ophdr);
+
+		rv = tfr_opdata(r, &ophdr, NULL, ts->fs->fd);
+		if (rv == -2)
+			return -1;
+		else if (rv != 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+/** Apply the operations of a transaction file to ts->fs, going through it
+ * with a fixed-size buffer. The file must have been verified with
+ * fill_trans() first.
+ * @returns 0 on success, -1 if the file was broken, -3 on I/O or memory
+ *	errors
+ */
+int replay_trans(int fd, off_t len, struct jtrans *ts)
+{
+	int rv;
+	struct tf_reader r;
+
+	if (tfr_init(&r, fd, len) != 0)
+		return -3;
+
+	switch (tfr_version(&r)) {
+	case 1:
+		rv = replay_trans_v1(&r, ts);
+		break;
+	case 2:
+		rv = replay_trans_v2(&r, ts);
+		break;
+	default:
+		rv = -1;
+	}
+
+	tfr_free(&r);
+	return rv;
+}
@@ -7,24 +7,43 @@
 
 
 struct journal_op {
-	int id;
+	uint64_t id;
 	int fd;
-	int numops;
+	uint64_t numops;
+	uint64_t expected_numops;
+	uint32_t flags;
 	char *name;
 	uint32_t csum;
 	struct jfs *fs;
+
+	/* LSN tracking, see lsn.c */
+	int lsn_tracked;
+	struct journal_op *lsn_prev;
+	struct journal_op *lsn_next;
 };
 
 typedef struct journal_op jop_t;
 
-struct journal_op *journal_new(struct jfs *fs, unsigned int flags);
+struct journal_op *journal_new(struct jfs *fs, unsigned int flags,
+		uint64_t numops, uint64_t len);
 int journal_add_op(struct journal_op *jop, unsigned char *buf, size_t len,
+		off_t offset, unsigned char *pdata, size_t plen);
+size_t journal_splice_threshold(struct jfs *fs);
+int journal_add_opv(struct journal_op *jop, const struct iovec *iov,
+		int iovcnt, size_t len, off_t offset);
+int journal_add_op_fd(struct journal_op *jop, int fd, off_t foff, size_t len,
 		off_t offset);
+int journal_add_extend(struct journal_op *jop, size_t len, off_t offset);
 void journal_pre_commit(struct journal_op *jop);
 int journal_commit(struct journal_op *jop);
+int journal_sync(struct journal_op *jop, int sync_dir);
 int journal_free(struct journal_op *jop, int do_unlink);
+void journal_free_cache(struct jfs *fs);
+int mark_broken(struct jfs *fs);
+int fsync_dir(int fd);
 
-int fill_trans(unsigned char *map, off_t len, struct jtrans *ts);
+int fill_trans(int fd, off_t len, struct jtrans *ts);
+int replay_trans(int fd, off_t len, struct jtrans *ts);
 
 #endif
 
@@ -88,6 +88,170 @@ enum jfsck_return {
 	J_EIO = -5,
 };
 
+/** Checksum algorithms for jopen_ex().
+ *
+ * @see struct jopen_opts
+ * @ingroup basic
+ */
+enum jopen_checksum {
+	/** The default, currently J_CSUM_CRC32C */
+	J_CSUM_DEFAULT = 0,
+
+	/** CRC32C (Castagnoli), the only one the journal format supports */
+	J_CSUM_CRC32C = 1,
+};
+
+/** Lock backends for jopen_ex().
+ *
+ * @see struct jopen_opts
+ * @ingroup basic
+ */
+enum jopen_lock {
+	/** The default, currently J_LOCK_FCNTL */
+	J_LOCK_DEFAULT = 0,
+
+	/** fcntl() locks on the file ranges */
+	J_LOCK_FCNTL = 1,
+
+	/** No locking at all, the same as J_NOLOCK */
+	J_LOCK_NONE = 2,
+};
+
+/** I/O backends for jopen_ex().
+ *
+ * @see struct jopen_opts
+ * @ingroup basic
+ */
+enum jopen_io {
+	/** The default, currently J_IO_POSIX */
+	J_IO_DEFAULT = 0,
+
+	/** pread() and pwrite() */
+	J_IO_POSIX = 1,
+};
+
+/** Options for jopen_ex().
+ *
+ * Zero is the default for every field, so the usual way to use it is to
+ * zero it with memset() and then set only the fields you need.
+ *
+ * @see jopen_ex()
+ * @ingroup basic
+ */
+struct jopen_opts {
+	/** Journal flags, the same as jopen()'s jflags */
+	unsigned int jflags;
+
+	/** Journal directory, or NULL to use the default (a directory named
+	 * after the file, next to it); it's created if it doesn't exist */
+	const char *jdir;
+
+	/** Checksum algorithm, from enum jopen_checksum */
+	int checksum;
+
+	/** Lock backend, from enum jopen_lock */
+	int lock;
+
+	/** I/O backend, from enum jopen_io */
+	int io;
+
+	/** If not 0, start an autosync thread with this as max_sec
+	 * @see jfs_autosync_start() */
+	time_t autosync_max_sec;
+
+	/** max_bytes for the autosync thread
+	 * @see jfs_autosync_start() */
+	size_t autosync_max_bytes;
+
+	/** For J_ASYNC, the maximum number of transactions waiting to be
+	 * applied, or 0 for the default (128); commits wait while it's
+	 * reached */
+	unsigned int async_max_pending;
+
+	/** For J_ASYNC, the maximum number of bytes waiting to be applied, or
+	 * 0 for the default (64 MiB); commits wait while it's reached */
+	size_t async_max_bytes;
+
+	/** For J_ASYNC, how long to wait after a transaction is committed for
+	 * others to be applied and synced along with it, in microseconds */
+	unsigned long group_commit_usec;
+
+	/** If not 0, jtrans_free() keeps up to this many transactions of the
+	 * file in a per-thread cache, reset but with their buffers, and
+	 * jtrans_new() reuses them
+	 * @see jtrans_reset() */
+	unsigned int trans_cache;
+
+	/** If not 0, the most bytes the file's transactions can hold in
+	 * memory: each write operation holds twice its length (its data and
+	 * the previous data, read when committing), or just its length with
+	 * J_NOROLLBACK or if it's at least spill_threshold long, from the
+	 * moment it's added until its transaction is reset or freed. Adds
+	 * that would go over it wait until other transactions free enough,
+	 * except the ones of a transaction that already holds memory, which
+	 * fail with EAGAIN
+	 * @see jfs_budget_stats() */
+	size_t mem_budget;
+
+	/** If not 0, adds that would go over mem_budget fail with EAGAIN
+	 * instead of waiting */
+	int budget_nowait;
+
+	/** If not 0, the most lingering transactions the file can have, each
+	 * one keeping its transaction file open; the commit that reaches it
+	 * calls jsync() before returning
+	 * @see jfs_budget_stats() */
+	unsigned int fd_budget;
+
+	/** Write operations at least this long, or 0 for the default
+	 * (8 MiB), don't keep their previous data in memory when they're
+	 * committed: it's copied to an undo file in the journal directory,
+	 * and jtrans_rollback() reads it back from there; they're charged
+	 * just their length against mem_budget */
+	size_t spill_threshold;
+
+	/** If not 0, operations with at least this many bytes of data to
+	 * journal write it to the transaction file with vmsplice() and
+	 * splice() instead of writev(), where available. Whether that's
+	 * cheaper depends on the system and the filesystem, so it's off by
+	 * default; J_SPLICE_AUTO measures it */
+	size_t splice_threshold;
+};
+
+/** Memory and file descriptor accounting of an open file.
+ *
+ * @see jfs_budget_stats(), struct jopen_opts
+ * @ingroup basic
+ */
+struct jfs_budget_stats {
+	/** Bytes held in memory by the file's transactions */
+	size_t mem_used;
+
+	/** Highest mem_used since the file was opened */
+	size_t mem_peak;
+
+	/** The memory budget, or 0 if there is none */
+	size_t mem_budget;
+
+	/** Number of adds that had to wait for memory */
+	uint64_t mem_waits;
+
+	/** Number of adds that failed because of the memory budget */
+	uint64_t mem_failures;
+
+	/** Transaction files kept open by lingering transactions */
+	unsigned int fds_used;
+
+	/** Highest fds_used since the file was opened */
+	unsigned int fds_peak;
+
+	/** The fd budget, or 0 if there is none */
+	unsigned int fd_budget;
+
+	/** Number of times jsync() was called because of the fd budget */
+	uint64_t early_syncs;
+};
+
 
 
 /*
@@ -99,8 +263,13 @@ enum jfsck_return {
  * Takes the same parameters as the UNIX open(2), with an additional one for
  * internal flags.
  *
- * The only supported internal flag is J_LINGER, which enables lingering
- * transactions.
+ * The supported internal flags are J_LINGER, which enables lingering
+ * transactions; J_COMPRESS, which compresses the data stored in the journal;
+ * J_DELTA, which stores in the journal only the bytes that differ from the
+ * previous contents of the file; J_FASTEXTEND, which doesn't journal the
+ * data of the transactions that only extend the file; and J_ASYNC, which
+ * makes commits return once the journal is on disk and applies the data in
+ * a background thread.
  *
  * @param name path to the file to open
  * @param flags flags to pass to open(2)
@@ -113,12 +282,31 @@ enum jfsck_return {
  */
 jfs_t *jopen(const char *name, int flags, int mode, unsigned int jflags);
 
+/** Open a file, with extended options.
+ *
+ * Works like jopen(), but the journal flags and the rest of the options are
+ * given in a struct jopen_opts.
+ *
+ * @param name path to the file to open
+ * @param flags flags to pass to open(2)
+ * @param mode mode to pass to open(2)
+ * @param opts options, or NULL to use the defaults
+ * @returns a new jfs_t that identifies the open file on success, or NULL on
+ *	error (with errno set to EINVAL if the options are not valid)
+ * @see jopen(), struct jopen_opts
+ * @ingroup basic
+ */
+jfs_t *jopen_ex(const char *name, int flags, int mode,
+		const struct jopen_opts *opts);
+
 /** Close a file opened with jopen().
  *
  * After a call to this function, the memory allocated for the open file will
  * be freed.
  *
  * If there was an autosync thread started for this file, it will be stopped.
+ * If it was opened with jfopen(), the data it has buffered is written first,
+ * just like jfclose() does.
  *
  * @param fs open file
  * @returns 0 on success, -1 on error
@@ -127,7 +315,8 @@ jfs_t *jopen(const char *name, int flags, int mode, unsigned int jflags);
  */
 int jclose(jfs_t *fs);
 
-/** Sync a file. Makes sense only when using lingering transactions.
+/** Sync a file. Makes sense only when using lingering transactions or
+ * J_ASYNC, in which case it waits for the data to be applied.
  *
  * @param fs open file
  * @returns 0 on success, -1 on error
@@ -138,11 +327,14 @@ int jsync(jfs_t *fs);
 /** Create a new transaction.
  *
  * Note that the final flags to use in the transaction will be the result of
- * ORing the flags parameter with fs' flags.
+ * ORing the flags parameter with fs' flags, except for the durability level
+ * (J_DUR_FULL, J_DUR_JOURNAL or J_DUR_ORDERED), which replaces fs' one if
+ * given.
  *
  * @param fs open file the transaction will apply to
  * @param flags transaction flags
- * @returns a new transaction (must be freed using jtrans_free())
+ * @returns a new transaction (must be freed using jtrans_free()), or NULL on
+ *	error (EINVAL if the durability level can't be used on fs)
  * @see jtrans_free()
  * @ingroup basic
  */
@@ -171,6 +363,32 @@ jtrans_t *jtrans_new(jfs_t *fs, unsigned int flags);
  */
 int jtrans_add_w(jtrans_t *ts, const void *buf, size_t count, off_t offset);
 
+/** Add a write operation to a transaction, with the data taken from another
+ * file.
+ *
+ * It's like jtrans_add_w(), but the count bytes to write are the ones of fd
+ * at src_off, and they are not copied into memory: at commit time they're
+ * copied to the transaction file a piece at a time (they have to be read to
+ * be checksummed), and then to the file, with copy_file_range() if the
+ * platform supports it, which keeps them out of user space entirely. This
+ * way a big file can be imported using little memory.
+ *
+ * fd must stay open, and its data unchanged, until the transaction is
+ * committed. If the transaction may be rolled back, see
+ * jopen_opts.spill_threshold too.
+ *
+ * @param ts transaction
+ * @param fd file to take the data from
+ * @param src_off offset of the data in fd
+ * @param count how many bytes to write
+ * @param offset offset to write at
+ * @returns 0 on success, -1 on error
+ * @ingroup basic
+ * @see jtrans_add_w()
+ */
+int jtrans_add_w_fd(jtrans_t *ts, int fd, off_t src_off, size_t count,
+		off_t offset);
+
 /** Add a read operation to a transaction.
  *
  * An operation consists of a buffer, its length, and the offset to read it
@@ -217,6 +435,28 @@ int jtrans_add_r(jtrans_t *ts, void *buf, size_t count, off_t offset);
  */
 ssize_t jtrans_commit(jtrans_t *ts);
 
+/** Commit many transactions at once.
+ *
+ * It's like calling jtrans_commit() on each of them in order, but the
+ * transaction files of consecutive transactions of the same file are written
+ * and then synced together, and so is their data, so the cost of the syncs is
+ * shared. Each transaction is still atomic on its own: if one fails, the
+ * others are not affected. Transactions that overlap with a previous one of
+ * the batch start a new group, so they see its data.
+ *
+ * A transaction must not appear more than once in the array.
+ *
+ * @param ts array of transactions
+ * @param n number of transactions in the array
+ * @param status array of n elements where the result of each commit is
+ * 	stored, as jtrans_commit() would return it; can be NULL
+ * @returns the number of transactions that were committed successfully
+ * @see jtrans_commit()
+ * @ingroup basic
+ */
+unsigned int jtrans_commit_many(jtrans_t **ts, unsigned int n,
+		ssize_t *status);
+
 /** Rollback a transaction.
  *
  * This function atomically undoes a previous committed transaction. After its
@@ -232,10 +472,57 @@ ssize_t jtrans_commit(jtrans_t *ts);
  */
 ssize_t jtrans_rollback(jtrans_t *ts);
 
+/** Get the number of bytes the last commit didn't write.
+ *
+ * When committing, write operations that would leave the data as it already
+ * is on disk are skipped, and if all of them are, the transaction doesn't
+ * even touch the journal. This only happens if the previous data gets read,
+ * that is, when J_NOROLLBACK is not used, and only for operations that don't
+ * extend the file or overlap with other write operations of the same
+ * transaction.
+ *
+ * @param ts transaction
+ * @returns the sum of the lengths of the skipped write operations
+ * @see jtrans_commit()
+ * @ingroup basic
+ */
+size_t jtrans_elided(jtrans_t *ts);
+
+/** Get the log sequence number (LSN) of the last commit.
+ *
+ * LSNs grow monotonically: a transaction committed after another one always
+ * gets a bigger LSN, even across processes. Commits that didn't need to touch
+ * the journal (because they had no write operations, or all of them were
+ * skipped) have LSN 0.
+ *
+ * @param ts transaction
+ * @returns the LSN of the last successful commit of the transaction, or 0
+ * @see jfs_durable_lsn(), jfs_wait_durable()
+ * @ingroup basic
+ */
+uint64_t jtrans_lsn(jtrans_t *ts);
+
+/** Remove all the operations of a transaction, so it can be reused.
+ *
+ * The transaction keeps its flags, and the memory used by the operations,
+ * which the ones added next reuse; so a loop that resets and fills the same
+ * transaction doesn't need to allocate memory once it has gone through the
+ * biggest one.
+ *
+ * @param ts transaction to reset
+ * @see jtrans_new(), jtrans_free()
+ * @ingroup basic
+ */
+void jtrans_reset(jtrans_t *ts);
+
 /** Free a transaction structure.
+ *
+ * If the file was opened with jopen_opts.trans_cache, the transaction may be
+ * reset and kept in a cache private to the calling thread, for jtrans_new()
+ * to reuse it.
  *
  * @param ts transaction to free
- * @see jtrans_new()
+ * @see jtrans_new(), jtrans_reset()
  * @ingroup basic
  */
 void jtrans_free(jtrans_t *ts);
@@ -282,6 +569,67 @@ int jfs_autosync_start(jfs_t *fs, time_t max_sec, size_t max_bytes);
 int jfs_autosync_stop(jfs_t *fs);
 
 
+/*
+ * Durability
+ */
+
+/** Get the durable log sequence number of an open file.
+ *
+ * All the transactions committed through this file with an LSN up to the
+ * returned one will survive a crash.
+ *
+ * @param fs open file
+ * @returns the durable LSN
+ * @see jtrans_lsn()
+ * @ingroup basic
+ */
+uint64_t jfs_durable_lsn(jfs_t *fs);
+
+/** Wait until the given LSN is durable.
+ *
+ * @param fs open file
+ * @param lsn LSN to wait for, as returned by jtrans_lsn()
+ * @param timeout_ms maximum number of milliseconds to wait, or a negative
+ *	number to wait for as long as needed
+ * @returns 0 if the LSN is durable, -1 if the timeout expired first
+ * @see jfs_durable_lsn()
+ * @ingroup basic
+ */
+int jfs_wait_durable(jfs_t *fs, uint64_t lsn, long timeout_ms);
+
+/** Get a file descriptor that becomes readable when the durable LSN
+ * advances.
+ *
+ * It's an eventfd(2): reading 8 bytes from it returns the number of times it
+ * advanced since the last read, and resets it. It's only created the first
+ * time this function is called, and it's closed by jclose().
+ *
+ * @param fs open file
+ * @returns the file descriptor, or -1 on error or if the platform does not
+ *	support it
+ * @see jfs_durable_lsn()
+ * @ingroup basic
+ */
+int jfs_durable_eventfd(jfs_t *fs);
+
+
+/*
+ * Budgets
+ */
+
+/** Get the memory and file descriptor accounting of an open file.
+ *
+ * It's meant to help sizing jopen_opts.mem_budget and jopen_opts.fd_budget,
+ * so it's kept even if the file has no budgets.
+ *
+ * @param fs open file
+ * @param stats where to store the accounting
+ * @see struct jfs_budget_stats
+ * @ingroup basic
+ */
+void jfs_budget_stats(jfs_t *fs, struct jfs_budget_stats *stats);
+
+
 /*
  * Journal checker
  */
@@ -347,7 +695,31 @@ ssize_t jpread(jfs_t *fs, void *buf, size_t count, off_t offset);
  */
 ssize_t jreadv(jfs_t *fs, const struct iovec *vector, int count);
 
+/** Read from the file at the given offset into multiple buffers. Works just
+ * like UNIX preadv(2).
+ *
+ * Like jpread(), it doesn't use nor change the file pointer, so it can be
+ * used by many threads at the same time.
+ *
+ * @param fs file to read from
+ * @param vector buffers used to store the data
+ * @param count number of buffers
+ * @param offset offset to read from
+ * @returns number of bytes read on success, or -1 on error
+ * @see preadv(2)
+ * @ingroup unix
+ */
+ssize_t jpreadv(jfs_t *fs, const struct iovec *vector, int count,
+		off_t offset);
+
 /** Write to the file. Works just like UNIX write(2).
+ *
+ * If the file was opened with O_APPEND, each write reserves its range at the
+ * end of the file and then commits without holding any lock, so concurrent
+ * appends don't wait for each other's syncs. Unlike write(2), this means a
+ * failed append can leave a hole: if a later append has reserved its range
+ * already, the failed one can't be given back, and the file will read as
+ * zeros there. The same goes for jwritev().
  *
  * @param fs file to write to
  * @param buf buffer used to read the data from
@@ -381,6 +753,24 @@ ssize_t jpwrite(jfs_t *fs, const void *buf, size_t count, off_t offset);
  */
 ssize_t jwritev(jfs_t *fs, const struct iovec *vector, int count);
 
+/** Write to the file at the given offset from multiple buffers. Works just
+ * like UNIX pwritev(2).
+ *
+ * The buffers are written as a single operation of a single transaction, so
+ * the write is atomic. Like jpwrite(), it doesn't use nor change the file
+ * pointer, so it can be used by many threads at the same time.
+ *
+ * @param fs file to write to
+ * @param vector buffers used to read the data from
+ * @param count number of buffers
+ * @param offset offset to write at
+ * @returns number of bytes written on success, or -1 on error
+ * @see pwritev(2)
+ * @ingroup unix
+ */
+ssize_t jpwritev(jfs_t *fs, const struct iovec *vector, int count,
+		off_t offset);
+
 /** Truncates the file to the given length. Works just like UNIX ftruncate(2).
  *
  * @param fs file to truncate
@@ -392,6 +782,10 @@ ssize_t jwritev(jfs_t *fs, const struct iovec *vector, int count);
 int jtruncate(jfs_t *fs, off_t length);
 
 /** Reposition read/write file offset. Works just like UNIX lseek(2).
+ *
+ * The offset is kept by the library, so it doesn't need a system call
+ * (except for SEEK_END, which needs to know the size of the file). The
+ * offset of the real file descriptor is only updated by jfileno().
  *
  * @param fs file to change the offset to
  * @param offset offset to set
@@ -419,6 +813,8 @@ size_t jfread(void *ptr, size_t size, size_t nmemb, jfs_t *stream);
 
 size_t jfwrite(const void *ptr, size_t size, size_t nmemb, jfs_t *stream);
 
+int jfflush(jfs_t *stream);
+
 int jfileno(jfs_t *stream);
 
 int jfeof(jfs_t *stream);
@@ -460,7 +856,74 @@ FILE *jfsopen(jfs_t *stream, const char *mode);
  * @ingroup basic */
 #define J_LINGER	4
 
-/* Range 8-256 is reserved for future public use */
+/** Compress the data stored in the journal.
+ *
+ * @see jopen()
+ * @ingroup basic */
+#define J_COMPRESS	8
+
+/** Store only the bytes that changed in the journal.
+ *
+ * Has no effect if J_NOROLLBACK is also given.
+ *
+ * @see jopen()
+ * @ingroup basic */
+#define J_DELTA		16
+
+/** Return from commits once the journal is on disk, and apply the data in
+ * the background.
+ *
+ * Only valid for jopen(), and the file must not be opened by more than one
+ * process at the same time.
+ *
+ * @see jopen()
+ * @ingroup basic */
+#define J_ASYNC		32
+
+/** Sync both the journal and the data when committing, which is the default.
+ *
+ * Durability levels can be given to jopen(), and to jtrans_new() to override
+ * the file's for a single transaction.
+ *
+ * @see jopen(), jtrans_new()
+ * @ingroup basic */
+#define J_DUR_FULL	64
+
+/** Sync only the journal when committing, and defer the data sync to
+ * jsync(). Same as J_LINGER.
+ *
+ * @see J_DUR_FULL
+ * @ingroup basic */
+#define J_DUR_JOURNAL	128
+
+/** Don't sync anything when committing: background threads sync the journal
+ * and then apply the data, so the commits are pipelined. A crash can lose
+ * transactions but never tear them; use jfs_wait_durable() to know when
+ * they're safe. Only valid on files opened with J_ASYNC, and not with
+ * J_DELTA; otherwise jopen() and jtrans_new() fail with EINVAL.
+ *
+ * @see J_DUR_FULL
+ * @ingroup basic */
+#define J_DUR_ORDERED	(J_DUR_FULL | J_DUR_JOURNAL)
+
+/** Mask of the durability level flags.
+ * @internal */
+#define J_DUR_MASK	(J_DUR_FULL | J_DUR_JOURNAL)
+
+/** Load data in bulk: the writes past the point where the file ended when it
+ * was opened go straight to the file without being journaled, and are made
+ * durable by jsync() and jclose(). If we crash in the middle, jfsck()
+ * truncates the file back to where it was at the last jsync(), discarding
+ * the partially loaded data. Those writes are not atomic, so they must not
+ * overwrite data that was already loaded; the writes before that point are
+ * journaled as usual. Implies J_NOROLLBACK.
+ *
+ * Only valid for jopen(), the file must not be opened by more than one
+ * process at the same time, and it can't be used with J_ASYNC.
+ *
+ * @see jopen(), jsync()
+ * @ingroup basic */
+#define J_BULKLOAD	256
 
 /** Marks a file as read-only.
  *
@@ -489,6 +952,35 @@ FILE *jfsopen(jfs_t *stream, const char *mode);
  * @internal */
 #define J_ROLLBACKING	4096
 
+/** Don't journal the data of transactions that only write past the end of
+ * the file: the journal records just the ranges, the data is written and
+ * synced in place, and if we crash before the commit returns, jfsck()
+ * truncates the file back. It saves writing the data twice when appending.
+ *
+ * Only used with J_DUR_FULL, and not with J_ASYNC. It comes after the
+ * internal flags because it was added later, but it's a jopen() flag.
+ *
+ * @see jopen()
+ * @ingroup basic */
+#define J_FASTEXTEND	8192
+
+
+/*
+ * jopen_opts values
+ */
+
+/** Value for jopen_opts.splice_threshold that has the library find it out:
+ * the first file opened with it times writev() and splicing in its journal
+ * directory, for sizes from 64 KiB to 4 MiB, and picks the smallest size
+ * from which splicing is faster for all the bigger ones (or disables it if
+ * it never is). That takes writing a few tens of megabytes to a temporary
+ * file, once; the result is used for the rest of the process. The splice
+ * program in tests/performance does the same measurement in more detail.
+ *
+ * @see jopen_ex()
+ * @ingroup basic */
+#define J_SPLICE_AUTO	((size_t) -1)
+
 
 /*
  * jfsck() flags
@@ -0,0 +1,162 @@
+
+/*
+ * Log sequence numbers
+ *
+ * The LSN of a transaction is its id, so they grow monotonically and are
+ * ordered just like transactions are applied on recovery. Each open file
+ * keeps the list of the transactions it created that are not durable yet,
+ * in LSN order, and the durable LSN is the greatest one that has itself and
+ * all the previous ones durable.
+ */
+
+#include <pthread.h>	/* pthread_* */
+#include <errno.h>	/* ETIMEDOUT */
+#include <time.h>	/* clock_gettime() */
+
+#include "common.h"
+#include "libjio.h"
+#include "compat.h"
+#include "journal.h"
+
+
+/** Recalculate the durable LSN and wake up the waiters if it advanced. Must
+ * be called with fs' lsnlock held. */
+static void update_durable(struct jfs *fs)
+{
+	uint64_t lsn;
+
+	if (fs->lsn_failed)
+		return;
+
+	if (fs->lsn_pending == NULL)
+		lsn = fs->last_lsn;
+	else
+		lsn = fs->lsn_pending->id - 1;
+
+	if (lsn <= fs->durable_lsn)
+		return;
+
+	fs->durable_lsn = lsn;
+	pthread_cond_broadcast(&(fs->durable_cond));
+
+	if (fs->durable_efd >= 0)
+		notify_fd_signal(fs->durable_efd);
+}
+
+/** Start tracking the given journal operation, which has just been assigned
+ * its id. Must be called with fs' lsnlock held, and the id assignment must
+ * have happened with it held too, so they're tracked in order. */
+void lsn_track(struct jfs *fs, struct journal_op *jop)
+{
+	jop->lsn_next = NULL;
+	jop->lsn_prev = fs->lsn_pending_last;
+	jop->lsn_tracked = 1;
+
+	if (fs->lsn_pending_last == NULL)
+		fs->lsn_pending = jop;
+	else
+		fs->lsn_pending_last->lsn_next = jop;
+	fs->lsn_pending_last = jop;
+
+	fs->last_lsn = jop->id;
+}
+
+/** Stop tracking the given journal operation, because it's durable or
+ * because it will never be. */
+void lsn_untrack(struct jfs *fs, struct journal_op *jop)
+{
+	pthread_mutex_lock(&(fs->lsnlock));
+
+	if (!jop->lsn_tracked)
+		goto exit;
+
+	if (jop->lsn_prev == NULL)
+		fs->lsn_pending = jop->lsn_next;
+	else
+		jop->lsn_prev->lsn_next = jop->lsn_next;
+
+	if (jop->lsn_next == NULL)
+		fs->lsn_pending_last = jop->lsn_prev;
+	else
+		jop->lsn_next->lsn_prev = jop->lsn_prev;
+
+	jop->lsn_tracked = 0;
+	update_durable(fs);
+
+exit:
+	pthread_mutex_unlock(&(fs->lsnlock));
+}
+
+/** Note that a transaction whose commit has already returned will never be
+ * durable. The durable LSN stops advancing, and the waiters are woken up so
+ * they can find out. */
+void lsn_fail(struct jfs *fs)
+{
+	pthread_mutex_lock(&(fs->lsnlock));
+	fs->lsn_failed = 1;
+	pthread_cond_broadcast(&(fs->durable_cond));
+	if (fs->durable_efd >= 0)
+		notify_fd_signal(fs->durable_efd);
+	pthread_mutex_unlock(&(fs->lsnlock));
+}
+
+/* Get the durable LSN */
+uint64_t jfs_durable_lsn(struct jfs *fs)
+{
+	uint64_t lsn;
+
+	pthread_mutex_lock(&(fs->lsnlock));
+	lsn = fs->durable_lsn;
+	pthread_mutex_unlock(&(fs->lsnlock));
+
+	return lsn;
+}
+
+/* Wait until the given LSN is durable */
+int jfs_wait_durable(struct jfs *fs, uint64_t lsn, long timeout_ms)
+{
+	int rv = 0;
+	struct timespec ts;
+
+	if (timeout_ms >= 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&(fs->lsnlock));
+	while (fs->durable_lsn < lsn && !fs->lsn_failed) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&(fs->durable_cond),
+					&(fs->lsnlock));
+			continue;
+		}
+
+		rv = pthread_cond_timedwait(&(fs->durable_cond),
+				&(fs->lsnlock), &ts);
+		if (rv == ETIMEDOUT)
+			break;
+	}
+	rv = (fs->durable_lsn >= lsn) ? 0 : -1;
+	pthread_mutex_unlock(&(fs->lsnlock));
+
+	return rv;
+}
+
+/* Get a file descriptor to be notified when the durable LSN advances */
+int jfs_durable_eventfd(struct jfs *fs)
+{
+	int fd;
+
+	pthread_mutex_lock(&(fs->lsnlock));
+	if (fs->durable_efd < 0)
+		fs->durable_efd = notify_fd_new();
+	fd = fs->durable_efd;
+	pthread_mutex_unlock(&(fs->lsnlock));
+
+	return fd;
+}
@@ -23,59 +23,278 @@
 #include "trans.h"
 
 
-/*
- * Transaction functions
- */
-
-/* Initialize a transaction structure */
-struct jtrans *jtrans_new(struct jfs *fs, unsigned int flags)
+/** Size of the buffer jtrans_commit_wv() keeps on the stack for the previous
+ * data; bigger writes allocate it */
+#define STACK_PDATA_SIZE (4 * 1024)
+
+/** Default jopen_opts.spill_threshold */
+#define DEFAULT_SPILL_THRESHOLD (8 * 1024 * 1024)
+
+/** Number of write operations apply_writes() can sort without allocating
+ * memory */
+#define APPLY_STACK_OPS 16
+
+/** Maximum number of buffers write_ops() writes with a single pwritev() */
+#define APPLY_IOV_MAX 64
+
+/** Check that the durability level in flags can be used on a file opened
+ * with the J_ASYNC bit in async: J_DUR_ORDERED skips the journal syncs, so
+ * it needs the applier's pipeline to keep the data from reaching the file
+ * before its transaction file is safe, and it can't take deltas against data
+ * that was never synced. Returns 0 if it's fine, -1 otherwise. */
+static int check_durability(unsigned int flags, unsigned int async)
 {
-	pthread_mutexattr_t attr;
-	struct jtrans *ts;
+	if (durability(flags) != J_DUR_ORDERED)
+		return 0;
 
-	ts = malloc(sizeof(struct jtrans));
-	if (ts == NULL)
-		return NULL;
+	if (!async || (flags & J_DELTA))
+		return -1;
+
+	return 0;
+}
 
+/** Set up the fields of a transaction structure that has no operations; its
+ * lock and its spare operations are left alone */
+static void jtrans_init(struct jtrans *ts, struct jfs *fs, unsigned int flags)
+{
 	ts->fs = fs;
 	ts->id = 0;
 	ts->flags = fs->flags | flags;
+
+	/* the transaction's durability level overrides the file's */
+	if (flags & J_DUR_MASK)
+		ts->flags = (ts->flags & ~J_DUR_MASK) | (flags & J_DUR_MASK);
 	ts->op = NULL;
 	ts->numops_r = 0;
 	ts->numops_w = 0;
 	ts->len_w = 0;
+	ts->elided = 0;
+	ts->mem = 0;
+	ts->undo_len = 0;
+}
+
+/** Initialize the lock and the lists of a new transaction structure */
+static void jtrans_setup(struct jtrans *ts)
+{
+	pthread_mutexattr_t attr;
+
+	ts->op = NULL;
+	ts->spare = NULL;
+	ts->cache_next = NULL;
+	ts->undo_fd = -1;
 
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
 	pthread_mutex_init(&(ts->lock), &attr);
 	pthread_mutexattr_destroy(&attr);
-
-	return ts;
 }
 
-/* Free the contents of a transaction structure */
-void jtrans_free(struct jtrans *ts)
+/** Free a list of operations, with their buffers */
+static void free_ops(struct operation *op)
 {
 	struct operation *tmpop;
 
-	ts->fs = NULL;
-
-	while (ts->op != NULL) {
-		tmpop = ts->op->next;
+	while (op != NULL) {
+		tmpop = op->next;
 
-		if (ts->op->buf && ts->op->direction == D_WRITE)
-			free(ts->op->buf);
-		if (ts->op->pdata)
-			free(ts->op->pdata);
-		free(ts->op);
+		free(op->wbuf);
+		free(op->pdata);
+		free(op);
 
-		ts->op = tmpop;
+		op = tmpop;
 	}
+}
+
+/** Free a transaction structure, without caching it */
+static void jtrans_destroy(struct jtrans *ts)
+{
+	free_ops(ts->op);
+	free_ops(ts->spare);
+	if (ts->undo_fd >= 0)
+		close(ts->undo_fd);
 	pthread_mutex_destroy(&(ts->lock));
 
 	free(ts);
 }
 
+
+/*
+ * Per-thread cache of transactions
+ *
+ * For files opened with jopen_opts.trans_cache, jtrans_free() resets the
+ * transactions and keeps them in a cache private to the thread, and
+ * jtrans_new() takes them from there, so a thread that commits in a loop
+ * reuses the same structures and buffers instead of allocating them every
+ * time. The cached transactions are not tied to any file, and are freed
+ * when the thread exits.
+ */
+
+/** A thread's cache of transactions */
+struct trans_cache {
+	/** Number of transactions in the cache */
+	unsigned int n;
+
+	/** The transactions, linked by their cache_next */
+	struct jtrans *first;
+};
+
+/** Key of the per-thread cache */
+static pthread_key_t trans_cache_key;
+
+/** Set to 1 once trans_cache_key has been created */
+static int trans_cache_ready = 0;
+
+/** To create trans_cache_key only once */
+static pthread_once_t trans_cache_once = PTHREAD_ONCE_INIT;
+
+/** Free a thread's cache, called when the thread exits */
+static void trans_cache_free(void *p)
+{
+	struct jtrans *ts;
+	struct trans_cache *cache = p;
+
+	while (cache->first != NULL) {
+		ts = cache->first;
+		cache->first = ts->cache_next;
+		jtrans_destroy(ts);
+	}
+
+	free(cache);
+}
+
+static void trans_cache_init(void)
+{
+	if (pthread_key_create(&trans_cache_key, trans_cache_free) == 0)
+		trans_cache_ready = 1;
+}
+
+/** Get the calling thread's cache, creating it if create is set. Returns
+ * NULL if there is none. */
+static struct trans_cache *trans_cache_get(int create)
+{
+	struct trans_cache *cache;
+
+	pthread_once(&trans_cache_once, trans_cache_init);
+	if (!trans_cache_ready)
+		return NULL;
+
+	cache = pthread_getspecific(trans_cache_key);
+	if (cache != NULL || !create)
+		return cache;
+
+	cache = malloc(sizeof(struct trans_cache));
+	if (cache == NULL)
+		return NULL;
+
+	cache->n = 0;
+	cache->first = NULL;
+
+	if (pthread_setspecific(trans_cache_key, cache) != 0) {
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+
+/*
+ * Transaction functions
+ */
+
+/* Initialize a transaction structure */
+struct jtrans *jtrans_new(struct jfs *fs, unsigned int flags)
+{
+	unsigned int tflags;
+	struct jtrans *ts;
+	struct trans_cache *cache;
+
+	tflags = fs->flags | flags;
+	if (flags & J_DUR_MASK)
+		tflags = (tflags & ~J_DUR_MASK) | (flags & J_DUR_MASK);
+	if (check_durability(tflags, fs->flags & J_ASYNC) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cache = trans_cache_get(0);
+	if (cache != NULL && cache->first != NULL) {
+		ts = cache->first;
+		cache->first = ts->cache_next;
+		cache->n--;
+	} else {
+		ts = malloc(sizeof(struct jtrans));
+		if (ts == NULL)
+			return NULL;
+
+		jtrans_setup(ts);
+	}
+
+	jtrans_init(ts, fs, flags);
+	return ts;
+}
+
+/* Remove all the operations of a transaction, keeping them for reuse */
+void jtrans_reset(struct jtrans *ts)
+{
+	struct operation *op;
+
+	pthread_mutex_lock(&(ts->lock));
+
+	if (ts->op != NULL) {
+		for (op = ts->op; op->next != NULL; op = op->next)
+			;
+		op->next = ts->spare;
+		ts->spare = ts->op;
+		ts->op = NULL;
+	}
+
+	ts->id = 0;
+	ts->numops_r = 0;
+	ts->numops_w = 0;
+	ts->len_w = 0;
+	ts->elided = 0;
+	budget_release_trans(ts);
+
+	/* the undo file is kept, but not the space it takes */
+	if (ts->undo_fd >= 0 && ts->undo_len)
+		ftruncate(ts->undo_fd, 0);
+	ts->undo_len = 0;
+
+	pthread_mutex_unlock(&(ts->lock));
+}
+
+/* Free the contents of a transaction structure */
+void jtrans_free(struct jtrans *ts)
+{
+	struct trans_cache *cache;
+
+	if (ts->fs->trans_cache) {
+		cache = trans_cache_get(1);
+		if (cache != NULL && cache->n < ts->fs->trans_cache) {
+			jtrans_reset(ts);
+
+			/* the undo file lives in the journal directory of
+			 * this file, and the cached transaction can be used
+			 * for any other */
+			if (ts->undo_fd >= 0) {
+				close(ts->undo_fd);
+				ts->undo_fd = -1;
+			}
+
+			ts->fs = NULL;
+			ts->cache_next = cache->first;
+			cache->first = ts;
+			cache->n++;
+			return;
+		}
+	}
+
+	budget_release_trans(ts);
+	ts->fs = NULL;
+	jtrans_destroy(ts);
+}
+
 /** Lock/unlock the ranges of the file covered by the transaction. mode must
  * be either F_LOCKW or F_UNLOCK. Returns 0 on success, -1 on error. */
 static int lock_file_ranges(struct jtrans *ts, int mode)
@@ -128,23 +347,30 @@ error:
 }
 
 /** Read the previous information from the disk into the given operation
- * structure. Returns 0 on success, -1 on error. */
+ * structure. If it already has a big enough buffer for it (from a previous
+ * commit, or given by jtrans_commit_w()) it's reused, otherwise one is
+ * allocated.
+ * Returns 0 on success, -1 on error. */
 static int operation_read_prev(struct jtrans *ts, struct operation *op)
 {
 	ssize_t rv;
+	void *pdata;
 
-	op->pdata = malloc(op->len);
-	if (op->pdata == NULL)
-		return -1;
+	if (op->pdatasize < op->len) {
+		pdata = malloc(op->len);
+		if (pdata == NULL)
+			return -1;
 
-	rv = spread(ts->fs->fd, op->pdata, op->len,
-			op->offset);
-	if (rv < 0) {
 		free(op->pdata);
-		op->pdata = NULL;
-		return -1;
+		op->pdata = pdata;
+		op->pdatasize = op->len;
 	}
 
+	rv = applier_pread(ts->fs, op->pdata, op->len, op->offset);
+	if (rv < 0)
+		return -1;
+
+	op->pspilled = 0;
 	op->plen = op->len;
 	if (rv < op->len) {
 		/* we are extending the file! */
@@ -155,14 +381,354 @@ static int operation_read_prev(struct jtrans *ts, struct operation *op)
 	return 0;
 }
 
-/** Common function to add an operation to a transaction */
-static int jtrans_add_common(struct jtrans *ts, const void *buf, size_t count,
-		off_t offset, enum op_direction direction)
+/** Tell if n bytes of the data of a write operation, from off on, are the
+ * same as the ones in p */
+static int op_data_equal(struct operation *op, size_t off,
+		const unsigned char *p, size_t n)
+{
+	int i;
+	size_t l;
+
+	/* memcmp() is vectorized by the C library, it's much faster than
+	 * anything we could do by hand */
+	if (op->iov == NULL)
+		return memcmp((unsigned char *) op->buf + off, p, n) == 0;
+
+	for (i = 0; i < op->iovcnt && n > 0; i++) {
+		if (off >= op->iov[i].iov_len) {
+			off -= op->iov[i].iov_len;
+			continue;
+		}
+
+		l = op->iov[i].iov_len - off;
+		if (l > n)
+			l = n;
+
+		if (memcmp((unsigned char *) op->iov[i].iov_base + off, p,
+					l) != 0)
+			return 0;
+
+		p += l;
+		n -= l;
+		off = 0;
+	}
+
+	return 1;
+}
+
+/** Gather the data of a write operation given as a vector into a new
+ * buffer, for the code that needs it in one piece. Returns the buffer, to be
+ * freed by the caller, or NULL on error. */
+static unsigned char *op_data_gather(struct operation *op)
+{
+	int i;
+	size_t done;
+	unsigned char *buf;
+
+	buf = malloc(op->len);
+	if (buf == NULL)
+		return NULL;
+
+	done = 0;
+	for (i = 0; i < op->iovcnt; i++) {
+		memcpy(buf + done, op->iov[i].iov_base, op->iov[i].iov_len);
+		done += op->iov[i].iov_len;
+	}
+
+	return buf;
+}
+
+/** Create the undo file of a transaction in the journal directory. It's
+ * removed right away, so it's gone once it's closed, even if we crash:
+ * only jtrans_rollback() needs it, recovery doesn't. Returns 0 on success,
+ * -1 on error. */
+static int undo_open(struct jtrans *ts)
+{
+	int fd;
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s/undo.XXXXXX", ts->fs->jdir);
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+
+	unlink(path);
+	ts->undo_fd = fd;
+	return 0;
+}
+
+/** Like operation_read_prev(), for operations of at least spill_threshold
+ * bytes: the previous data is copied to the transaction's undo file, a piece
+ * at a time, instead of being kept in memory. Since we won't have it around
+ * later, we compare it with the data on the way, for is_unchanged().
+ * Returns 0 on success, -1 on error. */
+static int operation_spill_prev(struct jtrans *ts, struct operation *op)
+{
+	ssize_t rv;
+	size_t done, n;
+	unsigned char *buf;
+
+	if (ts->undo_fd < 0 && undo_open(ts) != 0)
+		return -1;
+
+	buf = malloc(op->len < COPY_CHUNK ? op->len : COPY_CHUNK);
+	if (buf == NULL)
+		return -1;
+
+	op->pspilled = 1;
+	op->poffset = ts->undo_len;
+	op->pequal = op->srcfd < 0;
+	op->plen = 0;
+
+	for (done = 0; done < op->len; done += n) {
+		n = op->len - done < COPY_CHUNK ? op->len - done : COPY_CHUNK;
+
+		rv = applier_pread(ts->fs, buf, n, op->offset + done);
+		if (rv < 0)
+			goto error;
+
+		if (rv > 0 && spwrite(ts->undo_fd, buf, rv,
+					op->poffset + done) != rv)
+			goto error;
+
+		if (op->pequal && !op_data_equal(op, done, buf, rv))
+			op->pequal = 0;
+
+		op->plen += rv;
+
+		/* we are extending the file */
+		if (rv < n)
+			break;
+	}
+
+	ts->undo_len += op->plen;
+	free(buf);
+	return 0;
+
+error:
+	free(buf);
+	return -1;
+}
+
+/** Tell if the given write operation overlaps with any other write operation
+ * of the transaction */
+static int overlaps_other_writes(struct jtrans *ts, struct operation *op)
+{
+	struct operation *o;
+
+	for (o = ts->op; o != NULL; o = o->next) {
+		if (o == op || o->direction == D_READ)
+			continue;
+
+		if (o->offset < op->offset + (off_t) op->len
+				&& op->offset < o->offset + (off_t) o->len)
+			return 1;
+	}
+
+	return 0;
+}
+
+/** Tell if the given write operation would leave the data as it is, so it
+ * can be skipped. It must have its previous data read, and not overlap with
+ * any other write operation of the transaction (otherwise the data could be
+ * changed by the others). */
+static int is_unchanged(struct jtrans *ts, struct operation *op)
+{
+	if (op->plen != op->len || overlaps_other_writes(ts, op))
+		return 0;
+
+	if (op->pspilled)
+		return op->pequal;
+
+	/* we don't have the data to compare */
+	if (op->srcfd >= 0)
+		return 0;
+
+	return op_data_equal(op, 0, op->pdata, op->len);
+}
+
+/** With J_BULKLOAD, mark the write operations that go past the bulk start,
+ * which will be written directly to the file. The ones that cross it would
+ * be torn if we had to truncate the file back to it, so we make a
+ * checkpoint to move it past them first. Returns 0 on success, -1 on
+ * error. */
+static int mark_direct_ops(struct jtrans *ts)
+{
+	off_t start, end;
+	struct operation *op;
+
+	start = bulk_get_start(ts->fs);
+	if (start < 0)
+		return 0;
+
+	end = 0;
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (op->direction == D_WRITE && op->offset < start &&
+				op->offset + (off_t) op->len > start &&
+				op->offset + (off_t) op->len > end)
+			end = op->offset + op->len;
+	}
+
+	if (end) {
+		if (bulk_checkpoint(ts->fs, end) != 0)
+			return -1;
+		start = bulk_get_start(ts->fs);
+	}
+
+	for (op = ts->op; op != NULL; op = op->next) {
+		op->direct = op->direction == D_WRITE &&
+			op->offset >= start;
+	}
+
+	return 0;
+}
+
+/** Tell if all the write operations of a transaction that go to the journal
+ * write past the end of the file, so their data can be written in place
+ * instead of journaled (see commit_journal()). The file ranges must be
+ * locked, so nobody can write there in the meantime. */
+static int extends_only(struct jtrans *ts)
+{
+	int found;
+	struct stat st;
+	struct operation *op;
+
+	/* the applier could leave the file shorter than it will be, and
+	 * with anything but J_DUR_FULL the data is not synced before the
+	 * transaction file is removed */
+	if (!(ts->flags & J_FASTEXTEND) || ts->fs->ap_cfg ||
+			durability(ts->flags) != J_DUR_FULL)
+		return 0;
+
+	if (fstat(ts->fs->fd, &st) != 0)
+		return 0;
+
+	found = 0;
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (op->direction == D_READ || op->direct)
+			continue;
+
+		if (op->offset < st.st_size)
+			return 0;
+		found = 1;
+	}
+
+	return found;
+}
+
+/** qsort() comparison function to sort operations by descending offset */
+static int cmp_offset_desc(const void *a, const void *b)
+{
+	const struct operation *x = *(const struct operation **) a;
+	const struct operation *y = *(const struct operation **) b;
+
+	if (x->offset > y->offset)
+		return -1;
+	else if (x->offset < y->offset)
+		return 1;
+	return 0;
+}
+
+/** Add the write operations of a transaction that only extends the file to
+ * its transaction file, without their data. They're sorted by descending
+ * offset, so on recovery the last one is truncated first, and the file can
+ * be truncated back over the others too. Returns 0 on success, -1 on
+ * error. */
+static int journal_extends(struct jtrans *ts, jop_t *jop, unsigned int numops)
+{
+	int rv = 0;
+	unsigned int i;
+	struct operation *op, **ops;
+
+	ops = malloc(sizeof(struct operation *) * numops);
+	if (ops == NULL)
+		return -1;
+
+	i = 0;
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (op->direction == D_READ || op->direct)
+			continue;
+		ops[i++] = op;
+	}
+
+	qsort(ops, numops, sizeof(struct operation *), cmp_offset_desc);
+
+	for (i = 0; i < numops && rv == 0; i++)
+		rv = journal_add_extend(jop, ops[i]->len, ops[i]->offset);
+
+	free(ops);
+	return rv;
+}
+
+/** Get an operation structure for a transaction, whose lock must be held: one
+ * of its spare ones if there are any, or a new one. For write operations,
+ * wsize is the length of the data, and the operation gets a buffer of at
+ * least that size in wbuf. Returns NULL on error. */
+static struct operation *get_op(struct jtrans *ts, size_t wsize)
+{
+	void *wbuf;
+	struct operation *op, **prevp;
+
+	/* prefer a spare whose buffer is big enough, or else the first one,
+	 * and give it a bigger buffer */
+	for (prevp = &(ts->spare); *prevp != NULL; prevp = &((*prevp)->next)) {
+		if ((*prevp)->wbufsize >= wsize)
+			break;
+	}
+	if (*prevp == NULL)
+		prevp = &(ts->spare);
+
+	op = *prevp;
+	if (op == NULL) {
+		op = malloc(sizeof(struct operation));
+		if (op == NULL)
+			return NULL;
+
+		op->wbuf = NULL;
+		op->wbufsize = 0;
+		op->pdata = NULL;
+		op->pdatasize = 0;
+	} else {
+		*prevp = op->next;
+	}
+
+	if (op->wbufsize < wsize) {
+		wbuf = malloc(wsize);
+		if (wbuf == NULL) {
+			op->next = ts->spare;
+			ts->spare = op;
+			return NULL;
+		}
+
+		free(op->wbuf);
+		op->wbuf = wbuf;
+		op->wbufsize = wsize;
+	}
+
+	return op;
+}
+
+/** Common function to add an operation to a transaction. Write operations
+ * gather the data of all the buffers into a single one, unless srcfd is not
+ * -1: then the data is in that file at srcoff, and iov only has its length;
+ * read operations must have only one buffer. */
+static int jtrans_add_common(struct jtrans *ts, const struct iovec *iov,
+		int iovcnt, int srcfd, off_t srcoff, off_t offset,
+		enum op_direction direction)
 {
+	int i;
+	size_t count, done;
 	struct operation *op, *tmpop;
 
 	op = tmpop = NULL;
 
+	count = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > MAX_TSIZE - count)
+			return -1;
+		count += iov[i].iov_len;
+	}
+
 	pthread_mutex_lock(&(ts->lock));
 
 	/* Writes are not allowed in read-only mode, they fail early */
@@ -175,16 +741,27 @@ static int jtrans_add_common(struct jtrans *ts, const void *buf, size_t count,
 	if ((long long) ts->len_w + count > MAX_TSIZE)
 		goto error;
 
-	op = malloc(sizeof(struct operation));
-	if (op == NULL)
+	/* this can wait for other transactions to free some memory */
+	if (direction == D_WRITE &&
+			budget_charge_op(ts, count, srcfd >= 0) != 0)
+		goto error;
+
+	op = get_op(ts, direction == D_WRITE && srcfd < 0 ? count : 0);
+	if (op == NULL) {
+		if (direction == D_WRITE)
+			budget_uncharge_op(ts, count, srcfd >= 0);
 		goto error;
+	}
 
+	op->srcfd = srcfd;
+	op->srcoff = srcoff;
+	op->iov = NULL;
+	op->iovcnt = 0;
+	op->pspilled = 0;
 	if (direction == D_WRITE) {
-		op->buf = malloc(count);
-		if (op->buf == NULL)
-			goto error;
-
+		op->buf = srcfd < 0 ? op->wbuf : NULL;
 		ts->numops_w++;
+		ts->len_w += count;
 	} else {
 		ts->numops_r++;
 	}
@@ -203,275 +780,1067 @@ static int jtrans_add_common(struct jtrans *ts, const void *buf, size_t count,
 
 	pthread_mutex_unlock(&(ts->lock));
 
-	op->len = count;
-	op->offset = offset;
-	op->plen = 0;
-	op->pdata = NULL;
-	op->locked = 0;
-	op->direction = direction;
+	op->len = count;
+	op->offset = offset;
+	op->plen = 0;
+	op->elided = 0;
+	op->locked = 0;
+	op->direct = 0;
+	op->direction = direction;
+
+	if (direction == D_WRITE) {
+		/* with srcfd, the data stays in its file until the commit */
+		done = 0;
+		for (i = 0; srcfd < 0 && i < iovcnt; i++) {
+			memcpy((unsigned char *) op->buf + done,
+					iov[i].iov_base, iov[i].iov_len);
+			done += iov[i].iov_len;
+		}
+
+		if (!(ts->flags & J_NOROLLBACK)) {
+			/* jtrans_commit() will want to read the current data,
+			 * so we tell the kernel about that */
+			posix_fadvise(ts->fs->fd, offset, count,
+					POSIX_FADV_WILLNEED);
+		}
+	} else {
+		op->buf = iov[0].iov_base;
+
+		/* if there are no overlapping writes, jtrans_commit() will
+		 * want to read the data from the disk; and if there are we
+		 * will already have submitted a request and one more won't
+		 * hurt */
+		posix_fadvise(ts->fs->fd, offset, count, POSIX_FADV_WILLNEED);
+	}
+
+	return 0;
+
+error:
+	pthread_mutex_unlock(&(ts->lock));
+	return -1;
+}
+
+int jtrans_add_r(struct jtrans *ts, void *buf, size_t count, off_t offset)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = count;
+	return jtrans_add_common(ts, &iov, 1, -1, 0, offset, D_READ);
+}
+
+int jtrans_add_w(struct jtrans *ts, const void *buf, size_t count,
+		off_t offset)
+{
+	struct iovec iov;
+
+	/* this casts the const away, which is ugly but let us have a common
+	 * read/write path and avoid useless code repetition just to handle
+	 * it; the data is only read */
+	iov.iov_base = (void *) buf;
+	iov.iov_len = count;
+	return jtrans_add_common(ts, &iov, 1, -1, 0, offset, D_WRITE);
+}
+
+int jtrans_add_w_fd(struct jtrans *ts, int fd, off_t src_off, size_t count,
+		off_t offset)
+{
+	struct iovec iov;
+
+	if (fd < 0)
+		return -1;
+
+	/* only the length is used */
+	iov.iov_base = NULL;
+	iov.iov_len = count;
+	return jtrans_add_common(ts, &iov, 1, fd, src_off, offset, D_WRITE);
+}
+
+
+
+/** Add a committed journal operation to the list of lingering transactions,
+ * so it's freed by jsync(). If only_if_lingering is set, it's only added if
+ * the list is not empty. Returns 1 if it was added, 0 if not, or -1 on
+ * error. */
+static int linger_add(struct jfs *fs, struct journal_op *jop, size_t len,
+		int only_if_lingering)
+{
+	struct jlinger *linger, *lp;
+
+	pthread_mutex_lock(&(fs->ltlock));
+
+	/* this is the usual case when not lingering, so we check it before
+	 * allocating anything */
+	if (fs->ltrans == NULL && only_if_lingering) {
+		pthread_mutex_unlock(&(fs->ltlock));
+		return 0;
+	}
+
+	linger = malloc(sizeof(struct jlinger));
+	if (linger == NULL) {
+		pthread_mutex_unlock(&(fs->ltlock));
+		return -1;
+	}
+
+	linger->jop = jop;
+	linger->next = NULL;
+
+	/* add it to the end of the list so they're in order */
+	if (fs->ltrans == NULL) {
+		fs->ltrans = linger;
+	} else {
+		lp = fs->ltrans;
+		while (lp->next != NULL)
+			lp = lp->next;
+		lp->next = linger;
+	}
+
+	fs->ltrans_len += len;
+	fs->ltrans_count++;
+	if (fs->ltrans_count > fs->fds_peak)
+		fs->fds_peak = fs->ltrans_count;
+	autosync_check(fs);
+
+	pthread_mutex_unlock(&(fs->ltlock));
+
+	return 1;
+}
+
+/** State of a transaction while it's being committed */
+struct commit_state {
+	/** The transaction */
+	struct jtrans *ts;
+
+	/** Its journal operation, if it has one */
+	jop_t *jop;
+
+	/** Set to 1 if the data is not synced when committing */
+	int linger;
+
+	/** Set to 1 if the transaction only extends the file, and its data
+	 * is not journaled */
+	int extend;
+
+	/** Set to 1 while the commit is in progress */
+	int active;
+
+	/** Set to 1 if the file ranges have been (or are being) locked */
+	int locked;
+
+	/** Set to 1 once we have started writing the data */
+	int applying;
+
+	/** Bytes written to the file */
+	size_t written;
+
+	/** Set to 1 if the data was synced as it was written */
+	int dsynced;
+
+	/** Set to 1 if the transaction left the file with as many lingering
+	 * transactions as its fd budget allows, so it must be jsync()ed */
+	int sync_fds;
+
+	/** What jtrans_commit() returns */
+	ssize_t retval;
+};
+
+/** Tell if any operation of a overlaps with any operation of b */
+static int trans_overlap(struct jtrans *a, struct jtrans *b)
+{
+	struct operation *o, *p;
+
+	for (o = a->op; o != NULL; o = o->next) {
+		for (p = b->op; p != NULL; p = p->next) {
+			if (o->offset < p->offset + (off_t) p->len
+					&& p->offset < o->offset + (off_t) o->len)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** End the commit of a transaction, successful or not: roll it back if it
+ * failed after writing some data, free the journal operation and unlock
+ * everything. The transaction's lock must be held, and is released. */
+static void commit_end(struct commit_state *cs)
+{
+	ssize_t r;
+	struct jtrans *ts = cs->ts;
+
+	/* If the transaction failed we try to recover by rolling it back.
+	 * Only used if it has at least one write operation.
+	 *
+	 * NOTE: on extreme conditions (ENOSPC/disk failure) this can fail
+	 * too! There's nothing much we can do in that case, the caller should
+	 * take care of it by itself.
+	 *
+	 * Transactions that were successfuly recovered by rolling them back
+	 * will have J_ROLLBACKED in their flags. */
+	if (cs->applying && cs->jop && !(ts->flags & J_COMMITTED) &&
+			!(ts->flags & J_ROLLBACKING)) {
+		r = ts->flags;
+		ts->flags = ts->flags | J_NOLOCK | J_ROLLBACKING;
+		if (jtrans_rollback(ts) >= 0) {
+			ts->flags = r | J_ROLLBACKED;
+			cs->retval = -1;
+		} else {
+			ts->flags = r;
+			cs->retval = -2;
+		}
+	}
+
+	/* If the journal operation is no longer needed, we remove it from the
+	 * disk.
+	 *
+	 * Extreme conditions (filesystem just got read-only, for example) can
+	 * cause journal_free() to fail, but there's not much left to do at
+	 * that point, and the caller will have to be careful and stop its
+	 * operations. In that case, we will return -2, and the transaction
+	 * will be marked as J_COMMITTED to indicate that the data was
+	 * effectively written to disk. */
+	if (cs->jop) {
+		/* Note we only unlink if we've written down the real data, or
+		 * at least rolled it back properly */
+		int data_is_safe = (ts->flags & J_COMMITTED) ||
+			(ts->flags & J_ROLLBACKED);
+		r = journal_free(cs->jop, data_is_safe ? 1 : 0);
+		if (r != 0)
+			cs->retval = -2;
+
+		cs->jop = NULL;
+	}
+
+	/* always unlock everything at the end; otherwise we could have
+	 * half-overlapping transactions applying simultaneously, and if
+	 * anything goes wrong it would be possible to break consistency */
+	if (cs->locked)
+		lock_file_ranges(ts, F_UNLOCK);
+
+	cs->active = 0;
+	pthread_mutex_unlock(&(ts->lock));
+}
+
+/** Begin the commit of a transaction, whose lock must be held: lock the file
+ * ranges, read the previous data and write the transaction file, without
+ * syncing it. Returns 0 on success, or -1 if the commit failed, in which
+ * case commit_end() must be called. */
+static int commit_journal(struct commit_state *cs)
+{
+	ssize_t r;
+	int delta;
+	unsigned int numops;
+	size_t len;
+	unsigned char *buf, *pdata;
+	struct operation *op;
+	struct jtrans *ts = cs->ts;
+
+	cs->jop = NULL;
+	cs->active = 1;
+	cs->extend = 0;
+	cs->locked = 0;
+	cs->applying = 0;
+	cs->written = 0;
+	cs->dsynced = 0;
+	cs->sync_fds = 0;
+	cs->retval = -1;
+
+	/* with anything but J_DUR_FULL, the data is not synced here but
+	 * in jsync(), and the transaction file is kept until then */
+	cs->linger = durability(ts->flags) != J_DUR_FULL;
+
+	/* clear the flags */
+	ts->flags = ts->flags & ~J_COMMITTED;
+	ts->flags = ts->flags & ~J_ROLLBACKED;
+	ts->id = 0;
+
+	if (ts->numops_r + ts->numops_w == 0)
+		return -1;
+
+	/* fail for read-only accesses if we have write operations */
+	if (ts->numops_w && (ts->flags & J_RDONLY))
+		return -1;
+
+	/* Lock all the regions we're going to work with; otherwise there
+	 * could be another transaction trying to write the same spots and we
+	 * could end up with interleaved writes, that could break atomicity
+	 * warantees if we need to rollback.
+	 * Note we do this before creating a new transaction, so we know it's
+	 * not possible to have two overlapping transactions on disk at the
+	 * same time. */
+	cs->locked = 1;
+	if (lock_file_ranges(ts, F_LOCKW) != 0)
+		return -1;
+
+	if (mark_direct_ops(ts) != 0)
+		return -1;
+
+	/* if we only write past the end of the file, there's no previous
+	 * data to save: we journal just the ranges, write the data in place
+	 * and sync it before removing the transaction file; on recovery or
+	 * rollback the file is truncated back */
+	cs->extend = extends_only(ts);
+
+	/* read the previous data before writing the transaction file: we
+	 * need it to skip the operations that don't change anything, and to
+	 * journal only what changed */
+	ts->elided = 0;
+	ts->undo_len = 0;
+	numops = 0;
+	len = 0;
+	for (op = ts->op; op != NULL; op = op->next) {
+		op->elided = 0;
+		op->pspilled = 0;
+		if (op->direction == D_READ || op->direct)
+			continue;
+
+		if (cs->extend) {
+			op->plen = 0;
+		} else if (!(ts->flags & J_NOROLLBACK)) {
+			/* big previous data goes to the undo file */
+			if (op->len >= ts->fs->spill_threshold)
+				r = operation_spill_prev(ts, op);
+			else
+				r = operation_read_prev(ts, op);
+			if (r < 0)
+				return -1;
+
+			op->elided = is_unchanged(ts, op);
+		}
+
+		if (op->elided) {
+			ts->elided += op->len;
+		} else {
+			numops++;
+			len += op->len;
+		}
+	}
+
+	/* create and fill the transaction file only if we have at least one
+	 * write operation that changes something */
+	if (numops) {
+		cs->jop = journal_new(ts->fs, ts->flags, numops, len);
+		if (cs->jop == NULL)
+			return -1;
+	}
+
+	ts->id = cs->jop ? cs->jop->id : 0;
+
+	if (cs->extend && journal_extends(ts, cs->jop, numops) != 0)
+		return -1;
+
+	delta = (ts->flags & J_DELTA) && !(ts->flags & J_NOROLLBACK);
+	for (op = ts->op; op != NULL && !cs->extend; op = op->next) {
+		if (op->direction == D_READ || op->elided || op->direct)
+			continue;
+
+		if (op->srcfd >= 0) {
+			r = journal_add_op_fd(cs->jop, op->srcfd, op->srcoff,
+					op->len, op->offset);
+			if (r != 0)
+				return -1;
+
+			fiu_exit_on("jio/commit/tf_opdata");
+			continue;
+		}
+
+		/* the delta is applied on top of the data on disk at
+		 * recovery time, so it can only be used if no other
+		 * operation of this transaction touches the same bytes */
+		pdata = NULL;
+		if (delta && !op->pspilled && !overlaps_other_writes(ts, op))
+			pdata = op->pdata;
+
+		/* vectors are journaled straight from their buffers, unless
+		 * the data has to be compressed or diffed, which needs it in
+		 * one piece */
+		buf = op->buf;
+		if (op->iov != NULL) {
+			if (pdata == NULL && !(ts->flags & J_COMPRESS)) {
+				r = journal_add_opv(cs->jop, op->iov,
+						op->iovcnt, op->len,
+						op->offset);
+				if (r != 0)
+					return -1;
+
+				fiu_exit_on("jio/commit/tf_opdata");
+				continue;
+			}
+
+			buf = op_data_gather(op);
+			if (buf == NULL)
+				return -1;
+		}
+
+		r = journal_add_op(cs->jop, buf, op->len, op->offset,
+				pdata, op->plen);
+		if (buf != op->buf)
+			free(buf);
+		if (r != 0)
+			return -1;
+
+		fiu_exit_on("jio/commit/tf_opdata");
+	}
+
+	if (cs->jop)
+		journal_pre_commit(cs->jop);
+
+	fiu_exit_on("jio/commit/tf_data");
+
+	if (cs->jop && journal_commit(cs->jop) < 0)
+		return -1;
+
+	return 0;
+}
+
+/** qsort() comparison function to sort operations by ascending offset */
+static int cmp_offset_asc(const void *a, const void *b)
+{
+	return cmp_offset_desc(b, a);
+}
+
+/** Write the data of n write operations that follow each other in the file,
+ * with as few pwritev() as possible; the ones given as a vector are written
+ * straight from their buffers. *dsync is like in spwritev(). Returns the
+ * number of bytes written, or -1 on error. */
+static ssize_t write_ops(int fd, struct operation **ops, unsigned int n,
+		int *dsync)
+{
+	int j, veccnt, cnt;
+	unsigned int i;
+	ssize_t r;
+	size_t len, total;
+	off_t offset;
+	const struct iovec *vec;
+	struct iovec one, iov[APPLY_IOV_MAX];
+
+	offset = ops[0]->offset;
+	total = 0;
+	len = 0;
+	cnt = 0;
+	for (i = 0; i < n; i++) {
+		vec = ops[i]->iov;
+		veccnt = ops[i]->iovcnt;
+		if (vec == NULL) {
+			one.iov_base = ops[i]->buf;
+			one.iov_len = ops[i]->len;
+			vec = &one;
+			veccnt = 1;
+		}
+
+		for (j = 0; j < veccnt; j++) {
+			iov[cnt++] = vec[j];
+			len += vec[j].iov_len;
+
+			if (cnt < APPLY_IOV_MAX &&
+					(i < n - 1 || j < veccnt - 1))
+				continue;
+
+			/* spwritev() modifies iov, that's why it's a copy */
+			r = spwritev(fd, iov, cnt, offset, dsync);
+			if (r < 0 || (size_t) r != len)
+				return -1;
+
+			offset += len;
+			total += len;
+			len = 0;
+			cnt = 0;
+		}
+	}
+
+	return total;
+}
+
+/** Write the data of a transaction that has no read operations, so the
+ * writes can go in any order as long as they don't overlap: they're sorted
+ * by offset, so the disk sees them in order, and the ones that follow each
+ * other are merged into a single pwritev(). If the data must be synced and
+ * the only way would be an fdatasync() of the whole file, it's written with
+ * RWF_DSYNC instead where possible, which syncs just our ranges. Returns 0 on
+ * success, -1 on error. */
+static int apply_writes(struct commit_state *cs)
+{
+	ssize_t r;
+	int rv = -1, dsync, synced, durable;
+	unsigned int i, j, n;
+	size_t len;
+	struct operation *op, *stack_ops[APPLY_STACK_OPS], **ops;
+	struct jtrans *ts = cs->ts;
+
+	n = 0;
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (!op->elided)
+			n++;
+	}
+
+	if (n == 0)
+		return 0;
+
+	ops = stack_ops;
+	if (n > APPLY_STACK_OPS) {
+		ops = malloc(sizeof(struct operation *) * n);
+		if (ops == NULL)
+			return -1;
+	}
+
+	i = 0;
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (!op->elided)
+			ops[i++] = op;
+	}
+
+	qsort(ops, n, sizeof(struct operation *), cmp_offset_asc);
+
+	for (i = 1; i < n; i++) {
+		if (ops[i - 1]->offset + (off_t) ops[i - 1]->len >
+				ops[i]->offset)
+			break;
+	}
+
+	if (i < n) {
+		/* some overlap, so they must be written in order; the ones
+		 * that follow each other can still be merged */
+		i = 0;
+		for (op = ts->op; op != NULL; op = op->next) {
+			if (!op->elided)
+				ops[i++] = op;
+		}
+	}
+
+	/* with sync_file_range() the data is synced range by range, see
+	 * commit_wait_data() */
+	dsync = have_dsync_write && cs->jop && !cs->linger &&
+		(cs->extend || !have_sync_range);
+	durable = dsync;
+
+	for (i = 0; i < n; i = j) {
+		/* find the run of operations that follow each other; the data
+		 * of the ones that have it in a file is copied on its own */
+		len = ops[i]->len;
+		for (j = i + 1; j < n; j++) {
+			if (ops[j - 1]->srcfd >= 0 || ops[j]->srcfd >= 0 ||
+					ops[j]->direct != ops[i]->direct ||
+					ops[j - 1]->offset +
+					(off_t) ops[j - 1]->len !=
+					ops[j]->offset)
+				break;
+			len += ops[j]->len;
+		}
+
+		/* the direct writes of a bulk load are synced by jsync() */
+		synced = dsync && !ops[i]->direct;
+
+		if (ops[i]->srcfd >= 0) {
+			r = copy_range(ops[i]->srcfd, ops[i]->srcoff,
+					ts->fs->fd, ops[i]->offset, len);
+			synced = 0;
+		} else {
+			r = write_ops(ts->fs->fd, ops + i, j - i, &synced);
+		}
+		if (r != len)
+			goto exit;
+
+		cs->written += r;
+
+		if (!ops[i]->direct && !synced) {
+			durable = 0;
+
+			if (have_sync_range && !cs->linger) {
+				r = sync_range_submit(ts->fs->fd,
+						ops[i]->offset, len);
+				if (r != 0)
+					goto exit;
+			}
+		}
+
+		fiu_exit_on("jio/commit/wrote_op");
+	}
+
+	cs->dsynced = durable;
+	rv = 0;
+
+exit:
+	if (ops != stack_ops)
+		free(ops);
+	return rv;
+}
+
+/** Apply a transaction whose transaction file is safe: run the read
+ * operations and write the data, or leave it to the applier thread. Returns
+ * 0 on success, -1 on error. */
+static int commit_apply(struct commit_state *cs)
+{
+	ssize_t r;
+	int queued = 0, dsync;
+	struct operation *op;
+	struct jtrans *ts = cs->ts;
+
+	/* with J_ASYNC the transaction is safe now, so we leave the rest to
+	 * the applier thread; if we can't, we wait for it to finish with the
+	 * previous ones (so they don't overwrite ours) and apply it here */
+	if (cs->jop && ts->fs->ap_cfg) {
+		if (applier_queue(ts->fs, ts, cs->jop) == 0) {
+			cs->jop = NULL;
+			queued = 1;
+		} else {
+			applier_drain(ts->fs);
+
+			/* with J_DUR_ORDERED nobody has synced the
+			 * transaction file, and it must be safe before the
+			 * data reaches the file */
+			if (durability(cs->jop->flags) == J_DUR_ORDERED) {
+				if (journal_sync(cs->jop, 1) != 0)
+					return -1;
+				lsn_untrack(ts->fs, cs->jop);
+			}
+		}
+	}
+
+	/* now that we have a safe transaction file, let's apply it */
+	cs->applying = 1;
+
+	/* the read operations must see the writes that come before them and
+	 * not the ones after, so only the writes alone can be reordered */
+	if (!queued && ts->numops_r == 0) {
+		if (apply_writes(cs) != 0)
+			return -1;
+
+		fiu_exit_on("jio/commit/wrote_all_ops");
+		return 0;
+	}
+
+	for (op = ts->op; op != NULL; op = op->next) {
+		if (op->direction == D_READ) {
+			r = applier_pread(ts->fs, op->buf, op->len, op->offset);
+			if (r != op->len)
+				return -1;
+
+			continue;
+		}
+
+		/* from now on, write ops (which are more interesting) */
+
+		if (op->elided || queued)
+			continue;
+
+		dsync = 0;
+		if (op->srcfd >= 0)
+			r = copy_range(op->srcfd, op->srcoff, ts->fs->fd,
+					op->offset, op->len);
+		else
+			r = write_ops(ts->fs->fd, &op, 1, &dsync);
+		if (r != op->len)
+			return -1;
 
-	if (direction == D_WRITE) {
-		memcpy(op->buf, buf, count);
+		cs->written += r;
 
-		if (!(ts->flags & J_NOROLLBACK)) {
-			/* jtrans_commit() will want to read the current data,
-			 * so we tell the kernel about that */
-			posix_fadvise(ts->fs->fd, offset, count,
-					POSIX_FADV_WILLNEED);
+		/* the direct writes of a bulk load are synced by jsync() */
+		if (have_sync_range && !cs->linger && !op->direct) {
+			r = sync_range_submit(ts->fs->fd, op->offset,
+					op->len);
+			if (r != 0)
+				return -1;
 		}
-	} else {
-		/* this casts the const away, which is ugly but let us have a
-		 * common read/write path and avoid useless code repetition
-		 * just to handle it */
-		op->buf = (void *) buf;
 
-		/* if there are no overlapping writes, jtrans_commit() will
-		 * want to read the data from the disk; and if there are we
-		 * will already have submitted a request and one more won't
-		 * hurt */
-		posix_fadvise(ts->fs->fd, offset, count, POSIX_FADV_WILLNEED);
+		fiu_exit_on("jio/commit/wrote_op");
 	}
 
-	return 0;
-
-error:
-	pthread_mutex_unlock(&(ts->lock));
-
-	if (op && direction == D_WRITE)
-		free(op->buf);
-	free(op);
+	fiu_exit_on("jio/commit/wrote_all_ops");
 
-	return -1;
+	return 0;
 }
 
-int jtrans_add_r(struct jtrans *ts, void *buf, size_t count, off_t offset)
+/** Tell if the data of a transaction must be synced before its commit
+ * returns */
+static int commit_needs_data_sync(struct commit_state *cs)
 {
-	return jtrans_add_common(ts, buf, count, offset, D_READ);
+	return cs->active && cs->jop && !cs->linger && !cs->dsynced;
 }
 
-int jtrans_add_w(struct jtrans *ts, const void *buf, size_t count,
-		off_t offset)
+/** Wait for the data of a transaction to reach the disk, using
+ * sync_range_wait(). Returns 0 on success, -1 on error. */
+static int commit_wait_data(struct commit_state *cs)
 {
-	return jtrans_add_common(ts, buf, count, offset, D_WRITE);
-}
+	struct operation *op;
 
+	/* the data past the old end of the file is only there once the new
+	 * size is on disk too, and sync_file_range() doesn't write it */
+	if (cs->extend)
+		return fdatasync(cs->ts->fs->fd);
 
-/* Commit a transaction */
-ssize_t jtrans_commit(struct jtrans *ts)
+	for (op = cs->ts->op; op != NULL; op = op->next) {
+		if (op->direction == D_READ || op->elided || op->direct)
+			continue;
+
+		if (sync_range_wait(cs->ts->fs->fd, op->offset, op->len) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/** Mark a transaction whose data is safe as committed. Returns 0 on success,
+ * -1 on error. */
+static int commit_finish(struct commit_state *cs)
 {
-	ssize_t r, retval = -1;
-	struct operation *op;
-	struct jlinger *linger;
-	jop_t *jop = NULL;
-	size_t written = 0;
+	ssize_t r;
+	int lingering = 0;
+	struct jtrans *ts = cs->ts;
 
-	pthread_mutex_lock(&(ts->lock));
+	if (cs->jop && cs->linger) {
+		if (linger_add(ts->fs, cs->jop, cs->written, 0) < 0)
+			return -1;
 
-	/* clear the flags */
-	ts->flags = ts->flags & ~J_COMMITTED;
-	ts->flags = ts->flags & ~J_ROLLBACKED;
+		/* Leave the journal_free() up to jsync() */
+		cs->jop = NULL;
+		lingering = 1;
+	} else if (cs->jop && !cs->extend) {
+		/* if there are lingering transactions, they would be applied
+		 * on top of our data on recovery, so our transaction file
+		 * must stay until they're gone; this can't happen if we only
+		 * extended the file, since their data was applied before we
+		 * looked at its size, and we must not stay anyway because
+		 * our transaction would be undone on recovery */
+		r = linger_add(ts->fs, cs->jop, cs->written, 1);
+		if (r < 0)
+			return -1;
+		else if (r > 0)
+			cs->jop = NULL;
+		lingering = r > 0;
+	}
 
-	if (ts->numops_r + ts->numops_w == 0)
-		goto exit;
+	/* jtrans_commit_many() calls jsync() at the end if we reached the fd
+	 * budget (see budget.c) */
+	if (lingering && ts->fs->fd_budget) {
+		pthread_mutex_lock(&(ts->fs->ltlock));
+		cs->sync_fds = budget_fds_exceeded(ts->fs);
+		pthread_mutex_unlock(&(ts->fs->ltlock));
+	}
 
-	/* fail for read-only accesses if we have write operations */
-	if (ts->numops_w && (ts->flags & J_RDONLY))
-		goto exit;
+	/* mark the transaction as committed */
+	ts->flags = ts->flags | J_COMMITTED;
+	cs->retval = 1;
 
-	/* Lock all the regions we're going to work with; otherwise there
-	 * could be another transaction trying to write the same spots and we
-	 * could end up with interleaved writes, that could break atomicity
-	 * warantees if we need to rollback.
-	 * Note we do this before creating a new transaction, so we know it's
-	 * not possible to have two overlapping transactions on disk at the
-	 * same time. */
-	if (lock_file_ranges(ts, F_LOCKW) != 0)
-		goto unlock_exit;
+	return 0;
+}
 
-	/* create and fill the transaction file only if we have at least one
-	 * write operation */
-	if (ts->numops_w) {
-		jop = journal_new(ts->fs, ts->flags);
-		if (jop == NULL)
-			goto unlock_exit;
+/** Finish the commit of a run of transactions whose transaction files have
+ * been written. They must belong to the same file and not overlap, so the
+ * syncs can be shared. */
+static void commit_run(struct commit_state *run, unsigned int n)
+{
+	int failed;
+	unsigned int i;
+	struct commit_state *last;
+
+	/* this is a simple but efficient optimization: instead of doing
+	 * everything O_SYNC, we sync at this point only, this way we avoid
+	 * doing a lot of very small writes; in case of a crash the
+	 * transaction file is only useful if it's complete (ie. after this
+	 * point) so we only flush here (both data and metadata). The
+	 * journal directory is synced only once, after the last file.
+	 * With J_DUR_ORDERED we don't sync anything, the transaction will
+	 * be durable after the applier's syncer syncs the transaction
+	 * file. */
+	last = NULL;
+	for (i = 0; i < n; i++) {
+		if (run[i].active && run[i].jop &&
+				durability(run[i].jop->flags) != J_DUR_ORDERED)
+			last = &run[i];
 	}
 
-	for (op = ts->op; op != NULL; op = op->next) {
-		if (op->direction == D_READ)
+	failed = 0;
+	for (i = 0; last != NULL && i < n; i++) {
+		if (!run[i].active || !run[i].jop ||
+				durability(run[i].jop->flags) == J_DUR_ORDERED)
 			continue;
 
-		r = journal_add_op(jop, op->buf, op->len, op->offset);
-		if (r != 0)
-			goto unlink_exit;
+		if (!failed && journal_sync(run[i].jop, &run[i] == last) != 0)
+			failed = 1;
+	}
 
-		fiu_exit_on("jio/commit/tf_opdata");
+	/* we only know the directory is safe after the last one, so if
+	 * anything failed none of them can be trusted */
+	for (i = 0; last != NULL && i < n; i++) {
+		if (!run[i].active || !run[i].jop ||
+				durability(run[i].jop->flags) == J_DUR_ORDERED)
+			continue;
+
+		if (failed) {
+			commit_end(&run[i]);
+			continue;
+		}
+
+		/* the transaction can be recovered from now on */
+		lsn_untrack(run[i].ts->fs, run[i].jop);
 	}
 
-	if (jop)
-		journal_pre_commit(jop);
+	fiu_exit_on("jio/commit/tf_sync");
 
-	fiu_exit_on("jio/commit/tf_data");
+	for (i = 0; i < n; i++) {
+		if (run[i].active && commit_apply(&run[i]) != 0)
+			commit_end(&run[i]);
+	}
 
-	if (!(ts->flags & J_NOROLLBACK)) {
-		for (op = ts->op; op != NULL; op = op->next) {
-			if (op->direction == D_READ)
-				continue;
+	/* wait for the data, with a single sync if we can't do it range by
+	 * range */
+	if (have_sync_range) {
+		for (i = 0; i < n; i++) {
+			if (commit_needs_data_sync(&run[i]) &&
+					commit_wait_data(&run[i]) != 0)
+				commit_end(&run[i]);
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			if (commit_needs_data_sync(&run[i]))
+				break;
+		}
 
-			 r = operation_read_prev(ts, op);
-			 if (r < 0)
-				 goto unlink_exit;
+		if (i < n && fdatasync(run[i].ts->fs->fd) != 0) {
+			for ( ; i < n; i++) {
+				if (commit_needs_data_sync(&run[i]))
+					commit_end(&run[i]);
+			}
 		}
 	}
 
-	if (jop) {
-		r = journal_commit(jop);
-		if (r < 0)
-			goto unlink_exit;
+	for (i = 0; i < n; i++) {
+		if (!run[i].active)
+			continue;
+
+		commit_finish(&run[i]);
+		commit_end(&run[i]);
 	}
+}
 
-	/* now that we have a safe transaction file, let's apply it */
-	written = 0;
-	for (op = ts->op; op != NULL; op = op->next) {
-		if (op->direction == D_READ) {
-			r = spread(ts->fs->fd, op->buf, op->len, op->offset);
-			if (r != op->len)
-				goto rollback_exit;
+/* Commit a transaction */
+ssize_t jtrans_commit(struct jtrans *ts)
+{
+	ssize_t status;
 
-			continue;
-		}
+	jtrans_commit_many(&ts, 1, &status);
+	return status;
+}
 
-		/* from now on, write ops (which are more interesting) */
+/** Commit a transaction made of a single write operation with the data of
+ * the given buffers, like jpwritev() does, without allocating it: it's kept
+ * on the stack and the data is journaled and written straight from the
+ * buffers. Returns like jtrans_commit(). */
+ssize_t jtrans_commit_wv(struct jfs *fs, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	int i;
+	ssize_t rv;
+	size_t count, charged;
+	struct jtrans ts;
+	struct operation op;
+	unsigned char pdata[STACK_PDATA_SIZE];
+
+	count = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > MAX_TSIZE - count)
+			return -1;
+		count += iov[i].iov_len;
+	}
 
-		r = spwrite(ts->fs->fd, op->buf, op->len, op->offset);
-		if (r != op->len)
-			goto rollback_exit;
+	if (count == 0)
+		return -1;
 
-		written += r;
+	/* the data is the caller's, we only hold the previous data, and only
+	 * if it doesn't fit on the stack */
+	charged = 0;
+	if (count > sizeof(pdata) && count < fs->spill_threshold &&
+			!((fs->flags) & J_NOROLLBACK)) {
+		if (budget_charge(fs, count) != 0)
+			return -1;
+		charged = count;
+	}
 
-		if (have_sync_range && !(ts->flags & J_LINGER)) {
-			r = sync_range_submit(ts->fs->fd, op->len,
-					op->offset);
-			if (r != 0)
-				goto rollback_exit;
-		}
+	jtrans_setup(&ts);
+	jtrans_init(&ts, fs, 0);
+
+	/* the transaction doesn't outlive us (the applier takes its own
+	 * copy of the data), so the operation can use the caller's buffer
+	 * as it is, and the previous data can live on the stack if it's
+	 * small */
+	op.locked = 0;
+	op.direct = 0;
+	op.offset = offset;
+	op.len = count;
+	op.buf = NULL;
+	op.iov = iov;
+	op.iovcnt = iovcnt;
+	op.srcfd = -1;
+	op.wbuf = NULL;
+	op.wbufsize = 0;
+	op.direction = D_WRITE;
+	op.plen = 0;
+	op.pdata = NULL;
+	op.pdatasize = 0;
+	op.pspilled = 0;
+	if (count <= sizeof(pdata)) {
+		op.pdata = pdata;
+		op.pdatasize = sizeof(pdata);
+	}
+	op.elided = 0;
 
-		fiu_exit_on("jio/commit/wrote_op");
+	/* a single buffer is no different from the usual ones */
+	if (iovcnt == 1) {
+		op.buf = iov[0].iov_base;
+		op.iov = NULL;
+		op.iovcnt = 0;
 	}
+	op.prev = NULL;
+	op.next = NULL;
 
-	fiu_exit_on("jio/commit/wrote_all_ops");
+	ts.op = &op;
+	ts.numops_w = 1;
+	ts.len_w = count;
 
-	if (jop && (ts->flags & J_LINGER)) {
-		struct jlinger *lp;
+	rv = jtrans_commit(&ts);
 
-		linger = malloc(sizeof(struct jlinger));
-		if (linger == NULL)
-			goto rollback_exit;
+	if (op.pdata != pdata)
+		free(op.pdata);
+	if (ts.undo_fd >= 0)
+		close(ts.undo_fd);
+	pthread_mutex_destroy(&(ts.lock));
+	budget_release(fs, charged);
 
-		linger->jop = jop;
-		linger->next = NULL;
+	return rv;
+}
 
-		pthread_mutex_lock(&(ts->fs->ltlock));
+/** Like jtrans_commit_wv(), with a single buffer, like jpwrite() does */
+ssize_t jtrans_commit_w(struct jfs *fs, const void *buf, size_t count,
+		off_t offset)
+{
+	struct iovec iov;
 
-		/* add it to the end of the list so they're in order */
-		if (ts->fs->ltrans == NULL) {
-			ts->fs->ltrans = linger;
-		} else {
-			lp = ts->fs->ltrans;
-			while (lp->next != NULL)
-				lp = lp->next;
-			lp->next = linger;
-		}
+	/* the data is only read, see jtrans_add_w() */
+	iov.iov_base = (void *) buf;
+	iov.iov_len = count;
+	return jtrans_commit_wv(fs, &iov, 1, offset);
+}
 
-		ts->fs->ltrans_len += written;
-		autosync_check(ts->fs);
+/* Commit many transactions */
+unsigned int jtrans_commit_many(struct jtrans **ts, unsigned int n,
+		ssize_t *status)
+{
+	unsigned int i, j, start, ok;
+	struct commit_state one, *cs;
+
+	/* committing a single transaction is the common case, and doesn't
+	 * need to allocate anything */
+	cs = &one;
+	if (n > 1)
+		cs = malloc(sizeof(struct commit_state) * n);
+	if (cs == NULL) {
+		for (i = 0; status != NULL && i < n; i++)
+			status[i] = -1;
+		return 0;
+	}
 
-		pthread_mutex_unlock(&(ts->fs->ltlock));
+	/* we group the transactions in runs that can share the syncs, and
+	 * cut a run short when a transaction overlaps with one of it (or is
+	 * for a different file): it has to see the data of the previous
+	 * ones when reading the previous data, so they must be applied
+	 * first */
+	start = 0;
+	for (i = 0; i < n; i++) {
+		cs[i].ts = ts[i];
+		cs[i].active = 0;
+		pthread_mutex_lock(&(ts[i]->lock));
+
+		for (j = start; j < i; j++) {
+			if (ts[j]->fs != ts[i]->fs ||
+					trans_overlap(ts[j], ts[i]))
+				break;
+		}
 
-		/* Leave the journal_free() up to jsync() */
-		jop = NULL;
-	} else if (jop) {
-		if (have_sync_range) {
-			for (op = ts->op; op != NULL; op = op->next) {
-				if (op->direction == D_READ)
-					continue;
-
-				r = sync_range_wait(ts->fs->fd, op->len,
-						op->offset);
-				if (r != 0)
-					goto rollback_exit;
-			}
-		} else {
-			if (fdatasync(ts->fs->fd) != 0)
-				goto rollback_exit;
+		if (j < i) {
+			commit_run(cs + start, i - start);
+			start = i;
 		}
+
+		if (commit_journal(&cs[i]) != 0)
+			commit_end(&cs[i]);
 	}
 
-	/* mark the transaction as committed */
-	ts->flags = ts->flags | J_COMMITTED;
+	commit_run(cs + start, n - start);
 
-	retval = 1;
+	ok = 0;
+	for (i = 0; i < n; i++) {
+		if (status != NULL)
+			status[i] = cs[i].retval;
+		if (cs[i].retval > 0)
+			ok++;
+	}
 
-rollback_exit:
-	/* If the transaction failed we try to recover by rolling it back.
-	 * Only used if it has at least one write operation.
-	 *
-	 * NOTE: on extreme conditions (ENOSPC/disk failure) this can fail
-	 * too! There's nothing much we can do in that case, the caller should
-	 * take care of it by itself.
-	 *
-	 * Transactions that were successfuly recovered by rolling them back
-	 * will have J_ROLLBACKED in their flags. */
-	if (jop && !(ts->flags & J_COMMITTED) &&
-			!(ts->flags & J_ROLLBACKING)) {
-		r = ts->flags;
-		ts->flags = ts->flags | J_NOLOCK | J_ROLLBACKING;
-		if (jtrans_rollback(ts) >= 0) {
-			ts->flags = r | J_ROLLBACKED;
-			retval = -1;
-		} else {
-			ts->flags = r;
-			retval = -2;
+	/* now that nothing is locked, free the lingering transactions of the
+	 * files that reached their fd budget, once per file */
+	for (i = 0; i < n; i++) {
+		if (!cs[i].sync_fds)
+			continue;
+
+		for (j = 0; j < i; j++) {
+			if (cs[j].sync_fds && ts[j]->fs == ts[i]->fs)
+				break;
 		}
+
+		if (j == i)
+			budget_sync(ts[i]->fs);
 	}
 
-unlink_exit:
-	/* If the journal operation is no longer needed, we remove it from the
-	 * disk.
-	 *
-	 * Extreme conditions (filesystem just got read-only, for example) can
-	 * cause journal_free() to fail, but there's not much left to do at
-	 * that point, and the caller will have to be careful and stop its
-	 * operations. In that case, we will return -2, and the transaction
-	 * will be marked as J_COMMITTED to indicate that the data was
-	 * effectively written to disk. */
-	if (jop) {
-		/* Note we only unlink if we've written down the real data, or
-		 * at least rolled it back properly */
-		int data_is_safe = (ts->flags & J_COMMITTED) ||
-			(ts->flags & J_ROLLBACKED);
-		r = journal_free(jop, data_is_safe ? 1 : 0);
-		if (r != 0)
-			retval = -2;
+	if (cs != &one)
+		free(cs);
+	return ok;
+}
 
-		jop = NULL;
-	}
+/** Undo the part of a write operation that extended the file, for
+ * jtrans_rollback(). tend is where the transaction's writes end. If there's
+ * nothing past it, the file is truncated back; otherwise the data there may
+ * belong to others (like appends committed at the same time), so the range is
+ * filled with zeros instead, like recovery does. Returns 0 on success, -1 on
+ * error. */
+static int rollback_extend(struct jfs *fs, struct operation *op, off_t tend)
+{
+	int rv;
+	off_t start, end;
+	struct stat st;
 
-unlock_exit:
-	/* always unlock everything at the end; otherwise we could have
-	 * half-overlapping transactions applying simultaneously, and if
-	 * anything goes wrong it would be possible to break consistency */
-	lock_file_ranges(ts, F_UNLOCK);
+	start = op->offset + op->plen;
+	end = op->offset + op->len;
 
-exit:
-	pthread_mutex_unlock(&(ts->lock));
+	/* appends reserve their range with appendlock held, so holding it
+	 * makes sure nobody appends past us while we decide */
+	pthread_mutex_lock(&(fs->appendlock));
+
+	rv = fstat(fs->fd, &st);
+	if (rv != 0)
+		goto exit;
+
+	if (st.st_size > tend || (fs->appends && fs->append_end > tend)) {
+		/* only what was written, the rest will be a hole anyway */
+		if (st.st_size < end)
+			end = st.st_size;
+		if (end > start)
+			rv = fill_zeros(fs->fd, end - start, start);
+	} else if (st.st_size > start) {
+		/* the operations can be in any order, so an earlier one may
+		 * have been truncated further already, and we must not extend
+		 * the file again */
+		rv = ftruncate(fs->fd, start);
+	}
 
-	return retval;
+exit:
+	pthread_mutex_unlock(&(fs->appendlock));
+	return rv;
 }
 
 /* Rollback a transaction */
 ssize_t jtrans_rollback(struct jtrans *ts)
 {
 	ssize_t rv;
+	off_t tend;
 	struct jtrans *newts;
 	struct operation *op, *curop, *lop;
 
@@ -489,9 +1858,22 @@ ssize_t jtrans_rollback(struct jtrans *ts)
 		goto exit;
 	}
 
-	/* find the last operation */
-	for (op = ts->op; op->next != NULL; op = op->next)
-		;
+	/* we may need to truncate the file below, so the data of the
+	 * transaction must have been applied already */
+	if (applier_drain(ts->fs) != 0) {
+		rv = -1;
+		goto exit;
+	}
+
+	/* find the last operation, and where the writes end */
+	tend = 0;
+	for (op = ts->op; ; op = op->next) {
+		if (op->direction == D_WRITE &&
+				op->offset + (off_t) op->len > tend)
+			tend = op->offset + op->len;
+		if (op->next == NULL)
+			break;
+	}
 
 	/* and traverse the list backwards, skipping read operations */
 	for ( ; op != NULL; op = op->prev) {
@@ -499,14 +1881,11 @@ ssize_t jtrans_rollback(struct jtrans *ts)
 			continue;
 
 		/* if we extended the data in the previous transaction, we
-		 * should truncate it back */
-		/* DANGEROUS: this is one of the main reasons why rollbacking
-		 * is dangerous and should only be done with extreme caution:
-		 * if for some reason, after the previous transacton, we have
-		 * extended the file further, this will cut it back to what it
-		 * was; read the docs for more detail */
+		 * should truncate it back, or zero it if the file has been
+		 * extended further since then; read the docs for more
+		 * detail */
 		if (op->plen < op->len) {
-			rv = ftruncate(ts->fs->fd, op->offset + op->plen);
+			rv = rollback_extend(ts->fs, op, tend);
 			if (rv != 0)
 				goto exit;
 		}
@@ -521,10 +1900,26 @@ ssize_t jtrans_rollback(struct jtrans *ts)
 		curop->offset = op->offset;
 		curop->len = op->plen;
 		curop->buf = op->pdata;
-		curop->plen = op->plen;
-		curop->pdata = op->pdata;
+		curop->iov = NULL;
+		curop->iovcnt = 0;
+		curop->srcfd = -1;
+		curop->wbuf = NULL;
+		curop->wbufsize = 0;
+		curop->plen = 0;
+		curop->pdata = NULL;
+		curop->pdatasize = 0;
+		curop->pspilled = 0;
+
+		/* spilled previous data is read back from the undo file */
+		if (op->pspilled && op->plen) {
+			curop->buf = NULL;
+			curop->srcfd = ts->undo_fd;
+			curop->srcoff = op->poffset;
+		}
 		curop->direction = op->direction;
+		curop->elided = 0;
 		curop->locked = 0;
+		curop->direct = 0;
 
 		newts->numops_w++;
 		newts->len_w += curop->len;
@@ -546,19 +1941,26 @@ ssize_t jtrans_rollback(struct jtrans *ts)
 	rv = jtrans_commit(newts);
 
 exit:
-	/* Free the transaction, taking care to set buf to NULL first since
-	 * points to the same address as pdata, which would otherwise make
-	 * jtrans_free() attempt to free it twice. We leave the data at
-	 * curop->pdata since it is freed unconditionally, while the action
-	 * on curop->buf depends on the direction of the transaction. */
-	for (curop = newts->op; curop != NULL; curop = curop->next) {
-		curop->buf = NULL;
-	}
+	/* the operations' buf point to the previous data of the original
+	 * transaction, which belongs to it; jtrans_free() only frees the
+	 * buffers in wbuf and pdata */
 	jtrans_free(newts);
 
 	return rv;
 }
 
+/* Get the LSN of the last commit */
+uint64_t jtrans_lsn(struct jtrans *ts)
+{
+	return ts->id;
+}
+
+/* Get how many bytes the last commit skipped */
+size_t jtrans_elided(struct jtrans *ts)
+{
+	return ts->elided;
+}
+
 
 /*
  * Basic operations
@@ -566,13 +1968,67 @@ exit:
 
 /* Open a file */
 struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
+{
+	struct jopen_opts opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.jflags = jflags;
+
+	return jopen_ex(name, flags, mode, &opts);
+}
+
+/* Open a file, with extended options */
+struct jfs *jopen_ex(const char *name, int flags, int mode,
+		const struct jopen_opts *opts)
 {
 	int jfd, rv;
-	unsigned int t;
+	unsigned int jflags;
 	char jdir[PATH_MAX], jlockfile[PATH_MAX];
 	struct stat sinfo;
 	pthread_mutexattr_t attr;
 	struct jfs *fs;
+	struct jopen_opts defaults;
+
+	if (opts == NULL) {
+		memset(&defaults, 0, sizeof(defaults));
+		opts = &defaults;
+	}
+
+	/* we only have one of each, but the caller may ask for others */
+	if ((opts->checksum != J_CSUM_DEFAULT &&
+				opts->checksum != J_CSUM_CRC32C) ||
+			(opts->io != J_IO_DEFAULT && opts->io != J_IO_POSIX) ||
+			(opts->lock != J_LOCK_DEFAULT &&
+				opts->lock != J_LOCK_FCNTL &&
+				opts->lock != J_LOCK_NONE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	jflags = opts->jflags;
+	if (opts->lock == J_LOCK_NONE)
+		jflags |= J_NOLOCK;
+
+	/* the direct writes of a bulk load would race with the applier */
+	if ((jflags & J_BULKLOAD) && (jflags & J_ASYNC)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (check_durability(jflags, jflags & J_ASYNC) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* there's nothing to roll back to past the bulk start, and the rest
+	 * is expected to be mostly holes and zeros */
+	if (jflags & J_BULKLOAD)
+		jflags |= J_NOROLLBACK;
+
+	if (opts->jdir != NULL && strlen(opts->jdir) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
 
 	fs = malloc(sizeof(struct jfs));
 	if (fs == NULL)
@@ -584,6 +2040,24 @@ struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
 	fs->jdirfd = -1;
 	fs->jmap = MAP_FAILED;
 	fs->as_cfg = NULL;
+	fs->ap_cfg = NULL;
+	fs->lsn_pending = NULL;
+	fs->lsn_pending_last = NULL;
+	fs->last_lsn = 0;
+	fs->durable_lsn = 0;
+	fs->durable_efd = -1;
+	fs->lsn_failed = 0;
+	fs->bulk_start = -1;
+	fs->pos = 0;
+	fs->stdio = NULL;
+	fs->append_end = 0;
+	fs->appends = 0;
+	fs->trans_cache = opts->trans_cache;
+	fs->spill_threshold = opts->spill_threshold ? opts->spill_threshold :
+		DEFAULT_SPILL_THRESHOLD;
+	fs->splice_threshold = opts->splice_threshold;
+	fs->jop_cache = NULL;
+	fs->jop_cached = 0;
 
 	/* we provide either read-only or read-write access, because when we
 	 * commit a transaction we read the current contents before applying,
@@ -603,27 +2077,48 @@ struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
 	fs->open_flags = flags;
 	fs->ltrans = NULL;
 	fs->ltrans_len = 0;
+	fs->ltrans_count = 0;
+	fs->fds_peak = 0;
+	fs->fd_budget = opts->fd_budget;
+	fs->mem_used = 0;
+	fs->mem_peak = 0;
+	fs->mem_budget = opts->mem_budget;
+	fs->budget_nowait = opts->budget_nowait;
+	fs->mem_waits = 0;
+	fs->mem_failures = 0;
+	fs->early_syncs = 0;
 
 	/* Note on fs->lock usage: this lock is used only to protect the file
-	 * pointer. This means that it must only be held while performing
-	 * operations that depend or alter the file pointer (jread, jreadv,
-	 * jwrite, jwritev), but the others (jpread, jpwrite) are left
-	 * unprotected because they can be performed in parallel as long as
-	 * they don't affect the same portion of the file (this is protected
-	 * by lockf). The lock doesn't slow things down tho: any threaded app
-	 * MUST implement this kind of locking anyways if it wants to prevent
-	 * data corruption, we only make it easier for them by taking care of
-	 * it here. If performance is essential, the jpread/jpwrite functions
-	 * should be used, just as real life.
+	 * pointer (fs->pos, which we keep ourselves). This means that it must
+	 * only be held while performing operations that depend or alter the
+	 * file pointer (jread, jreadv, jwrite, jwritev), but the others
+	 * (jpread, jpwrite) are left unprotected because they can be
+	 * performed in parallel as long as they don't affect the same portion
+	 * of the file (this is protected by lockf). The lock doesn't slow
+	 * things down tho: any threaded app MUST implement this kind of
+	 * locking anyways if it wants to prevent data corruption, we only make
+	 * it easier for them by taking care of it here. If performance is
+	 * essential, the jpread/jpwrite functions should be used, just as real
+	 * life.
 	 * About fs->ltlock, it's used to protect the lingering transactions
 	 * list, fs->ltrans. */
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
 	pthread_mutex_init( &(fs->lock), &attr);
 	pthread_mutex_init( &(fs->ltlock), &attr);
+	pthread_mutex_init( &(fs->lsnlock), &attr);
+	pthread_mutex_init( &(fs->bulklock), &attr);
+	pthread_mutex_init( &(fs->appendlock), &attr);
+	pthread_mutex_init( &(fs->memlock), &attr);
 	pthread_mutexattr_destroy(&attr);
-
-	fs->fd = open(name, flags, mode);
+	pthread_cond_init(&(fs->durable_cond), NULL);
+	pthread_cond_init(&(fs->mem_cond), NULL);
+
+	/* appends are done by jwrite() and jwritev() at the offset they
+	 * reserve, and everything is written with pwrite(), which ignores the
+	 * offset on files opened with O_APPEND (at least on Linux); so the real
+	 * file is opened without it, and fs->open_flags keeps it */
+	fs->fd = open(name, flags & ~O_APPEND, mode);
 	if (fs->fd < 0)
 		goto error_exit;
 
@@ -632,7 +2127,9 @@ struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
 		return fs;
 	}
 
-	if (!get_jdir(name, jdir))
+	if (opts->jdir != NULL)
+		strcpy(jdir, opts->jdir);
+	else if (!get_jdir(name, jdir))
 		goto error_exit;
 	mkdir(jdir, 0750);
 	rv = lstat(jdir, &sinfo);
@@ -650,6 +2147,9 @@ struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
 	if (fs->jdirfd < 0)
 		goto error_exit;
 
+	if (fs->splice_threshold == J_SPLICE_AUTO)
+		fs->splice_threshold = journal_splice_threshold(fs);
+
 	snprintf(jlockfile, PATH_MAX, "%s/lock", jdir);
 	jfd = open(jlockfile, O_RDWR | O_CREAT, 0600);
 	if (jfd < 0)
@@ -657,25 +2157,34 @@ struct jfs *jopen(const char *name, int flags, int mode, unsigned int jflags)
 
 	fs->jfd = jfd;
 
-	/* initialize the lock file by writing the first tid to it, but only
-	 * if its empty, otherwise there is a race if two processes call
-	 * jopen() simultaneously and both initialize the file */
+	/* initialize the lock file by writing the first tid to it (or upgrade
+	 * it), but only if its empty, otherwise there is a race if two
+	 * processes call jopen() simultaneously and both initialize the
+	 * file */
 	plockf(jfd, F_LOCKW, 0, 0);
-	lstat(jlockfile, &sinfo);
-	if (sinfo.st_size != sizeof(unsigned int)) {
-		t = 0;
-		rv = spwrite(jfd, &t, sizeof(t), 0);
-		if (rv != sizeof(t)) {
-			goto error_exit;
-		}
-	}
+	rv = init_lockfile(jfd);
 	plockf(jfd, F_UNLOCK, 0, 0);
+	if (rv != 0)
+		goto error_exit;
 
-	fs->jmap = (unsigned int *) mmap(NULL, sizeof(unsigned int),
+	fs->jmap = (uint64_t *) mmap(NULL, sizeof(uint64_t),
 			PROT_READ | PROT_WRITE, MAP_SHARED, jfd, 0);
 	if (fs->jmap == MAP_FAILED)
 		goto error_exit;
 
+	if ((jflags & J_BULKLOAD) && bulk_begin(fs) != 0)
+		goto error_exit;
+
+	if ((jflags & J_ASYNC) && applier_start(fs, opts->async_max_pending,
+				opts->async_max_bytes,
+				opts->group_commit_usec) != 0)
+		goto error_exit;
+
+	if (opts->autosync_max_sec && jfs_autosync_start(fs,
+				opts->autosync_max_sec,
+				opts->autosync_max_bytes) != 0)
+		goto error_exit;
+
 	return fs;
 
 error_exit:
@@ -695,6 +2204,11 @@ int jsync(struct jfs *fs)
 	if (fs->fd < 0)
 		return -1;
 
+	/* the applier syncs the data itself before removing the transaction
+	 * files, so we just need to wait for it */
+	if (applier_drain(fs) != 0)
+		return -1;
+
 	rv = fdatasync(fs->fd);
 	if (rv != 0)
 		return rv;
@@ -713,11 +2227,14 @@ int jsync(struct jfs *fs)
 		ltmp = fs->ltrans->next;
 		free(fs->ltrans);
 		fs->ltrans = ltmp;
+		fs->ltrans_count--;
 	}
 
 	fs->ltrans_len = 0;
 	pthread_mutex_unlock(&(fs->ltlock));
-	return 0;
+
+	/* with J_BULKLOAD, the data loaded so far is safe now */
+	return bulk_checkpoint(fs, 0);
 }
 
 /* Change the location of the journal directory */
@@ -756,6 +2273,14 @@ int jmove_journal(struct jfs *fs, const char *newpath)
 		if (ret < 0)
 			goto exit;
 
+		/* and the bulk load marker, if there is one */
+		snprintf(oldjlockfile, PATH_MAX, "%s/bulkload", oldpath);
+		snprintf(jlockfile, PATH_MAX, "%s/bulkload", newpath);
+		ret = rename(oldjlockfile, jlockfile);
+		if (ret < 0 && errno != ENOENT)
+			goto exit;
+		snprintf(oldjlockfile, PATH_MAX, "%s/lock", oldpath);
+
 		/* remove the journal directory, if possible */
 		unlink(oldjlockfile);
 		ret = rmdir(oldpath);
@@ -780,18 +2305,27 @@ int jclose(struct jfs *fs)
 
 	ret = 0;
 
+	/* the data buffered by the stdio wrappers must be written first */
+	if (stdio_close(fs))
+		ret = -1;
+
 	if (jfs_autosync_stop(fs))
 		ret = -1;
 
+	if (applier_stop(fs))
+		ret = -1;
+
 	if (! (fs->flags & J_RDONLY)) {
 		if (jsync(fs))
 			ret = -1;
+		if (bulk_end(fs))
+			ret = -1;
 		if (fs->jfd < 0 || close(fs->jfd))
 			ret = -1;
 		if (fs->jdirfd < 0 || close(fs->jdirfd))
 			ret = -1;
 		if (fs->jmap != MAP_FAILED)
-			munmap(fs->jmap, sizeof(unsigned int));
+			munmap(fs->jmap, sizeof(uint64_t));
 	}
 
 	if (fs->fd < 0 || close(fs->fd))
@@ -802,8 +2336,19 @@ int jclose(struct jfs *fs)
 	if (fs->jdir)
 		free(fs->jdir);
 
+	if (fs->durable_efd >= 0 && close(fs->durable_efd))
+		ret = -1;
+
+	journal_free_cache(fs);
+
 	pthread_mutex_destroy(&(fs->lock));
 	pthread_mutex_destroy(&(fs->ltlock));
+	pthread_mutex_destroy(&(fs->lsnlock));
+	pthread_mutex_destroy(&(fs->bulklock));
+	pthread_mutex_destroy(&(fs->appendlock));
+	pthread_mutex_destroy(&(fs->memlock));
+	pthread_cond_destroy(&(fs->durable_cond));
+	pthread_cond_destroy(&(fs->mem_cond));
 
 	free(fs);
 
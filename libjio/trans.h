@@ -10,7 +10,7 @@ struct jtrans {
 	struct jfs *fs;
 
 	/** Transaction id */
-	int id;
+	uint64_t id;
 
 	/** Transaction flags */
 	uint32_t flags;
@@ -24,11 +24,31 @@ struct jtrans {
 	/** Sum of the lengths of the write operations */
 	size_t len_w;
 
+	/** Bytes the last commit didn't write because they were unchanged */
+	size_t elided;
+
+	/** Bytes charged against the file's memory budget (see budget.c) */
+	size_t mem;
+
 	/** Lock that protects the list of operations */
 	pthread_mutex_t lock;
 
 	/** List of operations */
 	struct operation *op;
+
+	/** Operations removed by jtrans_reset(), kept with their buffers to
+	 * be reused by the next ones added */
+	struct operation *spare;
+
+	/** Next transaction in the per-thread cache (see jtrans_free()) */
+	struct jtrans *cache_next;
+
+	/** Undo file holding the spilled previous data, or -1 if it hasn't
+	 * been created (see operation_spill_prev()) */
+	int undo_fd;
+
+	/** Bytes of the undo file used by the last commit */
+	off_t undo_len;
 };
 
 /** Possible operation directions */
@@ -42,6 +62,9 @@ struct operation {
 	/** Is the region locked? */
 	int locked;
 
+	/** Is it written without being journaled? (see bulk.c) */
+	int direct;
+
 	/** Operation's offset */
 	off_t offset;
 
@@ -51,6 +74,26 @@ struct operation {
 	/** Data buffer */
 	void *buf;
 
+	/** Data buffers, used instead of buf if not NULL; they're the
+	 * caller's (see jtrans_commit_wv()) */
+	const struct iovec *iov;
+
+	/** Number of buffers in iov */
+	int iovcnt;
+
+	/** File the data is read from instead of buf, or -1 */
+	int srcfd;
+
+	/** Offset of the data in srcfd */
+	off_t srcoff;
+
+	/** Buffer allocated for the data of write operations, which buf
+	 * points to; it's kept for reuse by jtrans_reset() */
+	void *wbuf;
+
+	/** Size of wbuf */
+	size_t wbufsize;
+
 	/** Direction */
 	enum op_direction direction;
 
@@ -60,6 +103,23 @@ struct operation {
 	/** Previous data (only if direction == D_WRITE) */
 	void *pdata;
 
+	/** Size of the buffer pdata points to */
+	size_t pdatasize;
+
+	/** Is the previous data in the transaction's undo file instead of
+	 * pdata? (only if direction == D_WRITE) */
+	int pspilled;
+
+	/** Offset of the previous data in the undo file, if pspilled */
+	off_t poffset;
+
+	/** If pspilled, is the previous data the same as the data? */
+	int pequal;
+
+	/** Is the data the same as the previous one? (only if direction ==
+	 * D_WRITE) */
+	int elided;
+
 	/** Previous operation */
 	struct operation *prev;
 
@@ -8,12 +8,66 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "libjio.h"
 #include "common.h"
+#include "compat.h"
 #include "trans.h"
 
 
+/** Maximum number of buffers jpreadv() reads with a single preadv() */
+#define READ_IOV_MAX 64
+
+/** Reserve count bytes at the end of the file for an append. The end takes
+ * into account the appends that are still being committed, so concurrent
+ * appenders get consecutive ranges and can commit in parallel. Must be
+ * followed by append_done(). Returns the offset to write at, or -1 on
+ * error. */
+static off_t append_reserve(struct jfs *fs, size_t count)
+{
+	off_t end;
+
+	pthread_mutex_lock(&(fs->appendlock));
+
+	end = applier_file_end(fs);
+	if (end >= 0) {
+		if (fs->appends && fs->append_end > end)
+			end = fs->append_end;
+		fs->append_end = end + count;
+		fs->appends++;
+	}
+
+	pthread_mutex_unlock(&(fs->appendlock));
+
+	return end;
+}
+
+/** Finish an append of count bytes at pos, reserved with append_reserve();
+ * rv is what its commit returned. If it failed, the range is given back,
+ * unless somebody has reserved past it already; in that case it's left as a
+ * hole. If it succeeded, the file pointer is moved after the data. */
+static void append_done(struct jfs *fs, off_t pos, size_t count, ssize_t rv)
+{
+	pthread_mutex_lock(&(fs->appendlock));
+
+	if (rv < 0 && fs->append_end == pos + (off_t) count)
+		fs->append_end = pos;
+
+	/* once there are no appends in progress, the file is the one that
+	 * knows where it ends (it can be truncated, or written by others) */
+	fs->appends--;
+
+	pthread_mutex_unlock(&(fs->appendlock));
+
+	if (rv >= 0) {
+		pthread_mutex_lock(&(fs->lock));
+		fs->pos = pos + count;
+		pthread_mutex_unlock(&(fs->lock));
+	}
+}
+
+
 /*
  * read() family wrappers
  */
@@ -26,14 +80,14 @@ ssize_t jread(struct jfs *fs, void *buf, size_t count)
 
 	pthread_mutex_lock(&(fs->lock));
 
-	pos = lseek(fs->fd, 0, SEEK_CUR);
+	pos = fs->pos;
 
 	plockf(fs->fd, F_LOCKR, pos, count);
-	rv = spread(fs->fd, buf, count, pos);
+	rv = applier_pread(fs, buf, count, pos);
 	plockf(fs->fd, F_UNLOCK, pos, count);
 
 	if (rv > 0)
-		lseek(fs->fd, rv, SEEK_CUR);
+		fs->pos += rv;
 
 	pthread_mutex_unlock(&(fs->lock));
 
@@ -46,7 +100,7 @@ ssize_t jpread(struct jfs *fs, void *buf, size_t count, off_t offset)
 	ssize_t rv;
 
 	plockf(fs->fd, F_LOCKR, offset, count);
-	rv = spread(fs->fd, buf, count, offset);
+	rv = applier_pread(fs, buf, count, offset);
 	plockf(fs->fd, F_UNLOCK, offset, count);
 
 	return rv;
@@ -56,22 +110,76 @@ ssize_t jpread(struct jfs *fs, void *buf, size_t count, off_t offset)
 ssize_t jreadv(struct jfs *fs, const struct iovec *vector, int count)
 {
 	ssize_t rv;
-	off_t pos;
 
 	pthread_mutex_lock(&(fs->lock));
-	pos = lseek(fs->fd, 0, SEEK_CUR);
-	if (pos < 0)
-		return -1;
 
-	plockf(fs->fd, F_LOCKR, pos, count);
-	rv = readv(fs->fd, vector, count);
-	plockf(fs->fd, F_UNLOCK, pos, count);
+	rv = jpreadv(fs, vector, count, fs->pos);
+	if (rv > 0)
+		fs->pos += rv;
 
 	pthread_mutex_unlock(&(fs->lock));
 
 	return rv;
 }
 
+/* preadv() wrapper */
+ssize_t jpreadv(struct jfs *fs, const struct iovec *vector, int count,
+		off_t offset)
+{
+	int i, j, n;
+	size_t total, len;
+	ssize_t rv, r;
+
+	total = 0;
+	for (i = 0; i < count; i++)
+		total += vector[i].iov_len;
+
+	plockf(fs->fd, F_LOCKR, offset, total);
+
+	/* preadv() takes a limited number of buffers, so we read them
+	 * READ_IOV_MAX at a time */
+	rv = 0;
+	if (fs->ap_cfg == NULL) {
+		for (i = 0; i < count; i += n) {
+			n = count - i < READ_IOV_MAX ? count - i : READ_IOV_MAX;
+
+			len = 0;
+			for (j = 0; j < n; j++)
+				len += vector[i + j].iov_len;
+
+			r = vec_pread(fs->fd, vector + i, n, offset + rv);
+			if (r < 0) {
+				rv = -1;
+				break;
+			}
+
+			rv += r;
+			if (r < len)
+				break;
+		}
+		plockf(fs->fd, F_UNLOCK, offset, total);
+		return rv;
+	}
+
+	/* with J_ASYNC the data that has not been applied yet is not in the
+	 * file, so we go through applier_pread() one buffer at a time */
+	for (i = 0; i < count; i++) {
+		r = applier_pread(fs, vector[i].iov_base,
+				vector[i].iov_len, offset + rv);
+		if (r < 0) {
+			rv = -1;
+			break;
+		}
+
+		rv += r;
+		if (r < vector[i].iov_len)
+			break;
+	}
+	plockf(fs->fd, F_UNLOCK, offset, total);
+
+	return rv;
+}
+
 
 /*
  * write() family wrappers
@@ -82,34 +190,31 @@ ssize_t jwrite(struct jfs *fs, const void *buf, size_t count)
 {
 	ssize_t rv;
 	off_t pos;
-	struct jtrans *ts;
 
-	ts = jtrans_new(fs, 0);
-	if (ts == NULL)
-		return -1;
+	/* appends only hold the locks while reserving their range, and
+	 * commit in parallel; the others hold fs->lock all along, because
+	 * they depend on the file pointer */
+	if (fs->open_flags & O_APPEND) {
+		pos = append_reserve(fs, count);
+		if (pos < 0)
+			return -1;
 
-	pthread_mutex_lock(&(fs->lock));
+		rv = jtrans_commit_w(fs, buf, count, pos);
+		append_done(fs, pos, count, rv);
 
-	if (fs->open_flags & O_APPEND)
-		pos = lseek(fs->fd, 0, SEEK_END);
-	else
-		pos = lseek(fs->fd, 0, SEEK_CUR);
+		return (rv >= 0) ? count : rv;
+	}
 
-	rv = jtrans_add_w(ts, buf, count, pos);
-	if (rv < 0)
-		goto exit;
+	pthread_mutex_lock(&(fs->lock));
 
-	rv = jtrans_commit(ts);
+	pos = fs->pos;
 
+	rv = jtrans_commit_w(fs, buf, count, pos);
 	if (rv >= 0)
-		lseek(fs->fd, count, SEEK_CUR);
-
-exit:
+		fs->pos += count;
 
 	pthread_mutex_unlock(&(fs->lock));
 
-	jtrans_free(ts);
-
 	return (rv >= 0) ? count : rv;
 }
 
@@ -117,20 +222,10 @@ exit:
 ssize_t jpwrite(struct jfs *fs, const void *buf, size_t count, off_t offset)
 {
 	ssize_t rv;
-	struct jtrans *ts;
-
-	ts = jtrans_new(fs, 0);
-	if (ts == NULL)
-		return -1;
-
-	rv = jtrans_add_w(ts, buf, count, offset);
-	if (rv < 0)
-		goto exit;
-
-	rv = jtrans_commit(ts);
 
-exit:
-	jtrans_free(ts);
+	/* a single write doesn't need a transaction of its own, see
+	 * jtrans_commit_w() */
+	rv = jtrans_commit_w(fs, buf, count, offset);
 
 	return (rv >= 0) ? count : rv;
 }
@@ -141,42 +236,52 @@ ssize_t jwritev(struct jfs *fs, const struct iovec *vector, int count)
 	int i;
 	size_t sum;
 	ssize_t rv;
-	off_t ipos, t;
-	struct jtrans *ts;
+	off_t ipos;
 
-	ts = jtrans_new(fs, 0);
-	if (ts == NULL)
-		return -1;
-
-	pthread_mutex_lock(&(fs->lock));
-
-	if (fs->open_flags & O_APPEND)
-		ipos = lseek(fs->fd, 0, SEEK_END);
-	else
-		ipos = lseek(fs->fd, 0, SEEK_CUR);
+	sum = 0;
+	for (i = 0; i < count; i++)
+		sum += vector[i].iov_len;
 
-	t = ipos;
+	/* see jwrite() */
+	if (fs->open_flags & O_APPEND) {
+		ipos = append_reserve(fs, sum);
+		if (ipos < 0)
+			return -1;
 
-	sum = 0;
-	for (i = 0; i < count; i++) {
-		rv = jtrans_add_w(ts, vector[i].iov_base,
-				vector[i].iov_len, t);
-		if (rv < 0)
-			goto exit;
+		rv = jtrans_commit_wv(fs, vector, count, ipos);
+		append_done(fs, ipos, sum, rv);
 
-		sum += vector[i].iov_len;
-		t += vector[i].iov_len;
+		return (rv >= 0) ? sum : rv;
 	}
 
-	rv = jtrans_commit(ts);
+	pthread_mutex_lock(&(fs->lock));
+
+	ipos = fs->pos;
 
+	rv = jtrans_commit_wv(fs, vector, count, ipos);
 	if (rv >= 0)
-		lseek(fs->fd, sum, SEEK_CUR);
+		fs->pos += sum;
 
-exit:
 	pthread_mutex_unlock(&(fs->lock));
 
-	jtrans_free(ts);
+	return (rv >= 0) ? sum : rv;
+}
+
+/* pwritev() wrapper */
+ssize_t jpwritev(struct jfs *fs, const struct iovec *vector, int count,
+		off_t offset)
+{
+	int i;
+	size_t sum;
+	ssize_t rv;
+
+	sum = 0;
+	for (i = 0; i < count; i++)
+		sum += vector[i].iov_len;
+
+	/* the buffers make up a single operation, so the range is locked,
+	 * journaled and written at once, straight from them */
+	rv = jtrans_commit_wv(fs, vector, count, offset);
 
 	return (rv >= 0) ? sum : rv;
 }
@@ -186,6 +291,16 @@ int jtruncate(struct jfs *fs, off_t length)
 {
 	int rv;
 
+	/* the data that has not been applied yet could extend the file after
+	 * we truncate it */
+	if (applier_drain(fs) != 0)
+		return -1;
+
+	/* with J_BULKLOAD, the data after length must not be taken as
+	 * loaded anymore */
+	if (bulk_truncate(fs, length) != 0)
+		return -1;
+
 	/* lock from length to the end of file */
 	plockf(fs->fd, F_LOCKW, length, 0);
 	rv = ftruncate(fs->fd, length);
@@ -200,7 +315,33 @@ off_t jlseek(struct jfs *fs, off_t offset, int whence)
 	off_t rv;
 
 	pthread_mutex_lock(&(fs->lock));
-	rv = lseek(fs->fd, offset, whence);
+
+	if (whence == SEEK_SET) {
+		rv = offset;
+	} else if (whence == SEEK_CUR) {
+		rv = fs->pos + offset;
+	} else if (whence == SEEK_END) {
+		/* with J_ASYNC, it takes into account the data that has not
+		 * been applied yet */
+		rv = applier_file_end(fs);
+		if (rv < 0)
+			goto exit;
+		rv += offset;
+	} else {
+		errno = EINVAL;
+		rv = -1;
+		goto exit;
+	}
+
+	if (rv < 0) {
+		errno = EINVAL;
+		rv = -1;
+		goto exit;
+	}
+
+	fs->pos = rv;
+
+exit:
 	pthread_mutex_unlock(&(fs->lock));
 
 	return rv;
@@ -32,7 +32,7 @@ def test_f01():
 
 	n = run_with_tmp(f1)
 	assert content(n) == c
-	assert struct.unpack("I", content(jiodir(n) + '/lock'))[0] == 0
+	assert struct.unpack("Q", content(jiodir(n) + '/lock'))[0] == 1
 	fsck_verify(n)
 	assert content(n) == c
 	cleanup(n)
@@ -78,7 +78,7 @@ def test_f04():
 
 	n = run_with_tmp(f1)
 
-	assert len(content(transpath(n, 1))) == DHS + DOHS + len(c)
+	assert len(content(transpath(n, 1))) == DHS + opsize(len(c))
 	assert content(n) == ''
 	fsck_verify(n, broken = 1)
 	assert content(n) == ''
@@ -98,7 +98,7 @@ def test_f05():
 
 	n = run_with_tmp(f1)
 
-	assert len(content(transpath(n, 1))) == DHS + (DOHS + len(c)) * 2
+	assert len(content(transpath(n, 1))) == DHS + opsize(len(c)) * 2
 	assert content(n) == ''
 	fsck_verify(n, broken = 1)
 	assert content(n) == ''
@@ -117,7 +117,7 @@ def test_f06():
 
 	n = run_with_tmp(f1)
 
-	assert len(content(transpath(n, 1))) == DHS + (DOHS + len(c)) * 2
+	assert len(content(transpath(n, 1))) == DHS + opsize(len(c)) * 2
 	assert content(n) == ''
 	fsck_verify(n, broken = 1)
 	assert content(n) == ''
@@ -179,7 +179,7 @@ def test_f10():
 
 	n = run_with_tmp(f1)
 	assert content(n) == c
-	assert struct.unpack("I", content(jiodir(n) + '/lock'))[0] == 1
+	assert struct.unpack("Q", content(jiodir(n) + '/lock'))[0] == 1
 	fsck_verify(n)
 	assert content(n) == c
 	assert not os.path.exists(jiodir(n))
@@ -444,3 +444,1296 @@ def test_n24():
 	fsck_verify(n)
 	cleanup(n)
 
+
+def test_n25():
+	"jfsck() of old (version 1) transaction files"
+	f, jf = bitmp()
+	n = f.name
+	del jf
+
+	c1 = gencontent(1000)
+	c2 = gencontent(13)
+
+	tf = TransFile()
+	tf.path = transpath(n, 1)
+	tf.ver = 1
+	tf.id = 1
+	tf.ops.append(attrdict(tlen = len(c1), offset = 0, flags = 0,
+		checksum = 0, payload = c1))
+	tf.ops.append(attrdict(tlen = len(c2), offset = 2000, flags = 0,
+		checksum = 0, payload = c2))
+	tf.update_checksums()
+	tf.save()
+
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c1 + '\0' * 1000 + c2
+	cleanup(n)
+
+def test_n26():
+	"jfsck() of hand-made transaction files"
+	f, jf = bitmp()
+	n = f.name
+	del jf
+
+	c1 = gencontent(1001)
+	c2 = gencontent(8)
+
+	tf = TransFile()
+	tf.path = transpath(n, 1)
+	tf.id = 1
+	tf.ops.append(attrdict(tlen = len(c1), offset = 0, flags = 0,
+		checksum = 0, payload = c1))
+	tf.ops.append(attrdict(tlen = len(c2), offset = 1001, flags = 0,
+		checksum = 0, payload = c2))
+	tf.update_checksums()
+	tf.save()
+
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c1 + c2
+	cleanup(n)
+
+def test_n27():
+	"64-bit transaction ids and old lock files"
+	f, jf = bitmp()
+	n = f.name
+	del jf
+
+	# an old lock file, holding a 32-bit id
+	open(jiodir(n) + '/lock', 'w').write(struct.pack("I", 7))
+
+	c1 = gencontent(100)
+	c2 = gencontent(100)
+
+	# transactions are applied in order, even when their names don't
+	# sort as strings do
+	for tid, c in ((2 ** 32 + 5, c1), (10 * 2 ** 32, c2)):
+		tf = TransFile()
+		tf.path = transpath(n, tid)
+		tf.id = tid
+		tf.ops.append(attrdict(tlen = len(c), offset = 0, flags = 0,
+			checksum = 0, payload = c))
+		tf.update_checksums()
+		tf.save()
+
+	# no cleanup, so we can look at the lock file
+	res = fsck(n)
+	assert res['reapplied'] == res['total'] == 2
+	assert content(n) == c2
+	lock = content(jiodir(n) + '/lock')
+	assert struct.unpack("Q", lock)[0] == 10 * 2 ** 32
+
+	jf = libjio.open(n, libjio.O_RDWR, 0400)
+	jf.write(c1)
+	del jf
+	lock = content(jiodir(n) + '/lock')
+	assert struct.unpack("Q", lock)[0] == 10 * 2 ** 32 + 1
+	assert content(n) == c1
+
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n28():
+	"J_COMPRESS"
+	c1 = gencontent(200 * 1024 + 17)
+	c2 = ''.join(chr(random.randint(0, 255)) for i in range(5000))
+
+	def f1(f, jf):
+		jf.write(c1)
+		jf.write(c2)
+
+		# leave the lingering transactions behind, as if we had
+		# crashed
+		os._exit(0)
+
+	n = run_with_tmp(f1, jflags = libjio.J_LINGER | libjio.J_COMPRESS)
+	assert content(n) == c1 + c2
+
+	# c1 compresses nicely, c2 can't be compressed so it's stored raw
+	tf = TransFile(transpath(n, 1))
+	assert tf.ops[0].flags == 1
+	assert len(tf.ops[0].payload) < len(c1) / 10
+	tf = TransFile(transpath(n, 2))
+	assert tf.ops[0].flags == 0
+	assert tf.ops[0].payload == c2
+
+	# lose the data, so we know it comes from the journal
+	open(n, 'w').truncate(0)
+	fsck_verify(n, reapplied = 2)
+	assert content(n) == c1 + c2
+	cleanup(n)
+
+def test_n29():
+	"J_DELTA"
+	c1 = gencontent(4096)
+	c2 = c1[:100] + 'x' * 20 + c1[120:3000] + 'y' + c1[3001:] + 'z' * 50
+
+	def f1(f, jf):
+		jf.write(c1)
+		jf.pwrite(c2, 0)
+
+		# leave the lingering transactions behind, as if we had
+		# crashed
+		os._exit(0)
+
+	n = run_with_tmp(f1, jflags = libjio.J_LINGER | libjio.J_DELTA)
+	assert content(n) == c2
+
+	# the first one has nothing to compare against, the second one only
+	# has the changes (the file extension is one of them)
+	tf = TransFile(transpath(n, 1))
+	assert tf.ops[0].flags == 0
+	tf = TransFile(transpath(n, 2))
+	assert tf.ops[0].flags == 2
+	assert len(tf.ops[0].payload) < 200
+
+	# go back to the first version, so we know the changes come from the
+	# journal
+	open(n, 'w').write(c1)
+	fsck_verify(n, reapplied = 2)
+	assert content(n) == c2
+	cleanup(n)
+
+
+def test_n30():
+	"elide unchanged writes"
+	c1 = gencontent(3000)
+	c2 = gencontent(1000)
+
+	f, jf = bitmp(jflags = libjio.J_LINGER)
+	n = f.name
+
+	jf.write(c1)
+
+	# only the second operation changes the data
+	t = jf.new_trans()
+	t.add_w(c1[:1000], 0)
+	t.add_w(c2, 1000)
+	t.commit()
+	assert t.elided() == 1000
+	assert content(n) == c1[:1000] + c2 + c1[2000:]
+
+	tf = TransFile(transpath(n, 2))
+	assert len(tf.ops) == 1
+	assert tf.ops[0].offset == 1000
+
+	# nothing changes, so the journal is not even touched
+	t = jf.new_trans()
+	t.add_w(c2, 1000)
+	t.add_w(c1[2000:], 2000)
+	t.commit()
+	assert t.elided() == 2000
+	assert not os.path.exists(transpath(n, 3))
+
+	# overlapping and extending writes are never skipped
+	t = jf.new_trans()
+	t.add_w(c2, 1000)
+	t.add_w(c2[:10], 1000)
+	t.add_w(c1[2000:] + 'x', 2000)
+	t.commit()
+	assert t.elided() == 0
+	assert len(TransFile(transpath(n, 3)).ops) == 3
+	del t
+	del jf
+
+	assert content(n) == c1[:1000] + c2 + c1[2000:] + 'x'
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n31():
+	"J_ASYNC"
+	c = [gencontent(random.randint(1, 5000)) for i in range(50)]
+	expected = ''.join(c)
+
+	f, jf = bitmp(jflags = libjio.J_ASYNC)
+	n = f.name
+
+	# what's written must be visible right away, even if it has not been
+	# applied yet
+	for i, s in enumerate(c):
+		jf.write(s)
+		assert jf.pread(len(s), jf.lseek(0, 1) - len(s)) == s
+		jf.pwrite('x', i)
+	expected = 'x' * len(c) + expected[len(c):]
+
+	assert jf.lseek(0, 2) == len(expected)
+	jf.lseek(0, 0)
+	assert jf.read(len(expected) + 10) == expected
+	jf.jsync()
+	assert content(n) == expected
+	del jf
+
+	fsck_verify(n)
+	cleanup(n)
+
+	# if we die before the data is applied, it comes from the journal
+	def f1(f, jf):
+		jf = libjio.open(f.name, libjio.O_RDWR, 0600,
+				libjio.J_ASYNC)
+		for s in c:
+			jf.write(s)
+		os._exit(0)
+
+	n = run_with_tmp(f1)
+	res = fsck(n)
+	assert res['total'] == res['reapplied']
+	assert content(n) == ''.join(c)
+	cleanup(n)
+
+def test_n32():
+	"LSNs and durability"
+	f, jf = bitmp(jflags = libjio.J_LINGER)
+	n = f.name
+	efd = jf.durable_eventfd()
+
+	lsns = []
+	for i in range(5):
+		t = jf.new_trans()
+		t.add_w(gencontent(100), i * 100)
+		t.commit()
+		lsns.append(t.lsn())
+	assert lsns == sorted(lsns) and len(set(lsns)) == len(lsns)
+
+	# the journal is synced when committing, so they're all durable
+	assert jf.durable_lsn() >= lsns[-1]
+	assert jf.wait_durable(lsns[-1], 0)
+	assert jf.wait_durable(lsns[-1])
+	assert struct.unpack("Q", os.read(efd, 8))[0] >= 1
+
+	# but the ones that were not committed yet are not
+	assert not jf.wait_durable(lsns[-1] + 1, 10)
+
+	# commits that don't use the journal don't get an LSN
+	t = jf.new_trans()
+	t.add_w(content(n)[:100], 0)
+	t.commit()
+	assert t.lsn() == 0
+	del t
+	del jf
+
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n33():
+	"durability levels"
+	c1 = gencontent(1000)
+	c2 = gencontent(1000)
+	c3 = gencontent(1000)
+
+	# J_DUR_ORDERED needs the applier, and can't take deltas
+	n = tmppath()
+	for jflags in (libjio.J_DUR_ORDERED,
+			libjio.J_DUR_ORDERED | libjio.J_ASYNC | libjio.J_DELTA):
+		try:
+			libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+					jflags)
+		except IOError:
+			pass
+		else:
+			raise AssertionError
+
+	for jflags in (0, libjio.J_ASYNC | libjio.J_DELTA):
+		jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+				jflags)
+		try:
+			jf.new_trans(libjio.J_DUR_ORDERED)
+		except IOError:
+			pass
+		else:
+			raise AssertionError
+		del jf
+	cleanup(n)
+
+	f, jf = bitmp(jflags = libjio.J_DUR_JOURNAL)
+	n = f.name
+
+	# the journal is synced, so it's durable, but the data is not synced
+	# until jsync()
+	t1 = jf.new_trans()
+	t1.add_w(c1, 0)
+	t1.commit()
+	assert os.path.exists(transpath(n, t1.lsn()))
+	assert jf.wait_durable(t1.lsn(), 0)
+
+	# the transaction can ask for more, but its transaction file must
+	# stay until the previous one is gone
+	t2 = jf.new_trans(libjio.J_DUR_FULL)
+	t2.add_w(c2, 0)
+	t2.commit()
+	assert os.path.exists(transpath(n, t2.lsn()))
+
+	t3 = jf.new_trans(libjio.J_DUR_JOURNAL)
+	t3.add_w(c3, 1000)
+	t3.commit()
+	assert os.path.exists(transpath(n, t3.lsn()))
+
+	jf.jsync()
+	assert jf.wait_durable(t3.lsn(), 0)
+	assert os.listdir(jiodir(n)) == ['lock']
+	assert content(n) == c2 + c3
+
+	# with a full commit and nothing lingering, it's all done by the time
+	# it returns
+	t4 = jf.new_trans(libjio.J_DUR_FULL)
+	t4.add_w(c1, 0)
+	t4.commit()
+	assert jf.wait_durable(t4.lsn(), 0)
+	assert not os.path.exists(transpath(n, t4.lsn()))
+	del t1, t2, t3, t4
+	del jf
+
+	assert content(n) == c1 + c3
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n34():
+	"jopen_ex() options"
+	c = gencontent()
+	n = tmppath()
+	jdir = tmppath()
+
+	def f1():
+		jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+				libjio.J_LINGER, jdir = jdir)
+		jf.write(c)
+
+		# leave the transaction behind, as if we had crashed
+		os._exit(0)
+
+	run_forked(f1)
+	assert sorted(os.listdir(jdir)) == ['1', 'lock']
+	assert not os.path.exists(jiodir(n))
+
+	open(n, 'w').truncate(0)
+	res = libjio.jfsck(n, jdir = jdir)
+	assert res['total'] == res['reapplied'] == 1
+	assert content(n) == c
+
+	# the async queue limits and the grouping don't change the results
+	jf = libjio.open(n, libjio.O_RDWR, 0600, libjio.J_ASYNC, jdir = jdir,
+			async_max_pending = 2, async_max_bytes = 3000,
+			group_commit_usec = 1000)
+	for i in range(20):
+		jf.pwrite(c[i * 100:(i + 1) * 100], i * 100)
+		assert jf.pread(100, i * 100) == c[i * 100:(i + 1) * 100]
+	del jf
+	assert content(n) == c
+	assert os.listdir(jdir) == ['lock']
+
+	os.unlink(n)
+	os.unlink(jdir + '/lock')
+	os.rmdir(jdir)
+
+
+def test_n35():
+	"pipelined commits with J_ASYNC | J_DUR_ORDERED"
+	c = gencontent(2000)
+	f, jf = bitmp(jflags = libjio.J_ASYNC | libjio.J_DUR_ORDERED)
+	n = f.name
+
+	lsns = []
+	for i in range(20):
+		t = jf.new_trans()
+		t.add_w(c[i * 100:(i + 1) * 100], i * 100)
+		t.commit()
+		lsns.append(t.lsn())
+		assert jf.pread(100, i * 100) == c[i * 100:(i + 1) * 100]
+	assert lsns == sorted(lsns) and len(set(lsns)) == len(lsns)
+
+	# the syncer makes them durable on its own
+	assert jf.wait_durable(lsns[-1], 10000)
+	assert jf.durable_lsn() >= lsns[-1]
+	jf.jsync()
+	assert content(n) == c
+
+	# the ones the applier can't take are synced before they're applied
+	# by the caller
+	src = tmppath()
+	open(src, 'w').write(c)
+	srcfd = os.open(src, os.O_RDONLY)
+	t = jf.new_trans()
+	t.add_w_fd(srcfd, 0, 1000, 1000)
+	t.commit()
+	assert jf.wait_durable(t.lsn(), 0)
+	assert content(n) == c[:1000] + c[:1000]
+	os.close(srcfd)
+	os.unlink(src)
+	jf.pwrite(c[1000:], 1000)
+	jf.jsync()
+	assert content(n) == c
+	del t
+	del jf
+
+	fsck_verify(n)
+	cleanup(n)
+
+	# if we die before the data is applied, it comes from the journal
+	def f1(f, jf):
+		jf = libjio.open(f.name, libjio.O_RDWR, 0600,
+				libjio.J_ASYNC | libjio.J_DUR_ORDERED)
+		for i in range(20):
+			jf.pwrite(c[i * 100:(i + 1) * 100], i * 100)
+		os._exit(0)
+
+	n = run_with_tmp(f1)
+	res = fsck(n)
+	assert res['total'] == res['reapplied']
+	assert content(n) == c
+	cleanup(n)
+
+def test_n36():
+	"jtrans_commit_many()"
+	c = gencontent(1000)
+	f, jf = bitmp()
+	n = f.name
+
+	# independent transactions, which share the syncs
+	ts = []
+	for i in range(10):
+		t = jf.new_trans()
+		t.add_w(c[i * 100:(i + 1) * 100], i * 100)
+		ts.append(t)
+	assert libjio.commit_many(ts) == [1] * 10
+	assert content(n) == c
+	assert libjio.commit_many([]) == []
+
+	# overlapping ones must see each other's data, and be applied in
+	# order
+	t1 = jf.new_trans()
+	t1.add_w('a' * 200, 0)
+	t2 = jf.new_trans()
+	t2.add_w('b' * 100, 100)
+	t3 = jf.new_trans()
+	t3.add_w('c' * 100, 500)
+	t4 = jf.new_trans()
+	t4.add_w('d' * 100, 150)
+	assert libjio.commit_many([t1, t2, t3, t4]) == [1] * 4
+	expected = 'a' * 100 + 'b' * 50 + 'd' * 100 + c[250:500] + \
+			'c' * 100 + c[600:]
+	assert content(n) == expected
+
+	# rolling back t4 gives us t2's data back
+	t4.rollback()
+	assert content(n)[150:200] == 'b' * 50
+
+	# a failed one doesn't affect the others
+	t5 = jf.new_trans()
+	t6 = jf.new_trans()
+	t6.add_w('e' * 10, 0)
+	r = libjio.commit_many([t5, t6])
+	assert r[0] < 0 and r[1] == 1
+	assert content(n)[:10] == 'e' * 10
+
+	del t1, t2, t3, t4, t5, t6, t, ts
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n37():
+	"J_BULKLOAD"
+	c1 = gencontent(1000)
+	c2 = gencontent(5000)
+	f, jf = bitmp()
+	n = f.name
+	jf.write(c1)
+	del jf
+
+	jf = libjio.open(n, libjio.O_RDWR, 0600, libjio.J_BULKLOAD)
+	assert os.path.exists(jiodir(n) + '/bulkload')
+
+	# writes past the end don't use the journal
+	jf.pwrite(c2, 1000)
+	assert sorted(os.listdir(jiodir(n))) == ['bulkload', 'lock']
+
+	# but the ones before it do, and the ones that cross it too
+	jf.pwrite('x' * 10, 0)
+	jf.pwrite('y' * 100, 950)
+	expected = 'x' * 10 + c1[10:950] + 'y' * 100 + c2[50:]
+	assert content(n) == expected
+	jf.jsync()
+	del jf
+
+	assert not os.path.exists(jiodir(n) + '/bulkload')
+	fsck_verify(n)
+	assert content(n) == expected
+	cleanup(n)
+
+	# if we die in the middle, the file goes back to the last jsync()
+	def f1(f, jf):
+		jf = libjio.open(f.name, libjio.O_RDWR, 0600,
+				libjio.J_BULKLOAD)
+		jf.pwrite(c1, 0)
+		jf.jsync()
+		jf.pwrite(c2, 1000)
+		os._exit(0)
+
+	n = run_with_tmp(f1)
+	assert len(content(n)) == 6000
+	fsck_verify(n)
+	assert content(n) == c1
+	cleanup(n)
+
+	# it can't be used with J_ASYNC
+	try:
+		libjio.open(tmppath(), libjio.O_RDWR | libjio.O_CREAT, 0600,
+				libjio.J_BULKLOAD | libjio.J_ASYNC)
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+
+
+def test_n38():
+	"J_FASTEXTEND"
+	c1 = gencontent(1000)
+	c2 = gencontent(2000)
+	f, jf = bitmp(jflags = libjio.J_FASTEXTEND)
+	n = f.name
+
+	# transactions that only extend the file, and rolling them back
+	jf.write(c1)
+	t = jf.new_trans()
+	t.add_w(c2[1000:], 2000)
+	t.add_w(c2[:1000], 1000)
+	t.commit()
+	assert content(n) == c1 + c2
+	t.rollback()
+	assert content(n) == c1
+
+	# the ones that write over the existing data are journaled as usual
+	jf.pwrite(c2, 500)
+	assert content(n) == c1[:500] + c2
+
+	del t
+	del jf
+	fsck_verify(n)
+	assert content(n) == c1[:500] + c2
+	cleanup(n)
+
+	# on recovery, they're undone instead of applied
+	def f1(f, jf):
+		jf.write(c1 + c2)
+		os._exit(0)
+
+	n = run_with_tmp(f1)
+	tf = TransFile()
+	tf.path = transpath(n, 1)
+	tf.id = 1
+	tf.ops = [attrdict(tlen = 1000, offset = 2000, flags = 4,
+			checksum = 0, payload = ''),
+		attrdict(tlen = 1000, offset = 1000, flags = 4,
+			checksum = 0, payload = '')]
+	tf.update_checksums()
+	tf.save()
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c1
+	cleanup(n)
+
+	# but if something else extended the file past them, we can't
+	# truncate it so the range is filled with zeros
+	n = run_with_tmp(f1)
+	tf.path = transpath(n, 1)
+	tf.ops = tf.ops[1:]
+	tf.update_checksums()
+	tf.save()
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == c1 + '\0' * 1000 + c2[1000:]
+	cleanup(n)
+
+def test_n39():
+	"concurrent appends with O_APPEND"
+	import threading
+	f, jf = bitmp(mode = 'a')
+	n = f.name
+
+	# each thread appends records made of its own letter, so we can
+	# tell if they interleave
+	def appender(jf, letter):
+		for i in range(20):
+			if i % 2:
+				jf.write(letter * 100)
+			else:
+				jf.writev([letter * 50, letter * 50])
+
+	threads = [ threading.Thread(target = appender, args = (jf, l))
+			for l in 'abcd' ]
+	for t in threads:
+		t.start()
+	for t in threads:
+		t.join()
+
+	c = content(n)
+	assert len(c) == 4 * 20 * 100
+	for i in range(0, len(c), 100):
+		assert c[i:i + 100] == c[i] * 100
+	for l in 'abcd':
+		assert c.count(l) == 20 * 100
+
+	# the file pointer is left after the data we appended; with the
+	# threads racing it's after whichever commit finished last, so we
+	# check it after a last append
+	jf.write('z' * 100)
+	c += 'z' * 100
+	assert jf.lseek(0, os.SEEK_CUR) == len(c)
+
+	# pwrite() still writes at the given offset
+	jf.pwrite('x' * 10, 0)
+	jf.write('y' * 10)
+	assert content(n) == 'x' * 10 + c[10:] + 'y' * 10
+
+	del threads, t
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n40():
+	"file position"
+	c = gencontent(1000)
+	f, jf = bitmp()
+	n = f.name
+
+	jf.write(c)
+	assert jf.lseek(0, os.SEEK_CUR) == 1000
+	assert jf.lseek(-100, os.SEEK_END) == 900
+	assert jf.read(200) == c[900:]
+	assert jf.lseek(-500, os.SEEK_CUR) == 500
+	b1, b2 = bytearray(10), bytearray(20)
+	assert jf.readv([b1, b2]) == 30
+	assert b1 == c[500:510] and b2 == c[510:530]
+	jf.writev(['x' * 10, 'y' * 10])
+	assert jf.lseek(0, os.SEEK_CUR) == 550
+
+	# invalid positions are rejected, and leave it where it was
+	try:
+		jf.lseek(-1, os.SEEK_SET)
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+	assert jf.lseek(0, os.SEEK_CUR) == 550
+
+	# the real file gets the position only when it's handed out
+	assert os.lseek(jf.fileno(), 0, os.SEEK_CUR) == 550
+
+	del jf
+	fsck_verify(n)
+	assert content(n) == c[:530] + 'x' * 10 + 'y' * 10 + c[550:]
+	cleanup(n)
+
+def test_n41():
+	"jpreadv() and jpwritev()"
+	c = gencontent(1000)
+	f, jf = bitmp()
+	n = f.name
+
+	jf.write(c)
+	assert jf.pwritev(['a' * 10, 'b' * 20, 'c' * 30], 100) == 60
+	expected = c[:100] + 'a' * 10 + 'b' * 20 + 'c' * 30 + c[160:]
+	assert content(n) == expected
+
+	# the file pointer is not used nor moved
+	assert jf.lseek(0, os.SEEK_CUR) == 1000
+
+	b1, b2 = bytearray(15), bytearray(25)
+	assert jf.preadv([b1, b2], 105) == 40
+	assert b1 == expected[105:120] and b2 == expected[120:145]
+	assert jf.lseek(0, os.SEEK_CUR) == 1000
+
+	# short reads at the end of the file
+	assert jf.preadv([b1, b2], 990) == 10
+	assert b1[:10] == expected[990:]
+
+	# the buffers are written as a single operation
+	def f1(f, jf):
+		jf.pwritev(['x' * 10, 'y' * 10], 0)
+		os._exit(0)
+
+	n2 = run_with_tmp(f1, jflags = libjio.J_LINGER)
+	assert TransFile(transpath(n2, 1)).numops == 1
+	fsck_verify(n2, reapplied = 1)
+	assert content(n2) == 'x' * 10 + 'y' * 10
+	cleanup(n2)
+
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n42():
+	"single writes around the size of the stack buffer"
+	f, jf = bitmp(jflags = libjio.J_LINGER)
+	n = f.name
+
+	c = gencontent(20 * 1024)
+	jf.write(c)
+	expected = c
+	for size in (1, 4095, 4096, 4097, 10000):
+		d = gencontent(size)
+		jf.pwrite(d, 100)
+		expected = expected[:100] + d + expected[100 + size:]
+		assert content(n) == expected
+
+		# and once more, so the previous data is the one we just wrote
+		jf.pwrite(d, 101)
+		expected = expected[:101] + d + expected[101 + size:]
+		assert content(n) == expected
+
+	jf.lseek(0, os.SEEK_END)
+	jf.write(c[:5000])
+	expected += c[:5000]
+	assert content(n) == expected
+
+	del jf
+	fsck_verify(n)
+	assert content(n) == expected
+	cleanup(n)
+
+def test_n43():
+	"jtrans_reset() and the transaction cache"
+	n = tmppath()
+	jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+			trans_cache = 2)
+
+	# the same transaction, reset and reused with different sizes
+	t = jf.new_trans()
+	expected = ''
+	for size in (100, 50, 200, 200, 10):
+		d = gencontent(size)
+		t.add_w(d, len(expected))
+		t.add_w(d[:5], 0)
+		t.commit()
+		expected = d[:5] + (expected + d)[5:]
+		assert content(n) == expected
+		t.reset()
+
+	# a reset transaction has nothing to commit
+	try:
+		t.commit()
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+
+	# read operations can reuse the operations too
+	b = bytearray(10)
+	t.add_r(b, 0)
+	t.commit()
+	assert b == expected[:10]
+	t.reset()
+	del t
+
+	# transactions freed and created again come from the cache
+	for i in range(10):
+		t = jf.new_trans()
+		t.add_w('x' * (i + 1), 0)
+		t.commit()
+		del t
+	expected = 'x' * 10 + expected[10:]
+	assert content(n) == expected
+
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n44():
+	"memory and fd budgets"
+	import threading, errno
+	n = tmppath()
+	jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+			mem_budget = 1000, budget_nowait = 1)
+
+	# each write operation holds twice its length
+	t1 = jf.new_trans()
+	t1.add_w('a' * 400, 0)
+	st = jf.budget_stats()
+	assert st['mem_used'] == 800 and st['mem_budget'] == 1000
+
+	t2 = jf.new_trans()
+	try:
+		t2.add_w('b' * 300, 400)
+	except IOError, e:
+		assert e.errno == errno.EAGAIN
+	else:
+		raise AssertionError
+	assert jf.budget_stats()['mem_failures'] == 1
+
+	t1.commit()
+	del t1
+	assert jf.budget_stats()['mem_used'] == 0
+
+	# a transaction bigger than the budget can go alone
+	t2.add_w('b' * 3000, 400)
+	t2.commit()
+	del t2
+	st = jf.budget_stats()
+	assert st['mem_used'] == 0 and st['mem_peak'] == 6000
+	assert content(n) == 'a' * 400 + 'b' * 3000
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+	# without budget_nowait, adds wait for the memory to be freed
+	jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+			mem_budget = 1000)
+	t1 = jf.new_trans()
+	t1.add_w('a' * 400, 0)
+
+	def adder(jf):
+		t = jf.new_trans()
+		t.add_w('b' * 300, 400)
+		t.commit()
+
+	th = threading.Thread(target = adder, args = (jf,))
+	th.start()
+	while jf.budget_stats()['mem_waits'] == 0:
+		time.sleep(0.01)
+	assert th.is_alive()
+
+	t1.commit()
+	del t1
+	th.join()
+	del th
+	assert content(n) == 'a' * 400 + 'b' * 300
+	assert jf.budget_stats()['mem_used'] == 0
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+	# lingering transactions are synced when they reach the fd budget
+	jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+			libjio.J_LINGER, fd_budget = 3)
+	for i in range(10):
+		jf.pwrite(str(i) * 10, i * 10)
+		st = jf.budget_stats()
+		assert st['fds_used'] < 3
+	assert st['fds_peak'] == 3 and st['early_syncs'] == 3
+	assert len(os.listdir(jiodir(n))) == 1 + st['fds_used']
+	del jf
+	fsck_verify(n)
+	assert content(n) == ''.join(str(i) * 10 for i in range(10))
+	cleanup(n)
+
+def test_n45():
+	"spill the previous data of big operations"
+	n = tmppath()
+	jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+			spill_threshold = 4096)
+	c = gencontent(100 * 1024)
+	jf.pwrite(c, 0)
+
+	# a big rewrite is rolled back from the undo file, and is charged
+	# only its length
+	t = jf.new_trans()
+	t.add_w('x' * 50000, 1000)
+	t.add_w('y' * 100, 60000)
+	t.add_w('z' * 80000, 90000)
+	assert jf.budget_stats()['mem_used'] == 50000 + 200 + 80000
+	t.commit()
+	assert content(n) == c[:1000] + 'x' * 50000 + c[51000:60000] + \
+			'y' * 100 + c[60100:90000] + 'z' * 80000
+	t.rollback()
+	assert content(n) == c
+	del t
+
+	# the undo file is not left behind
+	assert os.listdir(jiodir(n)) == ['lock']
+
+	# and big operations that don't change anything are still elided
+	t = jf.new_trans()
+	t.add_w(c[2000:12000], 2000)
+	t.commit()
+	assert t.elided() == 10000
+	del t
+
+	del jf
+	fsck_verify(n)
+	assert content(n) == c
+	cleanup(n)
+
+def test_n46():
+	"write the data of another file"
+	n = tmppath()
+	src = tmppath()
+	c = gencontent(300 * 1024)
+	open(src, 'w').write(c)
+	srcfd = os.open(src, os.O_RDONLY)
+
+	jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+			spill_threshold = 64 * 1024)
+	jf.write('x' * 1000)
+
+	# the data is not held in memory, only the previous data of the
+	# operations below the spill threshold
+	t = jf.new_trans()
+	t.add_w_fd(srcfd, 100, 200 * 1024, 500)
+	t.add_w_fd(srcfd, 0, 1000, 300 * 1024)
+	assert jf.budget_stats()['mem_used'] == 1000
+	t.commit()
+	assert content(n) == 'x' * 500 + c[100:100 + 200 * 1024] + \
+			'\0' * (300 * 1024 - 500 - 200 * 1024) + c[:1000]
+
+	# and it's journaled, so it's recovered too
+	assert os.listdir(jiodir(n)) == ['lock']
+	t.rollback()
+	assert content(n) == 'x' * 1000
+	del t
+
+	# past the end of the source, the commit fails
+	t = jf.new_trans()
+	t.add_w_fd(srcfd, len(c) - 10, 20, 0)
+	try:
+		t.commit()
+	except IOError:
+		pass
+	else:
+		raise AssertionError
+	del t
+
+	del jf
+	os.close(srcfd)
+
+	# like any commit that fails writing the transaction file, it leaves
+	# it behind, broken
+	fsck_verify(n, broken = 1)
+	assert content(n) == 'x' * 1000
+	cleanup(n)
+	os.unlink(src)
+
+def test_n47():
+	"splice big operations into the journal"
+	n = tmppath()
+	c1 = gencontent(200 * 1024)
+	c2 = gencontent(1000)
+
+	def f1():
+		jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600,
+				libjio.J_LINGER, splice_threshold = 64 * 1024)
+		jf.write(c1)
+		jf.write(c2)
+
+		# leave the lingering transactions behind, as if we had
+		# crashed
+		os._exit(0)
+
+	run_forked(f1)
+	assert content(n) == c1 + c2
+
+	# the first one was spliced, the second one was too small
+	tf = TransFile(transpath(n, 1))
+	assert tf.ops[0].payload == c1
+	tf = TransFile(transpath(n, 2))
+	assert tf.ops[0].payload == c2
+
+	# lose the data, so we know it comes from the journal (whose
+	# checksums are verified)
+	open(n, 'w').truncate(0)
+	fsck_verify(n, reapplied = 2)
+	assert content(n) == c1 + c2
+	cleanup(n)
+
+	# the library can pick the threshold by itself
+	jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600, 0,
+			splice_threshold = libjio.J_SPLICE_AUTO)
+	jf.write(c1)
+	jf.write(c2)
+	assert content(n) == c1 + c2
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n48():
+	"rollback of an append followed by another one"
+	c = gencontent(1000)
+	f, jf = bitmp(mode = 'a')
+	n = f.name
+
+	jf.write(c)
+
+	# this is what a failed append does when another one has been
+	# committed after it: the rollback must not truncate the file, or the
+	# later append would be lost
+	t = jf.new_trans()
+	t.add_w('a' * 100, len(c))
+	t.commit()
+	jf.write('b' * 100)
+	t.rollback()
+	assert content(n) == c + '\0' * 100 + 'b' * 100
+
+	# with nothing after it, it's truncated back as usual
+	t = jf.new_trans()
+	t.add_w('c' * 100, len(c) + 200)
+	t.commit()
+	t.rollback()
+	assert content(n) == c + '\0' * 100 + 'b' * 100
+
+	jf.write('d' * 100)
+	assert content(n) == c + '\0' * 100 + 'b' * 100 + 'd' * 100
+
+	del t
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n49():
+	"jpwritev() with many buffers"
+	# more buffers than we write at once, and more data than the previous
+	# data we keep on the stack
+	bufs = [ chr(ord('a') + i % 26) * (1 + i % 20) for i in range(1500) ]
+	data = ''.join(bufs)
+	c = gencontent(len(data) + 200)
+	f, jf = bitmp()
+	n = f.name
+
+	jf.write(c)
+	assert jf.pwritev(bufs, 100) == len(data)
+	expected = c[:100] + data + c[100 + len(data):]
+	assert content(n) == expected
+
+	# and they can be read back the same way
+	rbufs = [ bytearray(len(b)) for b in bufs ]
+	assert jf.preadv(rbufs, 100) == len(data)
+	assert ''.join(map(str, rbufs)) == data
+
+	# a read that hits the end of the file stops there
+	rbufs = [ bytearray(len(b)) for b in bufs ]
+	assert jf.preadv(rbufs, len(c) - 1000) == 1000
+	assert ''.join(map(str, rbufs))[:1000] == expected[-1000:]
+
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+	# the buffers are journaled as they are, or gathered to be
+	# compressed, and either way the data can be recovered
+	for jflags in (0, libjio.J_COMPRESS):
+		def f1(f, jf):
+			jf.pwritev(bufs, 0)
+			os._exit(0)
+
+		n = run_with_tmp(f1, jflags = libjio.J_LINGER | jflags)
+		assert content(n) == data
+
+		tf = TransFile(transpath(n, 1))
+		assert tf.numops == 1
+		if not jflags:
+			assert tf.ops[0].payload == data
+
+		open(n, 'w').truncate(0)
+		fsck_verify(n, reapplied = 1)
+		assert content(n) == data
+		cleanup(n)
+
+	# with J_ASYNC the applier keeps its own copy of the buffers
+	f, jf = bitmp(jflags = libjio.J_ASYNC)
+	n = f.name
+	jf.pwritev(bufs, 0)
+	assert jf.pread(len(data), 0) == data
+	rbufs = [ bytearray(len(b)) for b in bufs ]
+	assert jf.preadv(rbufs, 0) == len(data)
+	assert ''.join(map(str, rbufs)) == data
+	jf.jsync()
+	assert content(n) == data
+
+	del jf
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n50():
+	"buffered stdio wrappers"
+	n = tmppath()
+
+	def lasttid():
+		return struct.unpack("Q", content(jiodir(n) + '/lock'))[0]
+
+	c = [ gencontent(random.randint(1, 500)) for i in range(50) ]
+	expected = ''.join(c)
+
+	# small writes stay in the buffer, and are committed together
+	jf = libjio.fopen(n, 'w+')
+	for s in c:
+		assert jf.fwrite(s) == len(s)
+	assert content(n) == ''
+	assert jf.ftell() == len(expected)
+	jf.fflush()
+	assert content(n) == expected
+	assert lasttid() == 1
+
+	# reading sees what was written before
+	jf.fseek(0, os.SEEK_SET)
+	jf.fwrite('x' * 10)
+	assert content(n) == expected
+	assert jf.fread(20) == expected[10:30]
+	expected = 'x' * 10 + expected[10:]
+	assert content(n) == expected
+	assert jf.ftell() == 30
+
+	# seeking writes the buffer
+	jf.fwrite('y' * 10)
+	assert content(n) == expected
+	jf.fseek(0, os.SEEK_END)
+	expected = expected[:30] + 'y' * 10 + expected[40:]
+	assert content(n) == expected
+	assert jf.ftell() == len(expected)
+
+	# writing after reading ahead writes where the reading stopped
+	jf.fseek(0, os.SEEK_SET)
+	assert jf.fread(5) == 'x' * 5
+	jf.fwrite('z' * 10)
+	assert jf.ftell() == 15
+	jf.fflush()
+	expected = 'x' * 5 + 'z' * 10 + expected[15:]
+	assert content(n) == expected
+
+	# and closing writes it too
+	jf.fseek(0, os.SEEK_END)
+	jf.fwrite('w' * 10)
+	jf.fclose()
+	expected += 'w' * 10
+	assert content(n) == expected
+
+	# a read-only stream fails to write right away
+	jf = libjio.fopen(n, 'r')
+	assert not jf.ferror()
+	assert jf.fwrite('a' * 10) == 0
+	assert jf.ferror()
+	assert jf.fread(10) == expected[:10]
+	jf.fclose()
+	assert content(n) == expected
+
+	# on append streams, the buffered data goes at the end of the file,
+	# no matter where the stream was
+	jf = libjio.fopen(n, 'a+')
+	assert jf.fread(10) == expected[:10]
+	jf.fwrite('t' * 3)
+	assert content(n) == expected
+	assert jf.ftell() == len(expected) + 3
+	jf.fflush()
+	expected += 't' * 3
+	assert content(n) == expected
+	assert jf.ftell() == len(expected)
+	jf.fclose()
+
+	# jclose() writes what's buffered, like jfclose()
+	tid = lasttid()
+	jf = libjio.fopen(n, 'a')
+	jf.fwrite('v' * 10)
+	del jf
+	expected += 'v' * 10
+	assert content(n) == expected
+	assert lasttid() == tid + 1
+
+	# and so does jfileno(), which leaves the file offset after it
+	jf = libjio.fopen(n, 'r+')
+	jf.fwrite('u' * 5)
+	fd = jf.fileno()
+	expected = 'u' * 5 + expected[5:]
+	assert content(n) == expected
+	assert os.lseek(fd, 0, os.SEEK_CUR) == 5
+	del jf
+
+	fsck_verify(n)
+	cleanup(n)
+
+def test_n51():
+	"sorted and merged writes"
+	n = tmppath()
+	jf = libjio.open(n, libjio.O_RDWR | libjio.O_CREAT, 0600)
+
+	def piece(i, size):
+		return chr(ord('a') + i % 26) * size
+
+	def commit(jf, ops):
+		t = jf.new_trans()
+		for buf, offset in ops:
+			t.add_w(buf, offset)
+		t.commit()
+
+	# adjacent operations added in any order end up in their place
+	c = [ piece(i, random.randint(1, 5000)) for i in range(5) ]
+	offsets = [ sum(map(len, c[:i])) for i in range(5) ]
+	commit(jf, [ (c[i], offsets[i]) for i in (3, 0, 4, 2, 1) ])
+	assert content(n) == ''.join(c)
+
+	# overlapping ones are written in the order they were added, so the
+	# last one wins
+	commit(jf, [ ('x' * 100, 0), ('y' * 50, 25), ('z' * 10, 70),
+		('w' * 30, 60), ('v' * 20, 100) ])
+	expected = 'x' * 25 + 'y' * 35 + 'w' * 30 + 'x' * 10 + 'v' * 20 + \
+			''.join(c)[120:]
+	assert content(n) == expected
+
+	# more operations than fit in a single pwritev() and in the array on
+	# the stack
+	c = [ piece(i, random.randint(1, 300)) for i in range(200) ]
+	offsets = [ sum(map(len, c[:i])) for i in range(200) ]
+	ops = zip(c, offsets)
+	random.shuffle(ops)
+	commit(jf, ops)
+	expected = ''.join(c) + expected[len(''.join(c)):]
+	assert content(n) == expected
+
+	# the same, with holes in between, so they're not merged at all
+	ops = [ (piece(i, 10), i * 20) for i in range(100) ]
+	random.shuffle(ops)
+	commit(jf, ops)
+	expected = list(expected)
+	for buf, offset in ops:
+		expected[offset:offset + len(buf)] = buf
+	expected = ''.join(expected)
+	assert content(n) == expected
+
+	# operations that take their data from a file break the runs of the
+	# ones that follow each other
+	src = tmppath()
+	srcc = gencontent(10000)
+	open(src, 'w').write(srcc)
+	srcfd = os.open(src, os.O_RDONLY)
+
+	t = jf.new_trans()
+	t.add_w('1' * 100, 300)
+	t.add_w_fd(srcfd, 50, 200, 100)
+	t.add_w('2' * 100, 0)
+	t.add_w_fd(srcfd, 5000, 1000, 400)
+	t.add_w('3' * 100, 1400)
+	t.commit()
+	del t
+	os.close(srcfd)
+
+	expected = '2' * 100 + srcc[50:250] + '1' * 100 + \
+			srcc[5000:6000] + '3' * 100 + expected[1500:]
+	assert content(n) == expected
+
+	del jf
+	fsck_verify(n)
+	assert content(n) == expected
+	cleanup(n)
+	os.unlink(src)
+
+def test_n52():
+	"recover big lingering transactions"
+	# the data of the operations is much bigger than the buffer the
+	# transaction files are read with, and the second operation starts at
+	# an odd offset in the transaction file, so it spans the buffer's
+	# boundaries at odd places
+	c1 = gencontent(7)
+	c2 = ''.join([ chr(ord('a') + i % 26) * 4099 for i in range(800) ])
+	c2 = c2[:len(c2) - 13]
+
+	def f1(f, jf):
+		t = jf.new_trans()
+		t.add_w(c1, 0)
+		t.add_w(c2, 12345)
+		t.commit()
+		os._exit(0)
+
+	n = run_with_tmp(f1, jflags = libjio.J_LINGER)
+	expected = c1 + '\0' * (12345 - 7) + c2
+	assert content(n) == expected
+
+	tf = TransFile(transpath(n, 1))
+	assert tf.numops == 2
+	assert tf.ops[1].payload == c2
+
+	# lose the data, so it can only come from the journal
+	open(n, 'w').truncate(0)
+	fsck_verify(n, reapplied = 1)
+	assert content(n) == expected
+	cleanup(n)
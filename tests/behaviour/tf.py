@@ -17,11 +17,43 @@ import struct
 import libjio
 
 
-# Useful constants, must match journal.h
-DHS = 8		# disk header size
-DOHS = 12	# disk op header size
-DTS = 8		# disk trailer size
+# Useful constants, must match journal.c
+DHS = 32	# disk header size
+DOHS = 32	# disk op header size
+DTS = 16	# disk trailer size
 
+def padded(n):
+	"Returns n rounded up to the journal alignment (8 bytes)."
+	return (n + 7) & ~7
+
+def opsize(n):
+	"Returns the size of an operation with n bytes of data in the journal."
+	return DOHS + padded(n)
+
+
+def _crc_table():
+	table = []
+	for i in range(256):
+		c = i
+		for j in range(8):
+			if c & 1:
+				c = (c >> 1) ^ 0x82F63B78
+			else:
+				c = c >> 1
+		table.append(c)
+	return table
+
+_crc32c_table = _crc_table()
+
+def checksum(s, crc = 0):
+	"Returns the CRC32c of the given string, like libjio's checksum_buf()."
+	crc = ~crc & 0xFFFFFFFF
+	for c in s:
+		crc = (crc >> 8) ^ _crc32c_table[(crc ^ ord(c)) & 0xFF]
+	return ~crc & 0xFFFFFFFF
+
+
+_tmpcount = [0]
 
 def tmppath():
 	"""Returns a temporary path. We could use os.tmpnam() if it didn't
@@ -33,7 +65,11 @@ def tmppath():
 	now_s = str(int(now))
 	now_f = str((now - int(now)) * 10000)
 	now_str = "%s.%s" % (now_s[-5:], now_f[:now_f.find('.')])
-	return tmpdir + '/jiotest.%s.%s' % (now_str, os.getpid())
+
+	# the time alone is not enough when we're called twice in a row
+	_tmpcount[0] += 1
+	return tmpdir + '/jiotest.%s.%s.%d' % (now_str, os.getpid(),
+			_tmpcount[0])
 
 
 def run_forked(f, *args, **kwargs):
@@ -161,11 +197,16 @@ class attrdict (dict):
 		del self[name]
 
 class TransFile (object):
+	"""A transaction file. Both the version 1 (big endian, unaligned) and
+	version 2 (little endian, 8-byte aligned) formats are supported; ver
+	selects which one is used when saving."""
+
 	def __init__(self, path = ''):
-		self.ver = 1
+		self.ver = 2
 		self.id = -1
 		self.flags = 0
 		self.numops = -1
+		self.total_len = -1
 		self.checksum = -1
 		self.ops = []
 		self.path = path
@@ -174,7 +215,14 @@ class TransFile (object):
 
 	def load(self):
 		fd = open(self.path)
-
+		ver = fd.read(2)
+		fd.seek(0)
+		if struct.unpack("!H", ver)[0] == 1:
+			self.load_v1(fd)
+		else:
+			self.load_v2(fd)
+
+	def load_v1(self, fd):
 		# header
 		hdrfmt = "!HHI"
 		self.ver, self.flags, self.id = struct.unpack(hdrfmt,
@@ -191,29 +239,94 @@ class TransFile (object):
 			payload = fd.read(tlen)
 			assert len(payload) == tlen
 			self.ops.append(attrdict(tlen = tlen, offset = offset,
-				payload = payload))
+				flags = 0, checksum = 0, payload = payload))
 
 		# trailer
 		trailerfmt = "!II"
 		self.numops, self.checksum = struct.unpack(trailerfmt,
 				fd.read(struct.calcsize(trailerfmt)))
+		self.total_len = sum(o.tlen for o in self.ops)
+
+	def load_v2(self, fd):
+		# header
+		hdrfmt = "<HHIQQQ"
+		self.ver, self.flags, reserved, self.id, numops, \
+			self.total_len = struct.unpack(hdrfmt,
+				fd.read(struct.calcsize(hdrfmt)))
+
+		# operations
+		opfmt = "<QQQII"
+		self.ops = []
+		for i in range(numops):
+			tlen, offset, dlen, flags, csum = struct.unpack(opfmt,
+					fd.read(struct.calcsize(opfmt)))
+			# payload is the data as stored, which can be
+			# compressed
+			payload = fd.read(dlen)
+			assert len(payload) == dlen
+			fd.read(padded(dlen) - dlen)
+			self.ops.append(attrdict(tlen = tlen, offset = offset,
+				flags = flags, checksum = csum,
+				payload = payload))
+
+		# trailer
+		trailerfmt = "<QII"
+		self.numops, self.checksum, reserved = struct.unpack(
+				trailerfmt, fd.read(struct.calcsize(trailerfmt)))
+
+	def update_checksums(self):
+		"Recalculates the checksums and lengths from the operations."
+		self.numops = len(self.ops)
+		self.total_len = sum(o.tlen for o in self.ops)
+		self.checksum = 0
+		if self.ver == 1:
+			self.checksum = checksum(self.dump_v1()[:-8])
+			return
+
+		for o in self.ops:
+			o.checksum = checksum(struct.pack("<QQQII", o.tlen,
+				o.offset, len(o.payload), o.flags, 0) +
+				o.payload)
+
+		hdr = self.dump_v2()[:DHS]
+		self.checksum = checksum(''.join(
+			struct.pack("<I", o.checksum) for o in self.ops),
+			checksum(hdr))
+
+	def dump_v1(self):
+		s = struct.pack("!HHI", self.ver, self.flags, self.id)
+		for o in self.ops:
+			s += struct.pack("!IQ", o.tlen, o.offset)
+			s += o.payload
+		s += struct.pack("!IQ", 0, 0)
+		s += struct.pack("!II", self.numops, self.checksum)
+		return s
+
+	def dump_v2(self):
+		s = struct.pack("<HHIQQQ", self.ver, self.flags, 0, self.id,
+				len(self.ops), self.total_len)
+		for o in self.ops:
+			s += struct.pack("<QQQII", o.tlen, o.offset,
+					len(o.payload), o.flags, o.checksum)
+			s += o.payload
+			s += '\0' * (padded(len(o.payload)) - len(o.payload))
+		s += struct.pack("<QII", self.numops, self.checksum, 0)
+		return s
 
 	def save(self):
 		# the lack of integrity checking in this function is
 		# intentional, so we can write broken transactions and see how
 		# jfsck() copes with them
 		fd = open(self.path, 'w')
-		fd.write(struct.pack("!HHI", self.ver, self.flags, self.id))
-		for o in self.ops:
-			fd.write(struct.pack("!IQ", o.tlen, o.offset,))
-			fd.write(o.payload)
-		fd.write(struct.pack("!IQ", 0, 0))
-		fd.write(struct.pack("!II", self.numops, self.checksum))
+		if self.ver == 1:
+			fd.write(self.dump_v1())
+		else:
+			fd.write(self.dump_v2())
 
 	def __repr__(self):
-		return '<TransFile %s: id:%d f:%s n:%d ops:%s>' % \
-			(self.path, self.id, hex(self.flags), self.numops,
-					self.ops)
+		return '<TransFile %s: v:%d id:%d f:%s n:%d ops:%s>' % \
+			(self.path, self.ver, self.id, hex(self.flags),
+					self.numops, self.ops)
 
 
 def gen_ret_seq(seq):
@@ -0,0 +1,149 @@
+
+/*
+ * splice.c - A program to compare writev() and vmsplice()/splice() for
+ * writing the data of operations to the journal, and find the operation size
+ * from which splicing pays off (see jopen_opts.splice_threshold).
+ *
+ * For each operation size, from 4 KB up to the given maximum, it writes the
+ * given amount of data with jpwrite() three times: once with splicing
+ * disabled, once with every operation spliced, and once with the threshold
+ * the library picks with J_SPLICE_AUTO (which does a quicker version of this
+ * same measurement). The rest of the commit is the same in all cases, so the
+ * difference is the cost of writing to the journal.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <string.h>
+#include <libjio.h>
+
+#define FILENAME "test_file"
+
+
+static void help(void)
+{
+	printf("Use: splice towrite maxsize\n");
+	printf("\n");
+	printf(" - towrite: how many MB to write for each size and method\n");
+	printf(" - maxsize: biggest operation size to try, in KB\n");
+}
+
+/* Write mb megabytes in operations of size bytes, with the given
+ * splice_threshold, and return the speed in MB/s, or -1 on error */
+static double run(unsigned long mb, size_t size, size_t splice_threshold)
+{
+	void *buf;
+	jfs_t *fs;
+	off_t towrite, work_done;
+	long secs, usecs;
+	double seconds;
+	struct timeval tv1, tv2;
+	struct jopen_opts opts;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		perror("malloc()");
+		return -1;
+	}
+	memset(buf, 5, size);
+
+	/* we don't want the data syncs to hide the difference, so the
+	 * transactions linger until the fd budget makes us jsync() */
+	memset(&opts, 0, sizeof(opts));
+	opts.jflags = J_LINGER | J_NOROLLBACK;
+	opts.fd_budget = 64;
+	opts.splice_threshold = splice_threshold;
+
+	fs = jopen_ex(FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0600, &opts);
+	if (fs == NULL) {
+		perror("jopen_ex()");
+		free(buf);
+		return -1;
+	}
+
+	towrite = (off_t) mb * 1024 * 1024;
+	work_done = 0;
+
+	gettimeofday(&tv1, NULL);
+
+	while (work_done < towrite) {
+		if (jpwrite(fs, buf, size, work_done) != size) {
+			perror("jpwrite()");
+			break;
+		}
+
+		work_done += size;
+	}
+
+	jsync(fs);
+
+	gettimeofday(&tv2, NULL);
+
+	jclose(fs);
+	free(buf);
+
+	if (work_done < towrite)
+		return -1;
+
+	secs = tv2.tv_sec - tv1.tv_sec;
+	usecs = tv2.tv_usec - tv1.tv_usec;
+
+	if (usecs < 0) {
+		secs -= 1;
+		usecs = 1000000 + usecs;
+	}
+
+	seconds = secs + (usecs / 1000000.0);
+	return mb / seconds;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long mb;
+	size_t size, maxsize, threshold;
+	double writev_speed, splice_speed, auto_speed;
+
+	if (argc != 3) {
+		help();
+		return 1;
+	}
+
+	mb = atoi(argv[1]);
+	maxsize = atoi(argv[2]) * 1024;
+
+	/* the threshold is the smallest size from which splicing is faster
+	 * for all the bigger sizes too */
+	threshold = 0;
+
+	printf("# size writev_MB/s splice_MB/s auto_MB/s\n");
+	for (size = 4 * 1024; size <= maxsize; size *= 2) {
+		writev_speed = run(mb, size, 0);
+		splice_speed = run(mb, size, size);
+		auto_speed = run(mb, size, J_SPLICE_AUTO);
+		if (writev_speed < 0 || splice_speed < 0 || auto_speed < 0)
+			return 1;
+
+		printf("%zu %f %f %f\n", size, writev_speed, splice_speed,
+				auto_speed);
+
+		if (splice_speed > writev_speed) {
+			if (threshold == 0)
+				threshold = size;
+		} else {
+			threshold = 0;
+		}
+	}
+
+	if (threshold)
+		printf("splice_threshold: %zu\n", threshold);
+	else
+		printf("splice_threshold: 0 (splicing never paid off)\n");
+
+	return 0;
+}
+